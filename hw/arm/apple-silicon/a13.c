@@ -27,6 +27,7 @@
 #include "hw/qdev-properties.h"
 #include "hw/resettable.h"
 #include "migration/vmstate.h"
+#include "exec/icount.h"
 #include "qapi/error.h"
 #include "qemu/error-report.h"
 #include "qemu/log.h"
@@ -36,6 +37,9 @@
 #include "system/reset.h"
 #include "arm-powerctl.h"
 #include "target/arm/cpregs.h"
+#include "target/arm/internals.h"
+#include "target/arm/tcg/amx.h"
+#include "trace.h"
 
 #define VMSTATE_A13_CPREG(name) \
     VMSTATE_UINT64(A13_CPREG_VAR_NAME(name), AppleA13State)
@@ -75,6 +79,24 @@
       .writefn = apple_a13_cluster_cpreg_write,                          \
       .fieldoffset = offsetof(AppleA13Cluster, A13_CPREG_VAR_NAME(p_name)) }
 
+#define A13_PMU_CPREG_DEF(p_name, p_op0, p_op1, p_crn, p_crm, p_op2, \
+                          p_writefn)                                 \
+    { .cp = CP_REG_ARM64_SYSREG_CP,                                  \
+      .name = #p_name,                                               \
+      .opc0 = p_op0,                                                 \
+      .crn = p_crn,                                                  \
+      .crm = p_crm,                                                  \
+      .opc1 = p_op1,                                                 \
+      .opc2 = p_op2,                                                 \
+      .access = PL1_RW,                                              \
+      .state = ARM_CP_STATE_AA64,                                    \
+      .type = ARM_CP_OVERRIDE | ARM_CP_IO,                           \
+      .readfn = apple_a13_pmu_read,                                  \
+      .writefn = p_writefn,                                          \
+      .fieldoffset = offsetof(AppleA13State,                         \
+                              A13_CPREG_VAR_NAME(p_name)) -          \
+                     offsetof(ARMCPU, env) }
+
 #define IPI_SR_SRC_CPU_SHIFT 8
 #define IPI_SR_SRC_CPU_WIDTH 8
 #define IPI_SR_SRC_CPU_MASK \
@@ -89,6 +111,22 @@
 #define IPI_RR_TYPE_DEFERRED (2 << 28)
 #define IPI_RR_TYPE_NOWAKE (3 << 28)
 #define IPI_RR_TYPE_MASK (3 << 28)
+/* PMC0 counts core cycles, PMC1 retired instructions */
+#define A13_PMC_MAX ((1ULL << 47) - 1)
+#define A13_PMC_CYCLE_FREQ 1000000000ull /* 1 GHz, as the generic PMU */
+
+#define PMCR0_COUNTER_ENABLE(ctr) BIT_ULL(ctr)
+#define PMCR0_COUNTER_ENABLE_MASK (BIT_ULL(A13_PMC_COUNT) - 1)
+#define PMCR0_INTGEN_MASK (7ULL << 8)
+#define PMCR0_INTGEN_FIQ (4ULL << 8)
+#define PMCR0_PMAI BIT_ULL(11)
+#define PMCR0_PMI_ENABLE(ctr) BIT_ULL(12 + (ctr))
+
+#define PMCR1_EL0_A32_ENABLE(ctr) BIT_ULL(ctr)
+#define PMCR1_EL0_A64_ENABLE(ctr) BIT_ULL(8 + (ctr))
+#define PMCR1_EL1_A64_ENABLE(ctr) BIT_ULL(16 + (ctr))
+#define PMCR1_EL3_A64_ENABLE(ctr) BIT_ULL(24 + (ctr))
+
 #define NSEC_PER_USEC 1000ull /* nanoseconds per microsecond */
 #define USEC_PER_SEC 1000000ull /* microseconds per second */
 #define NSEC_PER_SEC 1000000000ull /* nanoseconds per second */
@@ -220,6 +258,7 @@ static void apple_a13_deliver_ipi(AppleA13State *cpu, uint64_t src_cpu,
         return;
     }
 
+    trace_apple_a13_ipi_deliver(cpu->phys_id, src_cpu, flag >> 28);
     cpu->ipi_sr = 1LL | (src_cpu << IPI_SR_SRC_CPU_SHIFT) | flag;
     qemu_irq_raise(cpu->fast_ipi);
 }
@@ -230,6 +269,83 @@ static void apple_a13_cluster_deliver_ipi(AppleA13Cluster *c, uint64_t cpu_id,
     apple_a13_deliver_ipi(c->cpus[cpu_id], src_cpu, flag);
 }
 
+static AppleA13State *apple_a13_cluster_find_cpu(AppleA13Cluster *c,
+                                                 uint32_t phys_id)
+{
+    AppleA13State *acpu = c->cpus_by_phys[phys_id & 0xFF];
+
+    if (acpu == NULL || acpu->phys_id != phys_id) {
+        return NULL;
+    }
+    return acpu;
+}
+
+static void apple_a13_cluster_update_nowake(AppleA13Cluster *c)
+{
+    uint32_t targets = 0;
+
+    for (uint32_t i = 0; i < A13_MAX_CPU; ++i) {
+        targets |= c->noWakeIPI[i];
+    }
+    c->noWakeTargets = targets;
+}
+
+/* Hand the first no-wake IPI held for `acpu` to it */
+static void apple_a13_cluster_deliver_nowake(AppleA13Cluster *c,
+                                             AppleA13State *acpu)
+{
+    for (uint32_t src = 0; src < A13_MAX_CPU; ++src) {
+        if (c->noWakeIPI[src] & BIT32(acpu->cpu_id)) {
+            apple_a13_deliver_ipi(acpu, src, IPI_RR_TYPE_NOWAKE);
+            return;
+        }
+    }
+}
+
+/*
+ * Called on every exception entry and return, so a CPU leaving WFI picks up
+ * its pending no-wake IPIs without having to wait for the IPI timer.
+ */
+static void apple_a13_ipi_el_change(ARMCPU *cpu, void *opaque)
+{
+    AppleA13Cluster *c = opaque;
+    AppleA13State *acpu = container_of(cpu, AppleA13State, parent_obj);
+
+    if (likely(!(c->noWakeTargets & BIT32(acpu->cpu_id)))) {
+        return;
+    }
+    apple_a13_cluster_deliver_nowake(c, acpu);
+}
+
+static bool apple_a13_ipi_pending(void)
+{
+    AppleA13Cluster *cluster;
+
+    QTAILQ_FOREACH (cluster, &clusters, next) {
+        if (cluster->noWakeTargets) {
+            return true;
+        }
+        for (uint32_t i = 0; i < A13_MAX_CPU; ++i) {
+            if (cluster->deferredIPI[i]) {
+                return true;
+            }
+        }
+    }
+
+    return false;
+}
+
+/* Arm the IPI timer, only if there is something for it to deliver */
+static void apple_a13_ipi_schedule(void)
+{
+    if (ipicr_timer == NULL || ipi_cr == 0 || timer_pending(ipicr_timer) ||
+        !apple_a13_ipi_pending()) {
+        return;
+    }
+
+    timer_mod_ns(ipicr_timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + ipi_cr);
+}
+
 static int apple_a13_cluster_pre_save(void *opaque)
 {
     AppleA13Cluster *cluster = opaque;
@@ -241,6 +357,8 @@ static int apple_a13_cluster_post_load(void *opaque, int version_id)
 {
     AppleA13Cluster *cluster = opaque;
     ipi_cr = cluster->ipi_cr;
+    apple_a13_cluster_update_nowake(cluster);
+    apple_a13_ipi_schedule();
     return 0;
 }
 
@@ -249,6 +367,7 @@ static void apple_a13_cluster_reset(DeviceState *dev)
     AppleA13Cluster *cluster = APPLE_A13_CLUSTER(dev);
     memset(cluster->deferredIPI, 0, sizeof(cluster->deferredIPI));
     memset(cluster->noWakeIPI, 0, sizeof(cluster->noWakeIPI));
+    cluster->noWakeTargets = 0;
 }
 
 static int add_cpu_to_cluster(Object *obj, void *opaque)
@@ -263,6 +382,9 @@ static int add_cpu_to_cluster(Object *obj, void *opaque)
 
     acpu->parent_obj.parent_obj.cluster_index = cluster->parent_obj.cluster_id;
     cluster->cpus[acpu->cpu_id] = acpu;
+    cluster->cpus_by_phys[acpu->phys_id & 0xFF] = acpu;
+    arm_register_el_change_hook(&acpu->parent_obj, apple_a13_ipi_el_change,
+                                cluster);
     return 0;
 }
 
@@ -319,7 +441,7 @@ static void apple_a13_cluster_ipicr_tick(void *opaque)
         apple_a13_cluster_tick(cluster);
     }
 
-    timer_mod_ns(ipicr_timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + ipi_cr);
+    apple_a13_ipi_schedule();
 }
 
 
@@ -332,7 +454,6 @@ static void apple_a13_cluster_reset_handler(void *opaque)
         ipicr_timer = timer_new_ns(QEMU_CLOCK_VIRTUAL,
                                    apple_a13_cluster_ipicr_tick, NULL);
     }
-    timer_mod_ns(ipicr_timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + ipi_cr);
 }
 
 static void apple_a13_cluster_instance_init(Object *obj)
@@ -345,38 +466,31 @@ static void apple_a13_cluster_instance_init(Object *obj)
     }
 }
 
-/* Deliver local IPI */
-static void apple_a13_ipi_rr_local(CPUARMState *env, const ARMCPRegInfo *ri,
-                                   uint64_t value)
+static void apple_a13_ipi_rr(AppleA13State *acpu, AppleA13Cluster *c,
+                             uint64_t value, const char *scope)
 {
-    AppleA13State *acpu =
-        container_of(env_archcpu(env), AppleA13State, parent_obj);
+    uint32_t phys_id = (value & 0xFF) | (c->parent_obj.cluster_id << 8);
+    AppleA13State *dst_acpu = apple_a13_cluster_find_cpu(c, phys_id);
+    uint32_t dst_cpu_id;
 
-    uint32_t phys_id = (value & 0xFF) | (acpu->cluster_id << 8);
-    AppleA13Cluster *c = apple_a13_find_cluster(acpu->cluster_id);
-    uint32_t dst_cpu_id = -1U;
-    AppleA13State *dst_acpu;
-
-    for (uint32_t i = 0; i < A13_MAX_CPU; i++) {
-        if (c->cpus[i] != NULL && c->cpus[i]->phys_id == phys_id) {
-            dst_cpu_id = i;
-            dst_acpu = c->cpus[dst_cpu_id];
-            break;
-        }
-    }
-
-    if (dst_cpu_id == -1U) {
+    if (dst_acpu == NULL) {
         qemu_log_mask(LOG_GUEST_ERROR,
-                      "CPU %x failed to send fast IPI to local CPU %x: value: "
+                      "CPU %x failed to send fast IPI to %s CPU %x: value: "
                       "0x" HWADDR_FMT_plx "\n",
-                      acpu->phys_id, phys_id, value);
+                      acpu->phys_id, scope, phys_id, value);
         return;
     }
 
+    dst_cpu_id = dst_acpu->cpu_id;
+    trace_apple_a13_ipi_send(acpu->phys_id, phys_id,
+                             (value & IPI_RR_TYPE_MASK) >> 28);
+
     switch (value & IPI_RR_TYPE_MASK) {
     case IPI_RR_TYPE_NOWAKE:
         if (apple_a13_is_asleep(dst_acpu)) {
             c->noWakeIPI[acpu->cpu_id] |= BIT32(dst_cpu_id);
+            c->noWakeTargets |= BIT32(dst_cpu_id);
+            apple_a13_ipi_schedule();
         } else {
             apple_a13_deliver_ipi(dst_acpu, acpu->cpu_id,
                                   IPI_RR_TYPE_IMMEDIATE);
@@ -384,10 +498,12 @@ static void apple_a13_ipi_rr_local(CPUARMState *env, const ARMCPRegInfo *ri,
         break;
     case IPI_RR_TYPE_DEFERRED:
         c->deferredIPI[acpu->cpu_id] |= BIT32(dst_cpu_id);
+        apple_a13_ipi_schedule();
         break;
     case IPI_RR_TYPE_RETRACT:
         c->deferredIPI[acpu->cpu_id] &= ~BIT32(dst_cpu_id);
         c->noWakeIPI[acpu->cpu_id] &= ~BIT32(dst_cpu_id);
+        apple_a13_cluster_update_nowake(c);
         break;
     case IPI_RR_TYPE_IMMEDIATE:
         apple_a13_deliver_ipi(dst_acpu, acpu->cpu_id, IPI_RR_TYPE_IMMEDIATE);
@@ -397,6 +513,17 @@ static void apple_a13_ipi_rr_local(CPUARMState *env, const ARMCPRegInfo *ri,
     }
 }
 
+/* Deliver local IPI */
+static void apple_a13_ipi_rr_local(CPUARMState *env, const ARMCPRegInfo *ri,
+                                   uint64_t value)
+{
+    AppleA13State *acpu =
+        container_of(env_archcpu(env), AppleA13State, parent_obj);
+
+    apple_a13_ipi_rr(acpu, apple_a13_find_cluster(acpu->cluster_id), value,
+                     "local");
+}
+
 /* Deliver global IPI */
 static void apple_a13_ipi_rr_global(CPUARMState *env, const ARMCPRegInfo *ri,
                                     uint64_t value)
@@ -409,48 +536,7 @@ static void apple_a13_ipi_rr_global(CPUARMState *env, const ARMCPRegInfo *ri,
         return;
     }
 
-    uint32_t phys_id = (value & 0xFF) | (cluster_id << 8);
-    uint32_t dst_cpu_id = -1;
-    AppleA13State *dst_acpu;
-
-    for (uint32_t i = 0; i < A13_MAX_CPU; i++) {
-        if (cluster->cpus[i] != NULL && cluster->cpus[i]->phys_id == phys_id) {
-            dst_cpu_id = i;
-            dst_acpu = cluster->cpus[dst_cpu_id];
-            break;
-        }
-    }
-
-    if (dst_cpu_id == -1U) {
-        qemu_log_mask(LOG_GUEST_ERROR,
-                      "CPU %x failed to send fast IPI to global CPU %x: value: "
-                      "0x" HWADDR_FMT_plx "\n",
-                      acpu->phys_id, phys_id, value);
-        return;
-    }
-
-    switch (value & IPI_RR_TYPE_MASK) {
-    case IPI_RR_TYPE_NOWAKE:
-        if (apple_a13_is_asleep(dst_acpu)) {
-            cluster->noWakeIPI[acpu->cpu_id] |= BIT32(dst_cpu_id);
-        } else {
-            apple_a13_deliver_ipi(dst_acpu, acpu->cpu_id,
-                                  IPI_RR_TYPE_IMMEDIATE);
-        }
-        break;
-    case IPI_RR_TYPE_DEFERRED:
-        cluster->deferredIPI[acpu->cpu_id] |= BIT32(dst_cpu_id);
-        break;
-    case IPI_RR_TYPE_RETRACT:
-        cluster->deferredIPI[acpu->cpu_id] &= ~BIT32(dst_cpu_id);
-        cluster->noWakeIPI[acpu->cpu_id] &= ~BIT32(dst_cpu_id);
-        break;
-    case IPI_RR_TYPE_IMMEDIATE:
-        apple_a13_deliver_ipi(dst_acpu, acpu->cpu_id, IPI_RR_TYPE_IMMEDIATE);
-        break;
-    default:
-        g_assert_not_reached();
-    }
+    apple_a13_ipi_rr(acpu, cluster, value, "global");
 }
 
 /* Receiving IPI */
@@ -471,12 +557,14 @@ static void apple_a13_ipi_write_sr(CPUARMState *env, const ARMCPRegInfo *ri,
     AppleA13Cluster *c = apple_a13_find_cluster(acpu->cluster_id);
     uint64_t src_cpu = IPI_SR_SRC_CPU(value);
 
+    trace_apple_a13_ipi_ack(acpu->phys_id, src_cpu);
     acpu->ipi_sr = 0;
     qemu_irq_lower(acpu->fast_ipi);
 
     switch (value & IPI_RR_TYPE_MASK) {
     case IPI_RR_TYPE_NOWAKE:
         c->noWakeIPI[src_cpu] &= ~BIT32(acpu->cpu_id);
+        apple_a13_cluster_update_nowake(c);
         break;
     case IPI_RR_TYPE_DEFERRED:
         c->deferredIPI[src_cpu] &= ~BIT32(acpu->cpu_id);
@@ -484,6 +572,10 @@ static void apple_a13_ipi_write_sr(CPUARMState *env, const ARMCPRegInfo *ri,
     default:
         break;
     }
+
+    if (c->noWakeTargets & BIT32(acpu->cpu_id)) {
+        apple_a13_cluster_deliver_nowake(c, acpu);
+    }
 }
 
 /* Read deferred interrupt timeout (global) */
@@ -500,18 +592,181 @@ static void apple_a13_ipi_write_cr(CPUARMState *env, const ARMCPRegInfo *ri,
                                    uint64_t value)
 {
     uint64_t nanosec = 0;
-    uint64_t ct = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
 
     if (value != 0) {
         absolutetime_to_nanoseconds(value & 0xFFFF, &nanosec);
     }
 
-    if (nanosec == 0) {
-        timer_del(ipicr_timer);
+    ipi_cr = nanosec;
+    timer_del(ipicr_timer);
+    apple_a13_ipi_schedule();
+}
+
+static uint64_t *apple_a13_pmc(AppleA13State *acpu, uint32_t ctr)
+{
+    return ctr ? &acpu->A13_CPREG_VAR_NAME(PMC1) :
+                 &acpu->A13_CPREG_VAR_NAME(PMC0);
+}
+
+/* Retired instructions are exact with -icount, otherwise one per cycle */
+static bool apple_a13_pmc_uses_icount(uint32_t ctr)
+{
+    return ctr == 1 && icount_enabled() == ICOUNT_PRECISE;
+}
+
+static uint64_t apple_a13_pmc_source(uint32_t ctr)
+{
+    if (apple_a13_pmc_uses_icount(ctr)) {
+        return icount_get_raw();
+    }
+    return muldiv64(qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL), A13_PMC_CYCLE_FREQ,
+                    NANOSECONDS_PER_SECOND);
+}
+
+static int64_t apple_a13_pmc_ns_per(uint32_t ctr, uint64_t count)
+{
+    if (apple_a13_pmc_uses_icount(ctr)) {
+        return icount_to_ns(count);
+    }
+    return muldiv64(count, NANOSECONDS_PER_SECOND, A13_PMC_CYCLE_FREQ);
+}
+
+static bool apple_a13_pmc_counting(AppleA13State *acpu, uint32_t ctr)
+{
+    CPUARMState *env = &acpu->parent_obj.env;
+    uint64_t pmcr1 = acpu->A13_CPREG_VAR_NAME(PMCR1);
+
+    if (!(acpu->A13_CPREG_VAR_NAME(PMCR0) & PMCR0_COUNTER_ENABLE(ctr))) {
+        return false;
+    }
+
+    switch (arm_current_el(env)) {
+    case 0:
+        return pmcr1 & (is_a64(env) ? PMCR1_EL0_A64_ENABLE(ctr) :
+                                      PMCR1_EL0_A32_ENABLE(ctr));
+    case 1:
+    case 2:
+        return pmcr1 & PMCR1_EL1_A64_ENABLE(ctr);
+    default:
+        return pmcr1 & PMCR1_EL3_A64_ENABLE(ctr);
+    }
+}
+
+static void apple_a13_pmu_update_irq(AppleA13State *acpu)
+{
+    uint64_t pmcr0 = acpu->A13_CPREG_VAR_NAME(PMCR0);
+
+    qemu_set_irq(acpu->pmi, (pmcr0 & PMCR0_PMAI) &&
+                                (pmcr0 & PMCR0_INTGEN_MASK) ==
+                                    PMCR0_INTGEN_FIQ);
+}
+
+/*
+ * Fold everything counted since the last sync into PMC0/PMC1 and latch
+ * overflows into PMSR, raising a PMI for counters that asked for one.
+ */
+static void apple_a13_pmu_sync(AppleA13State *acpu)
+{
+    uint64_t *pmcr0 = &acpu->A13_CPREG_VAR_NAME(PMCR0);
+
+    for (uint32_t ctr = 0; ctr < A13_PMC_COUNT; ++ctr) {
+        uint64_t *pmc = apple_a13_pmc(acpu, ctr);
+        uint64_t now = apple_a13_pmc_source(ctr);
+
+        if (apple_a13_pmc_counting(acpu, ctr)) {
+            *pmc += now - acpu->pmc_last[ctr];
+        }
+        acpu->pmc_last[ctr] = now;
+
+        if (*pmc > A13_PMC_MAX) {
+            *pmc &= A13_PMC_MAX;
+            acpu->A13_CPREG_VAR_NAME(PMSR) |= BIT_ULL(ctr);
+            if (*pmcr0 & PMCR0_PMI_ENABLE(ctr)) {
+                *pmcr0 |= PMCR0_PMAI;
+            }
+        }
+    }
+
+    apple_a13_pmu_update_irq(acpu);
+}
+
+/*
+ * Arm the PMI timer for the first counter due to overflow. The EL filter
+ * in PMCR1 is ignored here; an early expiry just syncs and re-arms.
+ */
+static void apple_a13_pmu_schedule(AppleA13State *acpu)
+{
+    uint64_t pmcr0 = acpu->A13_CPREG_VAR_NAME(PMCR0);
+    int64_t delta = INT64_MAX;
+
+    for (uint32_t ctr = 0; ctr < A13_PMC_COUNT; ++ctr) {
+        uint64_t remaining;
+
+        if (!(pmcr0 & PMCR0_COUNTER_ENABLE(ctr)) ||
+            !(pmcr0 & PMCR0_PMI_ENABLE(ctr))) {
+            continue;
+        }
+        remaining = A13_PMC_MAX + 1 - *apple_a13_pmc(acpu, ctr);
+        delta = MIN(delta, apple_a13_pmc_ns_per(ctr, remaining));
+    }
+
+    if (delta == INT64_MAX) {
+        timer_del(acpu->pmi_timer);
     } else {
-        timer_mod_ns(ipicr_timer, ct + nanosec);
+        timer_mod_ns(acpu->pmi_timer,
+                     qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + delta);
     }
-    ipi_cr = nanosec;
+}
+
+static void apple_a13_pmi_tick(void *opaque)
+{
+    AppleA13State *acpu = opaque;
+
+    apple_a13_pmu_sync(acpu);
+    apple_a13_pmu_schedule(acpu);
+}
+
+/* Account the counts of the EL being left before the PMCR1 filter changes */
+static void apple_a13_pmu_pre_el_change(ARMCPU *cpu, void *opaque)
+{
+    AppleA13State *acpu = opaque;
+
+    if (acpu->A13_CPREG_VAR_NAME(PMCR0) & PMCR0_COUNTER_ENABLE_MASK) {
+        apple_a13_pmu_sync(acpu);
+    }
+}
+
+static uint64_t apple_a13_amx_status_read(CPUARMState *env,
+                                          const ARMCPRegInfo *ri)
+{
+    return env->amx.active ? AMX_STATUS_ACTIVE : 0;
+}
+
+static uint64_t apple_a13_pmu_read(CPUARMState *env, const ARMCPRegInfo *ri)
+{
+    AppleA13State *acpu =
+        container_of(env_archcpu(env), AppleA13State, parent_obj);
+
+    apple_a13_pmu_sync(acpu);
+    return raw_read(env, ri);
+}
+
+static void apple_a13_pmu_write(CPUARMState *env, const ARMCPRegInfo *ri,
+                                uint64_t value)
+{
+    AppleA13State *acpu =
+        container_of(env_archcpu(env), AppleA13State, parent_obj);
+
+    apple_a13_pmu_sync(acpu);
+    raw_write(env, ri, value);
+    apple_a13_pmu_update_irq(acpu);
+    apple_a13_pmu_schedule(acpu);
+}
+
+static void apple_a13_pmc_write(CPUARMState *env, const ARMCPRegInfo *ri,
+                                uint64_t value)
+{
+    apple_a13_pmu_write(env, ri, value & A13_PMC_MAX);
 }
 
 static const ARMCPRegInfo apple_a13_cp_reginfo_tcg[] = {
@@ -542,14 +797,38 @@ static const ARMCPRegInfo apple_a13_cp_reginfo_tcg[] = {
     A13_CPREG_DEF(IMP_BARRIER_LBSY_BST_SYNC_W1_EL0, 3, 3, 15, 15, 1, PL1_RW, 0),
     A13_CPREG_DEF(ARM64_REG_3_3_15_7, 3, 3, 15, 7, 0, PL1_RW,
                   0x8000000000332211ULL),
-    A13_CPREG_DEF(PMC0, 3, 2, 15, 0, 0, PL1_RW, 0),
-    A13_CPREG_DEF(PMC1, 3, 2, 15, 1, 0, PL1_RW, 0),
-    A13_CPREG_DEF(PMCR0, 3, 1, 15, 0, 0, PL1_RW, 0),
-    A13_CPREG_DEF(PMCR1, 3, 1, 15, 1, 0, PL1_RW, 0),
-    A13_CPREG_DEF(PMSR, 3, 1, 15, 13, 0, PL1_RW, 0),
+    A13_PMU_CPREG_DEF(PMC0, 3, 2, 15, 0, 0, apple_a13_pmc_write),
+    A13_PMU_CPREG_DEF(PMC1, 3, 2, 15, 1, 0, apple_a13_pmc_write),
+    A13_PMU_CPREG_DEF(PMCR0, 3, 1, 15, 0, 0, apple_a13_pmu_write),
+    A13_PMU_CPREG_DEF(PMCR1, 3, 1, 15, 1, 0, apple_a13_pmu_write),
+    A13_PMU_CPREG_DEF(PMSR, 3, 1, 15, 13, 0, apple_a13_pmu_write),
     A13_CPREG_DEF(S3_4_c15_c0_5, 3, 4, 15, 0, 5, PL1_RW, 0),
-    A13_CPREG_DEF(AMX_STATUS_EL1, 3, 4, 15, 1, 3, PL1_R, 0),
-    A13_CPREG_DEF(AMX_CTL_EL1, 3, 4, 15, 1, 4, PL1_RW, 0),
+    {
+        .cp = CP_REG_ARM64_SYSREG_CP,
+        .name = "AMX_STATUS_EL1",
+        .opc0 = 3,
+        .opc1 = 4,
+        .crn = 15,
+        .crm = 1,
+        .opc2 = 3,
+        .access = PL1_R,
+        .type = ARM_CP_OVERRIDE | ARM_CP_NO_RAW,
+        .state = ARM_CP_STATE_AA64,
+        .readfn = apple_a13_amx_status_read,
+    },
+    {
+        .cp = CP_REG_ARM64_SYSREG_CP,
+        .name = "AMX_CTL_EL1",
+        .opc0 = 3,
+        .opc1 = 4,
+        .crn = 15,
+        .crm = 1,
+        .opc2 = 4,
+        .access = PL1_RW,
+        .type = ARM_CP_OVERRIDE,
+        .state = ARM_CP_STATE_AA64,
+        .fieldoffset = offsetof(CPUARMState, amx.ctl),
+    },
     A13_CPREG_DEF(ARM64_REG_CPU_OVRD, 3, 5, 15, 5, 0, PL1_RW, 0),
     A13_CPREG_DEF(ARM64_REG_ACC_OVRD, 3, 5, 15, 6, 0, PL1_RW, 0),
     A13_CPREG_DEF(ARM64_REG_ACC_CFG, 3, 5, 15, 4, 0, PL1_RW, 0),
@@ -641,6 +920,9 @@ static void apple_a13_realize(DeviceState *dev, Error **errp)
     if (*errp) {
         return;
     }
+    if (acpu->amx) {
+        set_feature(&acpu->parent_obj.env, ARM_FEATURE_AMX);
+    }
     apple_a13_add_cpregs(acpu);
     tclass->parent_realize(dev, errp);
     if (*errp) {
@@ -658,19 +940,42 @@ static void apple_a13_realize(DeviceState *dev, Error **errp)
 
     qdev_connect_gpio_out(dev, GTIMER_VIRT, qdev_get_gpio_in(fiq_or, 0));
     acpu->fast_ipi = qdev_get_gpio_in(fiq_or, 1);
+    acpu->pmi = qdev_get_gpio_in(fiq_or, 2);
+
+    acpu->pmi_timer =
+        timer_new_ns(QEMU_CLOCK_VIRTUAL, apple_a13_pmi_tick, acpu);
+    arm_register_pre_el_change_hook(&acpu->parent_obj,
+                                    apple_a13_pmu_pre_el_change, acpu);
 }
 
 static void apple_a13_reset_hold(Object *obj, ResetType type)
 {
+    AppleA13State *acpu = APPLE_A13(obj);
     AppleA13Class *tclass = APPLE_A13_GET_CLASS(obj);
     if (tclass->parent_phases.hold != NULL) {
         tclass->parent_phases.hold(obj, type);
     }
+
+    if (acpu->pmi_timer != NULL) {
+        timer_del(acpu->pmi_timer);
+        for (uint32_t ctr = 0; ctr < A13_PMC_COUNT; ++ctr) {
+            acpu->pmc_last[ctr] = apple_a13_pmc_source(ctr);
+        }
+        apple_a13_pmu_update_irq(acpu);
+    }
 }
 
 static void apple_a13_instance_init(Object *obj)
 {
+    AppleA13State *acpu = APPLE_A13(obj);
+
     object_property_set_uint(obj, "cntfrq", 24000000, &error_fatal);
+    object_property_add_uint64_ptr(obj, "sprr-tlb-flushes",
+                                   &acpu->sprr_tlb_flushes,
+                                   OBJ_PROP_FLAG_READ);
+    object_property_add_uint64_ptr(obj, "sprr-tlb-flushes-skipped",
+                                   &acpu->sprr_tlb_flushes_skipped,
+                                   OBJ_PROP_FLAG_READ);
 }
 
 AppleA13State *apple_a13_create(const char *name, uint32_t cpu_id,
@@ -758,10 +1063,23 @@ static const Property apple_a13_cluster_properties[] = {
     DEFINE_PROP_UINT32("cluster-type", AppleA13Cluster, cluster_type, 0),
 };
 
+static int apple_a13_post_load(void *opaque, int version_id)
+{
+    AppleA13State *acpu = opaque;
+
+    for (uint32_t ctr = 0; ctr < A13_PMC_COUNT; ++ctr) {
+        acpu->pmc_last[ctr] = apple_a13_pmc_source(ctr);
+    }
+    apple_a13_pmu_update_irq(acpu);
+    apple_a13_pmu_schedule(acpu);
+    return 0;
+}
+
 static const VMStateDescription vmstate_apple_a13 = {
     .name = "AppleA13State",
     .version_id = 1,
     .minimum_version_id = 1,
+    .post_load = apple_a13_post_load,
     .fields =
         (const VMStateField[]){
             VMSTATE_A13_CPREG(ARM64_REG_EHID3),
@@ -791,8 +1109,8 @@ static const VMStateDescription vmstate_apple_a13 = {
             VMSTATE_A13_CPREG(PMCR1),
             VMSTATE_A13_CPREG(PMSR),
             VMSTATE_A13_CPREG(S3_4_c15_c0_5),
-            VMSTATE_A13_CPREG(AMX_STATUS_EL1),
-            VMSTATE_A13_CPREG(AMX_CTL_EL1),
+            VMSTATE_UNUSED(sizeof(uint64_t)), /* was AMX_STATUS_EL1 */
+            VMSTATE_UINT64(parent_obj.env.amx.ctl, AppleA13State),
             VMSTATE_A13_CPREG(ARM64_REG_CPU_OVRD),
             VMSTATE_A13_CPREG(ARM64_REG_ACC_OVRD),
             VMSTATE_A13_CPREG(ARM64_REG_ACC_CFG),
@@ -828,6 +1146,10 @@ static const VMStateDescription vmstate_apple_a13_cluster = {
         }
 };
 
+static const Property apple_a13_properties[] = {
+    DEFINE_PROP_BOOL("amx", AppleA13State, amx, false),
+};
+
 static void apple_a13_class_init(ObjectClass *klass, const void *data)
 {
     ResettableClass *rc = RESETTABLE_CLASS(klass);
@@ -839,6 +1161,7 @@ static void apple_a13_class_init(ObjectClass *klass, const void *data)
                                        &tc->parent_phases);
     dc->desc = "Apple A13 CPU";
     dc->vmsd = &vmstate_apple_a13;
+    device_class_set_props(dc, apple_a13_properties);
     set_bit(DEVICE_CATEGORY_CPU, dc->categories);
 }
 
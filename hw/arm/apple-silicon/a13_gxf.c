@@ -24,6 +24,7 @@
 #include "target/arm/cpregs.h"
 #include "target/arm/cpu.h"
 #include "target/arm/internals.h"
+#include "trace.h"
 
 static CPAccessResult access_gxf(CPUARMState *env, const ARMCPRegInfo *ri,
                                  bool isread)
@@ -142,13 +143,46 @@ static void far_el1_write(CPUARMState *env, const ARMCPRegInfo *ri,
     }
 }
 
+/*
+ * Only flush the EL0 TLB when an SPRR index whose permissions changed may
+ * have been used to fill it; XNU rewrites the register on every context
+ * switch, usually with the value it already holds.
+ */
+static void sprr_perm_el0_update(CPUARMState *env, uint64_t old_perm,
+                                 uint64_t perm)
+{
+    AppleA13State *acpu =
+        container_of(env_archcpu(env), AppleA13State, parent_obj);
+    uint32_t changed = 0;
+    bool flush;
+
+    for (int i = 0; i < 16; i++) {
+        if (SPRR_EXTRACT_IDX_ATTR(old_perm ^ perm, i)) {
+            changed |= BIT(i);
+        }
+    }
+
+    flush = (changed & env->sprr.el0_tlb_idx) != 0;
+    trace_apple_a13_sprr_perm_el0(old_perm, perm, changed, flush);
+    if (!flush) {
+        acpu->sprr_tlb_flushes_skipped++;
+        return;
+    }
+
+    acpu->sprr_tlb_flushes++;
+    env->sprr.el0_tlb_idx = 0;
+    tlb_flush_by_mmuidx(env_cpu(env), ARMMMUIdxBit_E10_0);
+}
+
 static void sprr_perm_el0_write(CPUARMState *env, const ARMCPRegInfo *ri,
                                 uint64_t value)
 {
-    uint64_t perm = raw_read(env, ri);
+    uint64_t old_perm = raw_read(env, ri);
+    uint64_t perm = old_perm;
     uint32_t mask = env->sprr.mprr_el_br_el1[0][0];
     if (arm_current_el(env)) {
         raw_write(env, ri, value);
+        sprr_perm_el0_update(env, old_perm, value);
         return;
     }
 
@@ -168,8 +202,7 @@ static void sprr_perm_el0_write(CPUARMState *env, const ARMCPRegInfo *ri,
     }
 
     raw_write(env, ri, perm);
-
-    tlb_flush_by_mmuidx(env_cpu(env), ARMMMUIdxBit_E10_0);
+    sprr_perm_el0_update(env, old_perm, perm);
 }
 
 static uint64_t gxf_cpreg_raw_read(CPUARMState *env, const ARMCPRegInfo *ri)
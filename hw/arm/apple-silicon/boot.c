@@ -23,14 +23,18 @@
 #include "hw/arm/apple-silicon/boot.h"
 #include "hw/arm/apple-silicon/dt.h"
 #include "hw/arm/apple-silicon/mem.h"
+#include "migration/vmstate.h"
 #include "qapi/error.h"
+#include "qemu/bitops.h"
 #include "qemu/cutils.h"
 #include "qemu/error-report.h"
 #include "qemu/guest-random.h"
+#include "qemu/timer.h"
+#include "qemu/units.h"
 #include "system/memory.h"
-#include "img4.h"
 #include "lzfse.h"
 #include "lzss.h"
+#include "trace.h"
 
 #if 0
 #define DINFO(fmt, ...) info_report(fmt, ##__VA_ARGS__)
@@ -338,182 +342,377 @@ static void apple_boot_process_dt_node(AppleDTNode *node, AppleDTNode *parent)
     }
 }
 
-/*
- * @param payload_type must be at least 4 bytes long
- */
-static void extract_im4p_payload(const char *filename, char *payload_type,
-                                 uint8_t **data, uint32_t *length,
-                                 uint8_t **secure_monitor)
+typedef enum {
+    IM4P_UNCOMPRESSED = 0,
+    IM4P_LZFSE,
+    IM4P_LZSS,
+} AppleIm4pCompression;
+
+typedef struct {
+    const char *filename;
+    GMappedFile *file;
+    /// Payload as stored in the file, pointing into the mapping.
+    const uint8_t *payload;
+    size_t payload_len;
+    char type[5];
+    AppleIm4pCompression compression;
+    /// Decompressed payload, when it could not be streamed elsewhere.
+    uint8_t *decoded;
+    size_t decoded_capacity;
+    int64_t start_ns;
+} AppleIm4p;
+
+#define DER_IA5_STRING (0x16)
+#define DER_OCTET_STRING (0x04)
+#define DER_SEQUENCE (0x30)
+
+#define LZFSE_ENDOFSTREAM_BLOCK_MAGIC (0x24787662) // bvx$
+#define LZFSE_UNCOMPRESSED_BLOCK_MAGIC (0x2D787662) // bvx-
+#define LZFSE_COMPRESSEDV2_BLOCK_MAGIC (0x32787662) // bvx2
+#define LZFSE_COMPRESSEDLZVN_BLOCK_MAGIC (0x6E787662) // bvxn
+
+static bool der_read_header(const uint8_t **pos, const uint8_t *end,
+                            uint8_t tag, size_t *len)
 {
-    uint8_t *file_data;
-    gsize fsize;
-    char errorDescription[ASN1_MAX_ERROR_DESCRIPTION_SIZE];
-    asn1_node img4_definitions = NULL;
-    asn1_node img4;
-    int ret;
-    char magic[4];
-    char description[128];
-    int len;
-    uint8_t *payload_data;
-
-    if (!g_file_get_contents(filename, (gchar **)&file_data, &fsize, NULL)) {
-        error_setg(&error_fatal, "file read for `%s` failed", filename);
-        return;
+    const uint8_t *p = *pos;
+    size_t n;
+    size_t l;
+
+    if (end - p < 2 || *p++ != tag) {
+        return false;
     }
 
-    if (asn1_array2tree(img4_definitions_array, &img4_definitions,
-                        errorDescription) != ASN1_SUCCESS) {
-        error_setg(&error_fatal, "ASN.1 parser initialisation failed: `%s`.",
-                   errorDescription);
-        return;
+    l = *p++;
+    if (l & 0x80) {
+        n = l & 0x7F;
+        if (n == 0 || n > sizeof(size_t) || end - p < n) {
+            return false;
+        }
+        for (l = 0; n > 0; n--) {
+            l = (l << 8) | *p++;
+        }
     }
 
-    ret = asn1_create_element(img4_definitions, "Img4.Img4Payload", &img4);
-    if (ret != ASN1_SUCCESS) {
-        error_setg(&error_fatal, "Img4Payload element creation failed: %d",
-                   ret);
-        return;
+    if (l > end - p) {
+        return false;
     }
 
-    ret =
-        asn1_der_decoding(&img4, file_data, (uint32_t)fsize, errorDescription);
-    if (ret != ASN1_SUCCESS) {
-        *data = file_data;
-        *length = (uint32_t)fsize;
-        strncpy(payload_type, "raw", 4);
-        asn1_delete_structure(&img4);
-        asn1_delete_structure(&img4_definitions);
+    *pos = p;
+    *len = l;
+    return true;
+}
+
+/*
+ * Map the file and locate the IM4P payload inside of it without copying.
+ * Files that are not an IM4P are treated as a `raw` payload.
+ */
+static void apple_boot_im4p_open(AppleIm4p *im4p, const char *filename)
+{
+    const uint8_t *pos;
+    const uint8_t *end;
+    GError *gerr = NULL;
+    size_t len;
+
+    *im4p = (AppleIm4p){ .filename = filename, .start_ns = get_clock() };
+
+    im4p->file = g_mapped_file_new(filename, false, &gerr);
+    if (im4p->file == NULL) {
+        error_setg(&error_fatal, "file read for `%s` failed: %s", filename,
+                   gerr->message);
+        g_error_free(gerr);
         return;
     }
 
-    len = 4;
-    ret = asn1_read_value(img4, "magic", magic, &len);
-    if (ret != ASN1_SUCCESS) {
-        error_setg(&error_fatal, "im4p magic read for `%s` failed: %d.",
-                   filename, ret);
+    pos = (const uint8_t *)g_mapped_file_get_contents(im4p->file);
+    end = pos + g_mapped_file_get_length(im4p->file);
+
+    im4p->payload = pos;
+    im4p->payload_len = end - pos;
+    strcpy(im4p->type, "raw");
+
+    if (!der_read_header(&pos, end, DER_SEQUENCE, &len)) {
         return;
     }
+    end = pos + len;
 
-    if (memcmp(magic, "IM4P", 4) != 0) {
-        error_setg(&error_fatal, "`%s` is not an img4 payload.", filename);
+    if (!der_read_header(&pos, end, DER_IA5_STRING, &len) || len != 4 ||
+        memcmp(pos, "IM4P", 4) != 0) {
         return;
     }
+    pos += len;
 
-    len = 4;
-    ret = asn1_read_value(img4, "type", payload_type, &len);
-    if (ret != ASN1_SUCCESS) {
-        error_setg(&error_fatal, "img4 payload type read for `%s` failed: %d.",
-                   filename, ret);
+    if (!der_read_header(&pos, end, DER_IA5_STRING, &len) || len > 4) {
+        error_setg(&error_fatal, "img4 payload type read for `%s` failed.",
+                   filename);
         return;
     }
+    memset(im4p->type, 0, sizeof(im4p->type));
+    memcpy(im4p->type, pos, len);
+    pos += len;
 
-    len = 128;
-    ret = asn1_read_value(img4, "description", description, &len);
-    if (ret != ASN1_SUCCESS) {
+    if (!der_read_header(&pos, end, DER_IA5_STRING, &len)) {
         error_setg(&error_fatal,
-                   "img4 payload description read for `%s` failed: %d.",
-                   filename, ret);
+                   "img4 payload description read for `%s` failed.", filename);
         return;
     }
+    pos += len;
 
-    len = 0;
-    ret = asn1_read_value(img4, "data", NULL, &len);
-    if (ret != ASN1_MEM_ERROR) {
-        error_setg(&error_fatal, "img4 payload size read for `%s` failed: %d.",
-                   filename, ret);
+    if (!der_read_header(&pos, end, DER_OCTET_STRING, &len)) {
+        error_setg(&error_fatal, "img4 payload read for `%s` failed.",
+                   filename);
         return;
     }
 
-    payload_data = g_malloc0(len);
-    ret = asn1_read_value(img4, "data", payload_data, &len);
-    g_free(file_data);
+    im4p->payload = pos;
+    im4p->payload_len = len;
 
-    if (ret != ASN1_SUCCESS) {
-        error_setg(&error_fatal, "img4 payload read for `%s` failed: %d.",
-                   filename, ret);
-        return;
+    if (len >= 4 && memcmp(pos, "bvx", 3) == 0) {
+        im4p->compression = IM4P_LZFSE;
+    } else if (len >= sizeof(LzssCompHeader) &&
+               memcmp(pos, "complzss", 8) == 0) {
+        im4p->compression = IM4P_LZSS;
     }
+}
 
-    asn1_delete_structure(&img4);
-    asn1_delete_structure(&img4_definitions);
+static void apple_boot_im4p_close(AppleIm4p *im4p)
+{
+    trace_apple_boot_load_image(
+        im4p->filename, im4p->type, g_mapped_file_get_length(im4p->file),
+        im4p->payload_len, im4p->decoded_capacity,
+        (get_clock() - im4p->start_ns) / SCALE_US);
+
+    g_free(im4p->decoded);
+    g_mapped_file_unref(im4p->file);
+    *im4p = (AppleIm4p){ 0 };
+}
 
-    if (memcmp(payload_data, "bvx", 3) == 0) {
-        size_t decode_buffer_size = len * 8;
-        uint8_t *decode_buffer = g_malloc0(decode_buffer_size);
-        int decoded_length = lzfse_decode_buffer(
-            decode_buffer, decode_buffer_size, payload_data, len, NULL);
-        g_free(payload_data);
+static bool apple_boot_im4p_is(AppleIm4p *im4p, const char *type)
+{
+    return memcmp(im4p->type, type, 4) == 0;
+}
 
-        if (decoded_length == 0 || decoded_length == decode_buffer_size) {
-            error_setg(
-                &error_fatal,
-                "LZFSE decompression for `%s` failed; insufficient buffer size",
-                filename);
-            g_free(decode_buffer);
-            return;
+/*
+ * Sum up the decoded size of the LZFSE blocks from their headers.
+ * Returns 0 if a block cannot be skipped without decoding it.
+ */
+static size_t apple_boot_lzfse_decoded_size(const uint8_t *src, size_t len)
+{
+    size_t total = 0;
+    size_t off = 0;
+    size_t block;
+    uint32_t n_raw;
+
+    while (len - off >= 4) {
+        switch (ldl_le_p(src + off)) {
+        case LZFSE_ENDOFSTREAM_BLOCK_MAGIC:
+            return total;
+        case LZFSE_UNCOMPRESSED_BLOCK_MAGIC:
+            if (len - off < 8) {
+                return 0;
+            }
+            n_raw = ldl_le_p(src + off + 4);
+            block = 8 + (size_t)n_raw;
+            break;
+        case LZFSE_COMPRESSEDLZVN_BLOCK_MAGIC:
+            if (len - off < 12) {
+                return 0;
+            }
+            n_raw = ldl_le_p(src + off + 4);
+            block = 12 + (size_t)ldl_le_p(src + off + 8);
+            break;
+        case LZFSE_COMPRESSEDV2_BLOCK_MAGIC:
+            if (len - off < 32) {
+                return 0;
+            }
+            n_raw = ldl_le_p(src + off + 4);
+            // header size, literal payload bytes and LMD payload bytes.
+            block = extract64(ldq_le_p(src + off + 24), 0, 32) +
+                    extract64(ldq_le_p(src + off + 8), 20, 20) +
+                    extract64(ldq_le_p(src + off + 16), 40, 20);
+            break;
+        default:
+            return 0;
+        }
+        if (block > len - off) {
+            return 0;
         }
+        off += block;
+        total += n_raw;
+    }
 
-        *data = decode_buffer;
-        *length = decoded_length;
-        return;
+    return 0;
+}
+
+/// Decoded size of the payload, or 0 if it is not known up front.
+static size_t apple_boot_im4p_decoded_size(AppleIm4p *im4p)
+{
+    switch (im4p->compression) {
+    case IM4P_LZFSE:
+        return apple_boot_lzfse_decoded_size(im4p->payload, im4p->payload_len);
+    case IM4P_LZSS:
+        return be32_to_cpu(
+            ((const LzssCompHeader *)im4p->payload)->uncompressed_size);
+    default:
+        return im4p->payload_len;
     }
+}
 
-    if (memcmp(payload_data, "complzss", 8) == 0) {
-        LzssCompHeader *comp_header = (LzssCompHeader *)payload_data;
-        size_t uncompressed_size = be32_to_cpu(comp_header->uncompressed_size);
-        size_t compressed_size = be32_to_cpu(comp_header->compressed_size);
-        uint8_t *decode_buffer = g_malloc0(uncompressed_size);
-        int decoded_length =
-            decompress_lzss(decode_buffer, comp_header->data, compressed_size);
-        if (decoded_length == 0 || decoded_length != uncompressed_size) {
-            error_setg(&error_fatal, "LZSS decompression for `%s` failed.",
-                       filename);
-            g_free(decode_buffer);
-            return;
+/// Decode the payload into `dst`, returning the number of bytes written.
+static size_t apple_boot_im4p_decode_into(AppleIm4p *im4p, uint8_t *dst,
+                                          size_t capacity)
+{
+    const LzssCompHeader *comp_header;
+    uint32_t compressed_size;
+
+    switch (im4p->compression) {
+    case IM4P_LZFSE:
+        return lzfse_decode_buffer(dst, capacity, im4p->payload,
+                                   im4p->payload_len, NULL);
+    case IM4P_LZSS:
+        comp_header = (const LzssCompHeader *)im4p->payload;
+        compressed_size = be32_to_cpu(comp_header->compressed_size);
+        if (compressed_size > im4p->payload_len - sizeof(LzssCompHeader) ||
+            capacity < be32_to_cpu(comp_header->uncompressed_size)) {
+            return 0;
+        }
+        return decompress_lzss(dst, (uint8_t *)comp_header->data,
+                               compressed_size);
+    default:
+        g_assert_not_reached();
+    }
+}
+
+/*
+ * Get the payload contents, decompressing them on the heap if needed.
+ * The returned data stays valid until `apple_boot_im4p_close`.
+ */
+static const uint8_t *apple_boot_im4p_get_data(AppleIm4p *im4p,
+                                               uint32_t *length,
+                                               uint8_t **secure_monitor)
+{
+    const LzssCompHeader *comp_header;
+    size_t expected;
+    size_t decoded;
+    size_t monitor_off;
+
+    if (im4p->compression == IM4P_UNCOMPRESSED) {
+        *length = im4p->payload_len;
+        return im4p->payload;
+    }
+
+    expected = apple_boot_im4p_decoded_size(im4p);
+    if (expected != 0) {
+        // One spare byte tells a full decode from a truncated one.
+        im4p->decoded_capacity = expected + 1;
+        im4p->decoded = g_malloc(im4p->decoded_capacity);
+        decoded = apple_boot_im4p_decode_into(im4p, im4p->decoded,
+                                              im4p->decoded_capacity);
+    } else {
+        im4p->decoded_capacity = im4p->payload_len * 4;
+        for (;;) {
+            im4p->decoded =
+                g_realloc(im4p->decoded, im4p->decoded_capacity);
+            decoded = apple_boot_im4p_decode_into(im4p, im4p->decoded,
+                                                  im4p->decoded_capacity);
+            if (decoded < im4p->decoded_capacity) {
+                break;
+            }
+            im4p->decoded_capacity *= 2;
         }
+        expected = decoded;
+    }
 
-        size_t monitor_off = compressed_size + sizeof(LzssCompHeader);
-        if (secure_monitor && monitor_off < len) {
-            size_t monitor_size = len - monitor_off;
+    if (decoded == 0 || decoded != expected) {
+        error_setg(&error_fatal, "%s decompression for `%s` failed.",
+                   im4p->compression == IM4P_LZFSE ? "LZFSE" : "LZSS",
+                   im4p->filename);
+        return NULL;
+    }
+
+    if (im4p->compression == IM4P_LZSS && secure_monitor != NULL) {
+        comp_header = (const LzssCompHeader *)im4p->payload;
+        monitor_off =
+            be32_to_cpu(comp_header->compressed_size) + sizeof(LzssCompHeader);
+        if (monitor_off < im4p->payload_len) {
             DINFO("Found AP Secure Monitor in payload with size 0x%zX!",
-                  monitor_size);
-            *secure_monitor = g_malloc0(monitor_size);
-            memcpy(*secure_monitor, payload_data + monitor_off, monitor_size);
+                  im4p->payload_len - monitor_off);
+            *secure_monitor = g_memdup2(im4p->payload + monitor_off,
+                                        im4p->payload_len - monitor_off);
         }
+    }
 
-        g_free(payload_data);
+    *length = decoded;
+    return im4p->decoded;
+}
 
-        *data = decode_buffer;
-        *length = decoded_length;
-        return;
+/*
+ * Write the payload contents to guest memory, decompressing straight into
+ * it when the destination can be mapped. Returns the decoded size.
+ */
+static uint64_t apple_boot_im4p_write(AppleIm4p *im4p, AddressSpace *as,
+                                      hwaddr pa)
+{
+    const uint8_t *data;
+    uint32_t length;
+    size_t expected;
+    size_t decoded;
+    hwaddr capacity;
+    void *dst;
+
+    if (im4p->compression == IM4P_UNCOMPRESSED) {
+        address_space_write(as, pa, MEMTXATTRS_UNSPECIFIED, im4p->payload,
+                            im4p->payload_len);
+        return im4p->payload_len;
     }
 
-    *data = payload_data;
-    *length = len;
+    expected = apple_boot_im4p_decoded_size(im4p);
+    if (expected != 0) {
+        capacity = expected + 1;
+        dst = address_space_map(as, pa, &capacity, true,
+                                MEMTXATTRS_UNSPECIFIED);
+        if (dst != NULL && capacity >= expected) {
+            decoded = apple_boot_im4p_decode_into(im4p, dst, capacity);
+            address_space_unmap(as, dst, capacity, true, decoded);
+            if (decoded == 0 || decoded != expected) {
+                error_setg(&error_fatal, "%s decompression for `%s` failed.",
+                           im4p->compression == IM4P_LZFSE ? "LZFSE" : "LZSS",
+                           im4p->filename);
+            }
+            return decoded;
+        }
+        if (dst != NULL) {
+            address_space_unmap(as, dst, capacity, true, 0);
+        }
+    }
+
+    data = apple_boot_im4p_get_data(im4p, &length, NULL);
+    address_space_write(as, pa, MEMTXATTRS_UNSPECIFIED, data, length);
+    return length;
 }
 
 AppleDTNode *apple_boot_load_dt_file(const char *filename)
 {
     AppleDTNode *root = NULL;
-    uint8_t *file_data = NULL;
+    const uint8_t *file_data;
     uint32_t fsize;
-    char payload_type[4];
+    AppleIm4p im4p;
 
     if (filename == NULL) {
         return NULL;
     }
 
-    extract_im4p_payload(filename, payload_type, &file_data, &fsize, NULL);
+    apple_boot_im4p_open(&im4p, filename);
 
-    if (memcmp(payload_type, "dtre", 4) != 0 &&
-        memcmp(payload_type, "raw", 4) != 0) {
+    if (!apple_boot_im4p_is(&im4p, "dtre") &&
+        !apple_boot_im4p_is(&im4p, "raw")) {
         error_setg(&error_fatal, "`%s` is a `%.4s` object (expected `dtre`)",
-                   filename, payload_type);
+                   filename, im4p.type);
         return NULL;
     }
 
-    root = apple_dt_deserialise(file_data);
-    g_free(file_data);
+    file_data = apple_boot_im4p_get_data(&im4p, &fsize, NULL);
+    root = apple_dt_deserialise((void *)file_data);
+    apple_boot_im4p_close(&im4p);
     return root;
 }
 
@@ -703,26 +902,27 @@ uint8_t *apple_boot_load_trustcache_file(const char *filename, uint64_t *size)
 {
     uint32_t *trustcache_data;
     uint64_t trustcache_size;
-    g_autofree uint8_t *file_data;
+    const uint8_t *file_data;
     unsigned long file_size;
     uint32_t length;
-    char payload_type[4];
+    AppleIm4p im4p;
     uint32_t trustcache_version;
     uint32_t trustcache_entry_count;
     uint32_t expected_file_size;
     uint32_t trustcache_entry_size;
 
-    extract_im4p_payload(filename, payload_type, &file_data, &length, NULL);
+    apple_boot_im4p_open(&im4p, filename);
 
-    if (memcmp(payload_type, "trst", 4) != 0 &&
-        memcmp(payload_type, "rtsc", 4) != 0 &&
-        memcmp(payload_type, "raw", 4) != 0) {
+    if (!apple_boot_im4p_is(&im4p, "trst") &&
+        !apple_boot_im4p_is(&im4p, "rtsc") &&
+        !apple_boot_im4p_is(&im4p, "raw")) {
         error_setg(&error_fatal,
                    "`%s` is a `%.4s` object (expected `trst`/`rtsc`).",
-                   filename, payload_type);
+                   filename, im4p.type);
         return NULL;
     }
 
+    file_data = apple_boot_im4p_get_data(&im4p, &length, NULL);
     file_size = (unsigned long)length;
 
     trustcache_size = ROUND_UP_16K(file_size + 8);
@@ -730,6 +930,7 @@ uint8_t *apple_boot_load_trustcache_file(const char *filename, uint64_t *size)
     trustcache_data[0] = 1; // #trustcaches
     trustcache_data[1] = 8; // offset
     memcpy(&trustcache_data[2], file_data, file_size);
+    apple_boot_im4p_close(&im4p);
 
     // Validate the trustcache v1 header. The layout is:
     // uint32_t version
@@ -767,45 +968,131 @@ uint8_t *apple_boot_load_trustcache_file(const char *filename, uint64_t *size)
     return (uint8_t *)trustcache_data;
 }
 
+static void apple_boot_unmap_file(AddressSpace *as, MemoryRegion **mr)
+{
+    if (*mr == NULL) {
+        return;
+    }
+
+    memory_region_del_subregion(as->root, *mr);
+    vmstate_unregister_ram(*mr, NULL);
+    object_unparent(OBJECT(*mr));
+    *mr = NULL;
+}
+
+/*
+ * Map the file copy-on-write over guest memory, instead of copying it in.
+ * Pages are shared with every other VM using the same file through the page
+ * cache and are only read in when first touched. Whatever does not fill a
+ * whole host page at the end of the file is copied.
+ *
+ * A fresh mapping is created on every call, which discards guest writes made
+ * to the previous one.
+ */
+static bool apple_boot_map_file(const char *filename, AddressSpace *as,
+                                hwaddr pa, MemoryRegion **mr, uint64_t *size)
+{
+#ifdef CONFIG_POSIX
+    g_autofree char *name = NULL;
+    g_autofree uint8_t *tail = NULL;
+    Error *local_err = NULL;
+    uint64_t mapped_size;
+    gsize tail_size;
+    GStatBuf st;
+    int fd;
+
+    apple_boot_unmap_file(as, mr);
+
+    if (g_stat(filename, &st) != 0 || !S_ISREG(st.st_mode)) {
+        return false;
+    }
+
+    mapped_size = QEMU_ALIGN_DOWN(st.st_size, qemu_real_host_page_size());
+    if (mapped_size == 0 || !QEMU_IS_ALIGNED(pa, qemu_real_host_page_size())) {
+        return false;
+    }
+
+    tail_size = st.st_size - mapped_size;
+    if (tail_size != 0) {
+        fd = qemu_open(filename, O_RDONLY, NULL);
+        if (fd < 0) {
+            return false;
+        }
+        tail = g_malloc(tail_size);
+        if (pread(fd, tail, tail_size, mapped_size) != tail_size) {
+            close(fd);
+            return false;
+        }
+        close(fd);
+    }
+
+    name = g_strdup_printf("apple-boot.file@0x" HWADDR_FMT_plx, pa);
+    *mr = g_new0(MemoryRegion, 1);
+    if (!memory_region_init_ram_from_file(
+            *mr, NULL, name, mapped_size, 0,
+            RAM_PRIVATE | RAM_READONLY_FD, filename, 0, &local_err)) {
+        warn_report_err(local_err);
+        g_free(*mr);
+        *mr = NULL;
+        return false;
+    }
+    OBJECT(*mr)->free = g_free;
+    vmstate_register_ram_global(*mr);
+    memory_region_add_subregion_overlap(as->root, pa, *mr, 1);
+
+    if (tail_size != 0) {
+        address_space_write(as, pa + mapped_size, MEMTXATTRS_UNSPECIFIED, tail,
+                            tail_size);
+    }
+
+    *size = st.st_size;
+    return true;
+#else
+    return false;
+#endif
+}
+
 void apple_boot_load_ramdisk(const char *filename, AddressSpace *as, hwaddr pa,
-                             uint64_t *size)
+                             uint64_t *size, MemoryRegion **mr)
 {
-    uint8_t *file_data = NULL;
-    unsigned long file_size = 0;
-    uint32_t length = 0;
-    char payload_type[4];
-
-    extract_im4p_payload(filename, payload_type, &file_data, &length, NULL);
-    if (memcmp(payload_type, "rdsk", 4) != 0 &&
-        memcmp(payload_type, "raw", 4) != 0) {
+    AppleIm4p im4p;
+
+    apple_boot_im4p_open(&im4p, filename);
+    if (!apple_boot_im4p_is(&im4p, "rdsk") &&
+        !apple_boot_im4p_is(&im4p, "raw")) {
         error_setg(&error_fatal, "`%s` is a `%.4s` object (expected `rdsk`)",
-                   filename, payload_type);
+                   filename, im4p.type);
         return;
     }
 
-    file_size = length;
-    file_data = g_realloc(file_data, file_size);
+    if (apple_boot_im4p_is(&im4p, "raw") &&
+        apple_boot_map_file(filename, as, pa, mr, size)) {
+        apple_boot_im4p_close(&im4p);
+        return;
+    }
 
-    address_space_rw(as, pa, MEMTXATTRS_UNSPECIFIED, file_data, file_size,
-                     true);
-    *size = file_size;
-    g_free(file_data);
+    apple_boot_unmap_file(as, mr);
+    *size = apple_boot_im4p_write(&im4p, as, pa);
+    apple_boot_im4p_close(&im4p);
 }
 
 void apple_boot_load_raw_file(const char *filename, AddressSpace *as,
                               hwaddr file_pa, uint64_t *size)
 {
-    uint8_t *file_data;
-    gsize sizef;
-
-    if (g_file_get_contents(filename, (gchar **)&file_data, &sizef, NULL)) {
-        *size = sizef;
-        address_space_rw(as, file_pa, MEMTXATTRS_UNSPECIFIED, file_data, sizef,
-                         true);
-        g_free(file_data);
-    } else {
-        error_setg(&error_fatal, "file read for `%s` failed", filename);
+    g_autoptr(GMappedFile) file = NULL;
+    GError *gerr = NULL;
+
+    file = g_mapped_file_new(filename, false, &gerr);
+    if (file == NULL) {
+        error_setg(&error_fatal, "file read for `%s` failed: %s", filename,
+                   gerr->message);
+        g_error_free(gerr);
+        return;
     }
+
+    *size = g_mapped_file_get_length(file);
+    address_space_write(as, file_pa, MEMTXATTRS_UNSPECIFIED,
+                        g_mapped_file_get_contents(file), *size);
 }
 
 bool apple_boot_contains_boot_arg(const char *boot_args, const char *arg,
@@ -1008,25 +1295,159 @@ MachoHeader64 *apple_boot_load_kernel(const char *filename,
                                       MachoHeader64 **secure_monitor)
 {
     uint32_t len;
-    uint8_t *data = NULL;
-    char payload_type[4];
+    const uint8_t *data;
+    AppleIm4p im4p;
     MachoHeader64 *header;
 
-    extract_im4p_payload(filename, payload_type, &data, &len,
-                         (uint8_t **)secure_monitor);
+    apple_boot_im4p_open(&im4p, filename);
 
-    if (memcmp(payload_type, "krnl", 4) != 0 &&
-        memcmp(payload_type, "raw", 4) != 0) {
+    if (!apple_boot_im4p_is(&im4p, "krnl") &&
+        !apple_boot_im4p_is(&im4p, "raw")) {
         error_setg(&error_fatal, "`%s` is a `%.4s` object (expected `krnl`)",
-                   filename, payload_type);
+                   filename, im4p.type);
+        return NULL;
+    }
+
+    data = apple_boot_im4p_get_data(&im4p, &len, (uint8_t **)secure_monitor);
+    header = apple_boot_parse_macho((uint8_t *)data, len);
+    apple_boot_im4p_close(&im4p);
+    return header;
+}
+
+#define APPLE_KC_CACHE_MAGIC (0x4B434341) // AKCK
+#define APPLE_KC_CACHE_VERSION (1)
+/* The image starts page aligned, so that it maps cleanly. */
+#define APPLE_KC_CACHE_DATA_OFF (16 * KiB)
+
+typedef struct QEMU_PACKED {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t build_version;
+    uint32_t reserved;
+    /* Offset of the Mach-O header within the image */
+    uint64_t header_off;
+    uint64_t size;
+} AppleKCCacheHeader;
+
+char *apple_boot_kernel_cache_key(const char *filename, const char *patch_set)
+{
+    g_autoptr(GMappedFile) file = NULL;
+    g_autofree char *digest = NULL;
+    GError *gerr = NULL;
+
+    file = g_mapped_file_new(filename, false, &gerr);
+    if (file == NULL) {
+        warn_report("Unable to hash `%s` for the kernelcache cache: %s",
+                    filename, gerr->message);
+        g_error_free(gerr);
+        return NULL;
+    }
+
+    if (qcrypto_hash_digest(QCRYPTO_HASH_ALGO_SHA256,
+                            g_mapped_file_get_contents(file),
+                            g_mapped_file_get_length(file), &digest,
+                            NULL) != 0) {
+        return NULL;
+    }
+
+    return g_strdup_printf("%s-%s", digest, patch_set);
+}
+
+MachoHeader64 *apple_boot_load_cached_kernel(const char *cache_dir,
+                                             const char *key)
+{
+    g_autofree char *path = g_strdup_printf("%s/%s.kc", cache_dir, key);
+    const AppleKCCacheHeader *hdr;
+    MachoHeader64 *header;
+    GMappedFile *file;
+    uint8_t *data;
+    size_t len;
+
+    // Private and writable, as the image is slid in place when loading.
+    file = g_mapped_file_new(path, true, NULL);
+    if (file == NULL) {
+        return NULL;
+    }
+
+    data = (uint8_t *)g_mapped_file_get_contents(file);
+    len = g_mapped_file_get_length(file);
+    hdr = (const AppleKCCacheHeader *)data;
+    if (len < APPLE_KC_CACHE_DATA_OFF || hdr->magic != APPLE_KC_CACHE_MAGIC ||
+        hdr->version != APPLE_KC_CACHE_VERSION ||
+        hdr->size > len - APPLE_KC_CACHE_DATA_OFF ||
+        hdr->size < sizeof(MachoHeader64) ||
+        hdr->header_off > hdr->size - sizeof(MachoHeader64)) {
+        warn_report("Ignoring invalid kernelcache cache entry `%s`", path);
+        g_mapped_file_unref(file);
+        return NULL;
+    }
+
+    header = (MachoHeader64 *)(data + APPLE_KC_CACHE_DATA_OFF +
+                               hdr->header_off);
+    if (header->magic != MACH_MAGIC_64 ||
+        apple_boot_build_version(header) != hdr->build_version) {
+        warn_report("Ignoring invalid kernelcache cache entry `%s`", path);
+        g_mapped_file_unref(file);
         return NULL;
     }
 
-    header = apple_boot_parse_macho(data, len);
-    g_free(data);
+    info_report("Using cached kernelcache `%s`", path);
+
+    // The mapping backs the kernel for the lifetime of the machine.
     return header;
 }
 
+void apple_boot_store_cached_kernel(const char *cache_dir, const char *key,
+                                    MachoHeader64 *header)
+{
+    g_autofree char *path = g_strdup_printf("%s/%s.kc", cache_dir, key);
+    g_autofree char *tmp_path = g_strdup_printf("%s.XXXXXX", path);
+    g_autofree uint8_t *prefix = g_malloc0(APPLE_KC_CACHE_DATA_OFF);
+    AppleKCCacheHeader *hdr = (AppleKCCacheHeader *)prefix;
+    vaddr text_base;
+    vaddr kc_base;
+    vaddr kc_end;
+    bool ok;
+    int fd;
+
+    apple_boot_get_kc_bounds(header, &text_base, &kc_base, &kc_end, NULL,
+                             NULL);
+
+    hdr->magic = APPLE_KC_CACHE_MAGIC;
+    hdr->version = APPLE_KC_CACHE_VERSION;
+    hdr->build_version = apple_boot_build_version(header);
+    hdr->header_off = text_base - kc_base;
+    hdr->size = kc_end - kc_base;
+
+    if (g_mkdir_with_parents(cache_dir, 0755) != 0) {
+        warn_report("Unable to create kernelcache cache directory `%s`: %s",
+                    cache_dir, strerror(errno));
+        return;
+    }
+
+    fd = g_mkstemp(tmp_path);
+    if (fd < 0) {
+        warn_report("Unable to create `%s`: %s", tmp_path, strerror(errno));
+        return;
+    }
+
+    ok = qemu_write_full(fd, prefix, APPLE_KC_CACHE_DATA_OFF) ==
+             APPLE_KC_CACHE_DATA_OFF &&
+         qemu_write_full(fd, apple_boot_get_macho_buffer(header), hdr->size) ==
+             hdr->size;
+    ok = close(fd) == 0 && ok;
+
+    // Rename last, so that concurrent boots never see a partial entry.
+    if (!ok || rename(tmp_path, path) != 0) {
+        warn_report("Unable to store kernelcache cache entry `%s`: %s", path,
+                    strerror(errno));
+        unlink(tmp_path);
+        return;
+    }
+
+    info_report("Stored kernelcache cache entry `%s`", path);
+}
+
 MachoHeader64 *apple_boot_parse_macho(uint8_t *data, uint32_t len)
 {
     uint8_t *phys_base;
@@ -28,6 +28,7 @@
 #include "monitor/monitor.h"
 #include "qapi/error.h"
 #include "qemu/bitops.h"
+#include "qemu/rcu.h"
 #include "system/dma.h"
 #include "qobject/qdict.h"
 
@@ -46,6 +47,7 @@
 #define DART_MAX_TTBR (4)
 #define DART_MAX_VA_BITS (38)
 #define DART_MAX_TLB_OP_SETS (1)
+#define DART_IOTLB_SIZE (256)
 
 enum {
     DART_TLB_OP_INVALIDATE = 0,
@@ -176,6 +178,28 @@ typedef struct {
     uint32_t ttbr[DART_MAX_STREAMS][DART_MAX_TTBR];
 } AppleDARTDARTRegs;
 
+typedef struct {
+    uint64_t iova;
+    hwaddr pa;
+    IOMMUAccessFlags perm;
+    bool valid;
+} AppleDARTIOTLBEntry;
+
+typedef enum {
+    DART_STREAM_TRANSLATE = 0,
+    DART_STREAM_BYPASS,
+    DART_STREAM_BLOCKED,
+} AppleDARTStreamMode;
+
+/*
+ * Per-stream view of SID_REMAP and SID_CONFIG, published through RCU so that
+ * streams which never walk page tables do not need the mapper mutex.
+ */
+typedef struct {
+    struct rcu_head rcu;
+    uint8_t mode[DART_MAX_STREAMS];
+} AppleDARTStreamSnapshot;
+
 typedef struct {
     MemoryRegion iomem;
     QemuMutex mutex;
@@ -188,6 +212,11 @@ struct AppleDARTMapperInstance {
     AppleDARTInstance common;
     AppleDARTIOMMUMemoryRegion *iommus[DART_MAX_STREAMS];
     AppleDARTDARTRegs regs;
+    AppleDARTStreamSnapshot *streams;
+    /* Direct-mapped, indexed by page number, per (remapped) SID. */
+    AppleDARTIOTLBEntry iotlb[DART_MAX_STREAMS][DART_IOTLB_SIZE];
+    uint64_t iotlb_hits[DART_MAX_STREAMS];
+    uint64_t iotlb_misses[DART_MAX_STREAMS];
 };
 
 struct AppleDARTState {
@@ -255,6 +284,115 @@ static void apple_dart_update_irq(AppleDARTState *dart)
     qemu_irq_lower(dart->irq);
 }
 
+/*
+ * Drop cached translations of the SIDs in `sid_mask`, call with mutex locked
+ */
+static void apple_dart_mapper_iotlb_flush(AppleDARTMapperInstance *mapper,
+                                          uint64_t sid_mask)
+{
+    uint32_t i;
+
+    for (i = 0; i < DART_MAX_STREAMS; ++i) {
+        if (sid_mask & BIT_ULL(i)) {
+            memset(mapper->iotlb[i], 0, sizeof(mapper->iotlb[i]));
+        }
+    }
+}
+
+/*
+ * Tell the IOMMU notifiers of the SIDs in `sid_mask` that their mappings
+ * are gone, call with mutex unlocked
+ */
+static void apple_dart_mapper_notify_unmap(AppleDARTMapperInstance *mapper,
+                                           uint64_t sid_mask)
+{
+    IOMMUTLBEvent event = { 0 };
+    uint32_t i;
+
+    sid_mask &= mapper->common.dart->sid_mask;
+
+    for (i = 0; i < DART_MAX_STREAMS; ++i) {
+        if ((sid_mask & BIT_ULL(i)) == 0) {
+            continue;
+        }
+
+        event.type = IOMMU_NOTIFIER_UNMAP;
+        event.entry.target_as = &address_space_memory;
+        event.entry.iova = 0;
+        event.entry.perm = IOMMU_NONE;
+        event.entry.addr_mask = HWADDR_MAX;
+
+        memory_region_notify_iommu(&mapper->iommus[i]->iommu, 0, event);
+    }
+}
+
+/*
+ * A remap outside the implemented streams points at no tables; such SIDs
+ * fault on every access.
+ */
+static inline bool apple_dart_sid_remap_valid(uint8_t remap)
+{
+    return remap < DART_MAX_STREAMS;
+}
+
+/*
+ * SIDs whose translations come from the tables of `sid_mask`, call with mutex
+ * locked
+ */
+static uint64_t apple_dart_mapper_sids_using(AppleDARTMapperInstance *mapper,
+                                             uint64_t sid_mask)
+{
+    uint64_t users = 0;
+    uint32_t i;
+
+    for (i = 0; i < DART_MAX_STREAMS; ++i) {
+        uint8_t remap = mapper->regs.sid_remap[i];
+
+        if (apple_dart_sid_remap_valid(remap) && (sid_mask & BIT_ULL(remap))) {
+            users |= BIT_ULL(i);
+        }
+    }
+
+    return users;
+}
+
+/*
+ * Rebuild the stream snapshot from the registers, call with mutex locked
+ */
+static void apple_dart_mapper_publish_streams(AppleDARTMapperInstance *mapper)
+{
+    AppleDARTStreamSnapshot *snap = g_new0(AppleDARTStreamSnapshot, 1);
+    AppleDARTStreamSnapshot *old;
+    uint32_t config;
+    uint8_t remap;
+    uint32_t i;
+
+    for (i = 0; i < DART_MAX_STREAMS; ++i) {
+        remap = mapper->regs.sid_remap[i];
+        if (!apple_dart_sid_remap_valid(remap)) {
+            /* Take the locked path, which reports the fault */
+            snap->mode[i] = DART_STREAM_TRANSLATE;
+            continue;
+        }
+
+        config = mapper->regs.sid_config[remap];
+        if (REG_FIELD_EX32(config, DART_SID_CONFIG, FULL_BYPASS)) {
+            snap->mode[i] = DART_STREAM_BYPASS;
+        } else if (!REG_FIELD_EX32(config, DART_SID_CONFIG,
+                                   TRANSLATION_ENABLE)) {
+            snap->mode[i] = DART_STREAM_BLOCKED;
+        } else {
+            snap->mode[i] = DART_STREAM_TRANSLATE;
+        }
+    }
+
+    old = mapper->streams;
+    qatomic_rcu_set(&mapper->streams, snap);
+    if (old != NULL) {
+        g_free_rcu(old, rcu);
+    }
+}
+
 static void apple_dart_mapper_reg_write(void *opaque, hwaddr addr,
                                         uint64_t data, unsigned size)
 {
@@ -263,7 +401,6 @@ static void apple_dart_mapper_reg_write(void *opaque, hwaddr addr,
     uint32_t i;
     uint32_t set_index;
     uint64_t sid_mask = 0;
-    IOMMUTLBEvent event = { 0 };
 
     DPRINTF("%s[%d]: (DART) 0x" HWADDR_FMT_plx " <- 0x" HWADDR_FMT_plx "\n",
             mapper->common.dart->parent_obj.parent_obj.id, mapper->common.id,
@@ -292,22 +429,13 @@ static void apple_dart_mapper_reg_write(void *opaque, hwaddr addr,
                 sid_mask |=
                     mapper->regs.tlb_op_set[i] & mapper->common.dart->sid_mask;
             }
+
+            apple_dart_mapper_iotlb_flush(mapper, sid_mask);
+            sid_mask = apple_dart_mapper_sids_using(mapper, sid_mask);
         }
 
         if (sid_mask != 0) {
-            for (i = 0; i < DART_MAX_STREAMS; ++i) {
-                if ((sid_mask & BIT_ULL(i)) == 0) {
-                    continue;
-                }
-
-                event.type = IOMMU_NOTIFIER_UNMAP;
-                event.entry.target_as = &address_space_memory;
-                event.entry.iova = 0;
-                event.entry.perm = IOMMU_NONE;
-                event.entry.addr_mask = HWADDR_MAX;
-
-                memory_region_notify_iommu(&mapper->iommus[i]->iommu, 0, event);
-            }
+            apple_dart_mapper_notify_unmap(mapper, sid_mask);
         }
 
         qatomic_and(&mapper->regs.tlb_op, ~R_DART_TLB_OP_BUSY_MASK);
@@ -338,20 +466,28 @@ static void apple_dart_mapper_reg_write(void *opaque, hwaddr addr,
         {
             i = addr - A_DART_SID_REMAP(0);
             *(uint32_t *)&mapper->regs.sid_remap[i] = val;
+            apple_dart_mapper_publish_streams(mapper);
         }
+        /* The cache is per table, only the users of these SIDs change. */
+        apple_dart_mapper_notify_unmap(mapper, MAKE_64BIT_MASK(i, 4));
         break;
     case R_DART_SID_CONFIG(0)...(R_DART_SID_CONFIG(DART_MAX_STREAMS) - 1):
         WITH_QEMU_LOCK_GUARD(&mapper->common.mutex)
         {
             i = (addr >> 2) - R_DART_SID_CONFIG(0);
             mapper->regs.sid_config[i] = val;
+            apple_dart_mapper_publish_streams(mapper);
+            apple_dart_mapper_iotlb_flush(mapper, BIT_ULL(i));
+            sid_mask = apple_dart_mapper_sids_using(mapper, BIT_ULL(i));
         }
+        apple_dart_mapper_notify_unmap(mapper, sid_mask);
         break;
     case R_DART_TTBR(0, 0)...(R_DART_TTBR(DART_MAX_STREAMS, DART_MAX_TTBR) - 1):
         WITH_QEMU_LOCK_GUARD(&mapper->common.mutex)
         {
             i = (addr >> 2) - R_DART_TTBR(0, 0);
             ((uint32_t *)mapper->regs.ttbr)[i] = val;
+            apple_dart_mapper_iotlb_flush(mapper, BIT_ULL(i / DART_MAX_TTBR));
         }
         break;
     default:
@@ -511,6 +647,8 @@ static IOMMUTLBEntry apple_dart_mapper_translate(IOMMUMemoryRegion *mr,
     AppleDARTState *dart = mapper->common.dart;
     uint32_t sid = iommu->sid;
     uint64_t iova;
+    AppleDARTIOTLBEntry *tlb;
+    AppleDARTStreamMode mode;
 
     IOMMUTLBEntry entry = {
         .target_as = &address_space_memory,
@@ -523,29 +661,70 @@ static IOMMUTLBEntry apple_dart_mapper_translate(IOMMUMemoryRegion *mr,
         return entry;
     }
 
+    WITH_RCU_READ_LOCK_GUARD()
+    {
+        mode = qatomic_rcu_read(&mapper->streams)->mode[sid];
+    }
+
+    /*
+     * Neither case depends on the page tables, so report the whole IOVA space
+     * as one entry and let the memory core reuse it.
+     */
+    switch (mode) {
+    case DART_STREAM_BYPASS:
+        // TODO: BYPASS_ADDR_39_32
+        entry.iova = 0;
+        entry.translated_addr = 0;
+        entry.addr_mask = MAKE_64BIT_MASK(0, DART_MAX_VA_BITS);
+        entry.perm = IOMMU_RW;
+        return entry;
+    case DART_STREAM_BLOCKED:
+        // Disabled translation means no access, not error (?)
+        entry.iova = 0;
+        entry.addr_mask = MAKE_64BIT_MASK(0, DART_MAX_VA_BITS);
+        return entry;
+    default:
+        break;
+    }
+
     QEMU_LOCK_GUARD(&mapper->common.mutex);
 
     sid = mapper->regs.sid_remap[sid];
-
-    // Disabled translation means bypass, not error (?)
-    if (REG_FIELD_EX32(mapper->regs.sid_config[sid], DART_SID_CONFIG,
-                   TRANSLATION_ENABLE) == 0 ||
-        REG_FIELD_EX32(mapper->regs.sid_config[sid], DART_SID_CONFIG,
-                   FULL_BYPASS) != 0) {
-        // TODO
+    if (!apple_dart_sid_remap_valid(sid)) {
+        mapper->regs.error_address = addr;
+        mapper->regs.error_status = REG_FIELD_DP32(
+            REG_FIELD_DP32(REG_FIELD_DP32(mapper->regs.error_status,
+                                          DART_ERROR_STATUS, FLAG, 1),
+                           DART_ERROR_STATUS, TTBR_INVLD, 1),
+            DART_ERROR_STATUS, SID, iommu->sid);
+        apple_dart_raise_irq(dart);
         goto end;
     }
 
     iova = addr >> dart->page_shift;
+    tlb = &mapper->iotlb[sid][iova & (DART_IOTLB_SIZE - 1)];
 
-    uint32_t status = apple_dart_mapper_ptw(mapper, sid, iova, &entry);
-    if (status != 0) {
-        mapper->regs.error_address = addr;
-        mapper->regs.error_status =
-            REG_FIELD_DP32(mapper->regs.error_status | status, DART_ERROR_STATUS,
-                       SID, iommu->sid);
-        apple_dart_raise_irq(dart);
-        goto end;
+    if (tlb->valid && tlb->iova == iova) {
+        mapper->iotlb_hits[sid]++;
+        entry.translated_addr = tlb->pa;
+        entry.perm = tlb->perm;
+    } else {
+        mapper->iotlb_misses[sid]++;
+
+        uint32_t status = apple_dart_mapper_ptw(mapper, sid, iova, &entry);
+        if (status != 0) {
+            mapper->regs.error_address = addr;
+            mapper->regs.error_status =
+                REG_FIELD_DP32(mapper->regs.error_status | status,
+                               DART_ERROR_STATUS, SID, iommu->sid);
+            apple_dart_raise_irq(dart);
+            goto end;
+        }
+
+        tlb->iova = iova;
+        tlb->pa = entry.translated_addr;
+        tlb->perm = entry.perm;
+        tlb->valid = true;
     }
 
     entry.translated_addr |= addr & entry.addr_mask;
@@ -580,6 +759,23 @@ end:
     return entry;
 }
 
+static int apple_dart_notify_flag_changed(IOMMUMemoryRegion *mr,
+                                          IOMMUNotifierFlag old,
+                                          IOMMUNotifierFlag new, Error **errp)
+{
+    /*
+     * Mappings are only discovered on translation, so there is nothing to
+     * send MAP events from. Invalidations are sent on TLB operations.
+     */
+    if (new & IOMMU_NOTIFIER_MAP) {
+        error_setg(errp, "%s does not support MAP notifications",
+                   memory_region_name(MEMORY_REGION(mr)));
+        return -EINVAL;
+    }
+
+    return 0;
+}
+
 static void apple_dart_reset(DeviceState *dev)
 {
     AppleDARTState *dart = APPLE_DART(dev);
@@ -595,6 +791,9 @@ static void apple_dart_reset(DeviceState *dev)
 
             QEMU_LOCK_GUARD(&mapper->common.mutex);
             mapper->regs = (AppleDARTDARTRegs){ 0 };
+            apple_dart_mapper_iotlb_flush(mapper, MAKE_64BIT_MASK(0, 64));
+            memset(mapper->iotlb_hits, 0, sizeof(mapper->iotlb_hits));
+            memset(mapper->iotlb_misses, 0, sizeof(mapper->iotlb_misses));
 
             mapper->regs.params1 =
                 REG_FIELD_DP32(0, DART_PARAMS1, PAGE_SHIFT, dart->page_shift);
@@ -609,6 +808,7 @@ static void apple_dart_reset(DeviceState *dev)
             for (j = 0; j < DART_MAX_STREAMS; j++) {
                 mapper->regs.sid_remap[j] = j;
             }
+            apple_dart_mapper_publish_streams(mapper);
             break;
         }
         default:
@@ -740,6 +940,7 @@ AppleDARTState *apple_dart_from_node(AppleDTNode *node)
                 g_new0(AppleDARTMapperInstance, 1);
             instance = &mapper->common;
             instance->type = DART_DART;
+            apple_dart_mapper_publish_streams(mapper);
             memory_region_init_io(&instance->iomem, OBJECT(dev),
                                   &apple_dart_mapper_reg_ops, instance,
                                   TYPE_APPLE_DART ".reg", reg[(i * 2) + 1]);
@@ -900,7 +1101,11 @@ void hmp_info_dart(Monitor *mon, const QDict *qdict)
                                    sid);
                     continue;
                 }
-                monitor_printf(mon, "\t\tSID %d:\n", sid);
+                monitor_printf(mon,
+                               "\t\tSID %d: IOTLB hits: %" PRIu64
+                               " misses: %" PRIu64 "\n",
+                               sid, mapper->iotlb_hits[sid],
+                               mapper->iotlb_misses[sid]);
                 const uint64_t l0_entries[] = { mapper->regs.ttbr[sid][0],
                                                 mapper->regs.ttbr[sid][1],
                                                 mapper->regs.ttbr[sid][2],
@@ -954,6 +1159,7 @@ static void apple_dart_iommu_memory_region_class_init(ObjectClass *klass,
     IOMMUMemoryRegionClass *imrc = IOMMU_MEMORY_REGION_CLASS(klass);
 
     imrc->translate = apple_dart_mapper_translate;
+    imrc->notify_flag_changed = apple_dart_notify_flag_changed;
 }
 
 static const TypeInfo apple_dart_info = {
@@ -22,6 +22,8 @@
 #include "hw/qdev-core.h"
 #include "qapi/error.h"
 #include "qemu/cutils.h"
+#include "qemu/timer.h"
+#include "trace.h"
 
 #if 0
 #include "qemu/error-report.h"
@@ -45,8 +47,20 @@ static void apple_dt_prop_destroy(gpointer data)
 
     prop = data;
 
-    g_free(prop->data);
-    g_free(prop);
+    if (!prop->arena_data) {
+        g_free(prop->data);
+    }
+    if (!prop->arena) {
+        g_free(prop);
+    }
+}
+
+static void apple_dt_init_node(AppleDTNode *node)
+{
+    // Property names are interned, as few distinct ones exist.
+    node->props = g_hash_table_new_full(g_str_hash, g_str_equal, NULL,
+                                        apple_dt_prop_destroy);
+    node->child_index = g_hash_table_new(g_str_hash, g_str_equal);
 }
 
 static AppleDTNode *apple_dt_new_node(void)
@@ -54,9 +68,7 @@ static AppleDTNode *apple_dt_new_node(void)
     AppleDTNode *node;
 
     node = g_new0(AppleDTNode, 1);
-
-    node->props = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
-                                        apple_dt_prop_destroy);
+    apple_dt_init_node(node);
 
     return node;
 }
@@ -64,12 +76,107 @@ static AppleDTNode *apple_dt_new_node(void)
 static void apple_dt_destroy_node(AppleDTNode *node)
 {
     g_hash_table_unref(node->props);
+    g_hash_table_unref(node->child_index);
 
     if (node->children != NULL) {
         g_list_free_full(node->children, (GDestroyNotify)apple_dt_destroy_node);
     }
 
-    g_free(node);
+    if (!node->arena) {
+        g_free(node);
+    }
+}
+
+/// Returns the name of `node` if it can be indexed, otherwise null.
+static const char *apple_dt_node_index_name(AppleDTNode *node, bool *partial)
+{
+    AppleDTProp *prop;
+
+    prop = apple_dt_get_prop(node, "name");
+    if (prop == NULL || prop->len == 0) {
+        return NULL;
+    }
+
+    if (memchr(prop->data, '\0', prop->len) == NULL) {
+        *partial = true;
+        return NULL;
+    }
+
+    return prop->data;
+}
+
+static void apple_dt_index_child(AppleDTNode *parent, AppleDTNode *child)
+{
+    const char *name;
+
+    name = apple_dt_node_index_name(child, &parent->child_index_partial);
+    if (name != NULL && !g_hash_table_contains(parent->child_index, name)) {
+        g_hash_table_insert(parent->child_index, (gpointer)name, child);
+    }
+}
+
+/// Index `name` to the first child of `parent` with it, ignoring `skip`.
+static void apple_dt_reindex_name(AppleDTNode *parent, const char *name,
+                                  AppleDTNode *skip)
+{
+    AppleDTNode *child;
+    const char *child_name;
+    GList *iter;
+
+    g_hash_table_remove(parent->child_index, name);
+
+    for (iter = parent->children; iter != NULL; iter = iter->next) {
+        child = iter->data;
+        if (child == skip) {
+            continue;
+        }
+        child_name =
+            apple_dt_node_index_name(child, &parent->child_index_partial);
+        if (child_name != NULL && strcmp(child_name, name) == 0) {
+            g_hash_table_insert(parent->child_index, (gpointer)child_name,
+                                child);
+            return;
+        }
+    }
+}
+
+static void apple_dt_unindex_child(AppleDTNode *parent, AppleDTNode *child)
+{
+    const char *name;
+    bool partial = false;
+
+    name = apple_dt_node_index_name(child, &partial);
+    if (name != NULL &&
+        g_hash_table_lookup(parent->child_index, name) == child) {
+        apple_dt_reindex_name(parent, name, child);
+    }
+}
+
+static AppleDTNode *apple_dt_get_child(AppleDTNode *node, const char *name)
+{
+    AppleDTNode *child;
+    AppleDTProp *prop;
+    GList *iter;
+
+    if (!node->child_index_partial) {
+        return g_hash_table_lookup(node->child_index, name);
+    }
+
+    for (iter = node->children; iter != NULL; iter = iter->next) {
+        child = iter->data;
+
+        prop = apple_dt_get_prop(child, "name");
+
+        if (prop == NULL) {
+            continue;
+        }
+
+        if (strncmp((const char *)prop->data, name, prop->len) == 0) {
+            return child;
+        }
+    }
+
+    return NULL;
 }
 
 AppleDTNode *apple_dt_node_new(AppleDTNode *parent, const char *name)
@@ -91,22 +198,65 @@ AppleDTNode *apple_dt_node_new(AppleDTNode *parent, const char *name)
     }
 
     if (parent != NULL) {
+        node->parent = parent;
         parent->children = g_list_append(parent->children, node);
+        apple_dt_index_child(parent, node);
     }
 
     return node;
 }
 
-static AppleDTProp *apple_dt_deserialise_prop(void **blob, char **name)
+/*
+ * The nodes, properties and values of a deserialised device tree all live in
+ * a single arena, sized by a first pass over the blob. The arena is never
+ * freed, since the device tree lives as long as the machine.
+ */
+typedef struct {
+    AppleDTNode *nodes;
+    AppleDTProp *props;
+    uint8_t *data;
+    uint8_t *blob;
+} AppleDTArena;
+
+static void apple_dt_measure_node(void **blob, uint32_t *node_count,
+                                  uint32_t *prop_count)
+{
+    uint32_t i;
+    uint32_t props;
+    uint32_t children;
+    uint32_t len;
+
+    props = ldl_le_p(*blob);
+    *blob += sizeof(props);
+    children = ldl_le_p(*blob);
+    *blob += sizeof(children);
+
+    *node_count += 1;
+    *prop_count += props;
+
+    for (i = 0; i < props; i++) {
+        *blob += APPLE_DT_PROP_NAME_LEN;
+        len = ldl_le_p(*blob) & ~APPLE_DT_PROP_PLACEHOLDER;
+        *blob += sizeof(uint32_t) + ROUND_UP(len, 4);
+    }
+
+    for (i = 0; i < children; i++) {
+        apple_dt_measure_node(blob, node_count, prop_count);
+    }
+}
+
+static void apple_dt_deserialise_prop(AppleDTArena *arena, void **blob,
+                                      AppleDTNode *node)
 {
     AppleDTProp *prop;
-    size_t name_len;
+    char name[APPLE_DT_PROP_NAME_LEN];
 
-    prop = g_new0(AppleDTProp, 1);
-    name_len = strnlen(*blob, APPLE_DT_PROP_NAME_LEN - 1);
-    *name = g_new(char, name_len + 1);
-    memcpy(*name, *blob, name_len);
-    (*name)[name_len] = '\0';
+    prop = arena->props++;
+    prop->arena = true;
+
+    // Names are truncated to fit a terminator, as always.
+    memcpy(name, *blob, APPLE_DT_PROP_NAME_LEN - 1);
+    name[APPLE_DT_PROP_NAME_LEN - 1] = '\0';
     *blob += APPLE_DT_PROP_NAME_LEN;
 
     prop->len = ldl_le_p(*blob);
@@ -117,50 +267,45 @@ static AppleDTProp *apple_dt_deserialise_prop(void **blob, char **name)
     *blob += sizeof(uint32_t);
 
     if (prop->len != 0) {
-        prop->data = g_malloc0(prop->len);
-        memcpy(prop->data, *blob, prop->len);
+        prop->data = arena->data + (*blob - (void *)arena->blob);
+        prop->arena_data = true;
         *blob += ROUND_UP(prop->len, 4);
     }
 
-    return prop;
+    g_assert_true(g_hash_table_insert(
+        node->props, (gpointer)g_intern_string(name), prop));
 }
 
-static AppleDTNode *apple_dt_deserialise_node(void **blob)
+static AppleDTNode *apple_dt_deserialise_node(AppleDTArena *arena, void **blob,
+                                              AppleDTNode *parent)
 {
     uint32_t i;
     AppleDTNode *node;
     uint32_t prop_count;
     uint32_t children_count;
-    AppleDTNode *child;
-    AppleDTProp *prop;
-    char *key;
 
-    if (blob == NULL || *blob == NULL) {
-        return NULL;
-    }
+    node = arena->nodes++;
+    node->arena = true;
+    node->parent = parent;
+    apple_dt_init_node(node);
 
-    node = apple_dt_new_node();
     prop_count = ldl_le_p(*blob);
     *blob += sizeof(prop_count);
     children_count = ldl_le_p(*blob);
     *blob += sizeof(children_count);
 
     for (i = 0; i < prop_count; i++) {
-        prop = apple_dt_deserialise_prop(blob, &key);
-        if (prop == NULL) {
-            apple_dt_destroy_node(node);
-            return NULL;
-        }
-        g_assert_true(g_hash_table_insert(node->props, key, prop));
+        apple_dt_deserialise_prop(arena, blob, node);
     }
 
     for (i = 0; i < children_count; i++) {
-        child = apple_dt_deserialise_node(blob);
-        if (child == NULL) {
-            apple_dt_destroy_node(node);
-            return NULL;
-        }
-        node->children = g_list_append(node->children, child);
+        node->children = g_list_prepend(
+            node->children, apple_dt_deserialise_node(arena, blob, node));
+    }
+    node->children = g_list_reverse(node->children);
+
+    for (GList *iter = node->children; iter != NULL; iter = iter->next) {
+        apple_dt_index_child(node, iter->data);
     }
 
     return node;
@@ -168,7 +313,37 @@ static AppleDTNode *apple_dt_deserialise_node(void **blob)
 
 AppleDTNode *apple_dt_deserialise(void *blob)
 {
-    return apple_dt_deserialise_node(&blob);
+    AppleDTArena arena;
+    AppleDTNode *root;
+    uint32_t node_count = 0;
+    uint32_t prop_count = 0;
+    void *end = blob;
+    size_t blob_len;
+    size_t len;
+    int64_t start_ns;
+
+    if (blob == NULL) {
+        return NULL;
+    }
+
+    start_ns = get_clock();
+
+    apple_dt_measure_node(&end, &node_count, &prop_count);
+    blob_len = end - blob;
+
+    len = sizeof(AppleDTNode) * node_count + sizeof(AppleDTProp) * prop_count;
+    arena.nodes = g_malloc0(len + blob_len);
+    arena.props = (AppleDTProp *)(arena.nodes + node_count);
+    arena.data = (uint8_t *)(arena.props + prop_count);
+    arena.blob = blob;
+    memcpy(arena.data, blob, blob_len);
+
+    root = apple_dt_deserialise_node(&arena, &blob, NULL);
+
+    trace_apple_dt_deserialise(node_count, prop_count, blob_len,
+                               (get_clock() - start_ns) / SCALE_US);
+
+    return root;
 }
 
 void apple_dt_del_node(AppleDTNode *parent, AppleDTNode *node)
@@ -178,6 +353,7 @@ void apple_dt_del_node(AppleDTNode *parent, AppleDTNode *node)
     g_assert_false(node->finalised);
 
     parent->children = g_list_remove(parent->children, node);
+    apple_dt_unindex_child(parent, node);
     apple_dt_destroy_node(node);
 }
 
@@ -197,6 +373,10 @@ bool apple_dt_del_node_named(AppleDTNode *parent, const char *name)
 
 bool apple_dt_del_prop_named(AppleDTNode *node, const char *name)
 {
+    if (node->parent != NULL && strcmp(name, "name") == 0) {
+        apple_dt_unindex_child(node->parent, node);
+    }
+
     return g_hash_table_remove(node->props, name);
 }
 
@@ -204,31 +384,56 @@ AppleDTProp *apple_dt_set_prop(AppleDTNode *node, const char *name,
                                const uint32_t len, const void *val)
 {
     AppleDTProp *prop;
+    const char *node_name;
+    bool is_name;
 
     g_assert_cmpint(strlen(name), <, APPLE_DT_PROP_NAME_LEN);
 
+    is_name = node->parent != NULL && strcmp(name, "name") == 0;
+    if (is_name) {
+        apple_dt_unindex_child(node->parent, node);
+    }
+
     prop = apple_dt_get_prop(node, name);
 
     if (prop == NULL) {
         g_assert_false(node->finalised);
 
         prop = g_new0(AppleDTProp, 1);
-        g_hash_table_insert(node->props, g_strdup(name), prop);
+        g_hash_table_insert(node->props, (gpointer)g_intern_string(name),
+                            prop);
     } else {
         g_assert_false(node->finalised && prop->len != len);
 
-        g_free(prop->data);
-        *prop = (AppleDTProp){ 0 };
+        // Values of the same length are overwritten in place.
+        if (prop->len != len || len == 0) {
+            if (!prop->arena_data) {
+                g_free(prop->data);
+            }
+            prop->data = NULL;
+            prop->arena_data = false;
+        }
+        prop->placeholder = false;
     }
 
+    if (prop->data == NULL) {
+        prop->data = g_malloc(len);
+    }
     if (val == NULL) {
-        prop->data = g_malloc0(len);
+        memset(prop->data, 0, len);
     } else {
-        prop->data = g_malloc(len);
         memcpy(prop->data, val, len);
     }
     prop->len = len;
 
+    if (is_name) {
+        node_name = apple_dt_node_index_name(
+            node, &node->parent->child_index_partial);
+        if (node_name != NULL) {
+            apple_dt_reindex_name(node->parent, node_name, NULL);
+        }
+    }
+
     return prop;
 }
 
@@ -420,13 +625,9 @@ uint64_t apple_dt_get_prop_u64(AppleDTNode *node, const char *name,
 
 AppleDTNode *apple_dt_get_node(AppleDTNode *node, const char *path)
 {
-    GList *iter;
-    AppleDTProp *prop;
-    AppleDTNode *child;
     char *next;
     char *string;
     const char *token;
-    bool found;
 
     next = string = g_strdup(path);
 
@@ -435,28 +636,7 @@ AppleDTNode *apple_dt_get_node(AppleDTNode *node, const char *path)
             continue;
         }
 
-        found = false;
-
-        for (iter = node->children; iter; iter = iter->next) {
-            child = (AppleDTNode *)iter->data;
-
-            prop = apple_dt_get_prop(child, "name");
-
-            if (prop == NULL) {
-                continue;
-            }
-
-            if (strncmp((const char *)prop->data, token, prop->len) == 0) {
-                node = child;
-                found = true;
-                break;
-            }
-        }
-
-        if (!found) {
-            g_free(string);
-            return NULL;
-        }
+        node = apple_dt_get_child(node, token);
     }
 
     g_free(string);
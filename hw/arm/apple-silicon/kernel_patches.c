@@ -22,6 +22,8 @@
 #include "hw/arm/apple-silicon/patcher.h"
 #include "qemu/bitops.h"
 #include "qemu/error-report.h"
+#include "qemu/timer.h"
+#include "trace.h"
 
 #define NOP (0xD503201F)
 #define MOV_W0_0 (0x52800000)
@@ -761,7 +763,50 @@ static void ck_kp_pmap_cs_enforce_patch(CKPatcherRange *range)
                             sizeof(repl));
 }
 
-void ck_patch_kernel(MachoHeader64 *hdr)
+static void ck_kp_kernel_text_patches(CKPatcherRange *range)
+{
+    ck_kp_mac_mount_patch(range);
+    ck_kp_kprintf_patch(range);
+    ck_kp_cs_patches(range);
+}
+
+// For when AMX is not emulated and must be hidden from the kernel.
+static void ck_kp_kernel_text_no_amx_patches(CKPatcherRange *range)
+{
+    ck_kp_kernel_text_patches(range);
+    ck_kp_amx_patch(range);
+}
+
+static void ck_kp_ppl_text_patches(CKPatcherRange *range)
+{
+    ck_kp_tc_patch(range);
+    ck_kp_pmap_cs_enforce_patch(range);
+}
+
+static void ck_kp_kernel_ppl_text_patches(CKPatcherRange *range)
+{
+    ck_kp_kernel_text_patches(range);
+    ck_kp_ppl_text_patches(range);
+}
+
+static void ck_kp_kernel_ppl_text_no_amx_patches(CKPatcherRange *range)
+{
+    ck_kp_kernel_text_no_amx_patches(range);
+    ck_kp_ppl_text_patches(range);
+}
+
+// Look up all the patterns of `patches` in a single scan of `range`.
+static void ck_kp_batch(CKPatcherRange *range,
+                        void (*patches)(CKPatcherRange *range))
+{
+    ck_patcher_batch_begin(range);
+    patches(range);
+    ck_patcher_batch_scan(range);
+    patches(range);
+    ck_patcher_batch_end(range);
+}
+
+void ck_patch_kernel(MachoHeader64 *hdr, bool amx)
 {
     MachoHeader64 *apfs_hdr;
     g_autofree CKPatcherRange *apfs_text;
@@ -772,10 +817,11 @@ void ck_patch_kernel(MachoHeader64 *hdr)
     g_autofree CKPatcherRange *kernel_text;
     g_autofree CKPatcherRange *kernel_const;
     g_autofree CKPatcherRange *kernel_ppltext;
+    int64_t start_ns = get_clock();
 
     apfs_hdr = ck_kp_find_image_header(hdr, "com.apple.filesystems.apfs");
     apfs_text = ck_kp_find_section_range(apfs_hdr, "__TEXT_EXEC", "__text");
-    ck_kp_apfs_patches(apfs_text);
+    ck_kp_batch(apfs_text, ck_kp_apfs_patches);
     apfs_cstring = ck_kp_find_section_range(apfs_hdr, "__TEXT", "__cstring");
     if (apfs_cstring == NULL) {
         apfs_cstring = ck_kp_find_section_range(hdr, "__TEXT", "__cstring");
@@ -784,7 +830,7 @@ void ck_patch_kernel(MachoHeader64 *hdr)
 
     amfi_text =
         ck_kp_find_image_text(hdr, "com.apple.driver.AppleMobileFileIntegrity");
-    ck_kp_amfi_patches(amfi_text);
+    ck_kp_batch(amfi_text, ck_kp_amfi_patches);
 
     sep_mgr_text =
         ck_kp_find_image_text(hdr, "com.apple.driver.AppleSEPManager");
@@ -794,20 +840,19 @@ void ck_patch_kernel(MachoHeader64 *hdr)
     ck_kp_img4_patches(img4_text);
 
     kernel_text = ck_kp_get_kernel_section(hdr, "__TEXT_EXEC", "__text");
-    ck_kp_mac_mount_patch(kernel_text);
-    ck_kp_kprintf_patch(kernel_text);
-    ck_kp_amx_patch(kernel_text);
-    ck_kp_cs_patches(kernel_text);
     kernel_const = ck_kp_get_kernel_section(hdr, "__TEXT", "__const");
     ck_kp_hactivation_patch(kernel_const);
 
     kernel_ppltext = ck_kp_find_section_range(hdr, "__PPLTEXT", "__text");
     if (kernel_ppltext == NULL) {
         warn_report("Failed to find `__PPLTEXT.__text`.");
-        ck_kp_tc_patch(kernel_text);
-        ck_kp_pmap_cs_enforce_patch(kernel_text);
+        ck_kp_batch(kernel_text, amx ? ck_kp_kernel_ppl_text_patches :
+                                       ck_kp_kernel_ppl_text_no_amx_patches);
     } else {
-        ck_kp_tc_patch(kernel_ppltext);
-        ck_kp_pmap_cs_enforce_patch(kernel_ppltext);
+        ck_kp_batch(kernel_text, amx ? ck_kp_kernel_text_patches :
+                                       ck_kp_kernel_text_no_amx_patches);
+        ck_kp_batch(kernel_ppltext, ck_kp_ppl_text_patches);
     }
+
+    trace_ck_patch_kernel_done((get_clock() - start_ns) / SCALE_US);
 }
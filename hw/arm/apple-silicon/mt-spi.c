@@ -743,16 +743,9 @@ static void apple_mt_spi_handle_fw(AppleMTSPIState *s)
     }
 }
 
-static uint32_t apple_mt_spi_transfer(SSIPeripheral *dev, uint32_t val)
+static uint8_t apple_mt_spi_transfer_byte(AppleMTSPIState *s, uint8_t val)
 {
-    AppleMTSPIState *s;
-    uint8_t ret;
-
-    s = container_of(dev, AppleMTSPIState, parent_obj);
-
-    QEMU_LOCK_GUARD(&s->lock);
-
-    apple_mt_spi_buf_push_byte(&s->rx, (uint8_t)val);
+    apple_mt_spi_buf_push_byte(&s->rx, val);
 
     if (apple_mt_spi_buf_read_byte(&s->rx, 0) == (LL_PACKET_PREAMBLE & 0xFF)) {
         apple_mt_spi_handle_fw(s);
@@ -764,18 +757,55 @@ static uint32_t apple_mt_spi_transfer(SSIPeripheral *dev, uint32_t val)
         apple_mt_spi_buf_free(&s->rx);
     }
 
-    ret = apple_mt_spi_buf_pop(&s->tx);
+    return apple_mt_spi_buf_pop(&s->tx);
+}
 
+static void apple_mt_spi_update_irq(AppleMTSPIState *s)
+{
     if (apple_mt_spi_buf_is_empty(&s->pending_hbpp) &&
         QTAILQ_EMPTY(&s->pending_fw)) {
         qemu_irq_raise(s->irq);
     } else {
         qemu_irq_lower(s->irq);
     }
+}
+
+static uint32_t apple_mt_spi_transfer(SSIPeripheral *dev, uint32_t val)
+{
+    AppleMTSPIState *s;
+    uint8_t ret;
+
+    s = container_of(dev, AppleMTSPIState, parent_obj);
+
+    QEMU_LOCK_GUARD(&s->lock);
+
+    ret = apple_mt_spi_transfer_byte(s, (uint8_t)val);
+    apple_mt_spi_update_irq(s);
 
     return ret;
 }
 
+static void apple_mt_spi_transfer_bulk(SSIPeripheral *dev, const uint8_t *tx,
+                                       uint8_t *rx, size_t len)
+{
+    AppleMTSPIState *s;
+    uint8_t ret;
+    size_t i;
+
+    s = container_of(dev, AppleMTSPIState, parent_obj);
+
+    QEMU_LOCK_GUARD(&s->lock);
+
+    for (i = 0; i < len; i++) {
+        ret = apple_mt_spi_transfer_byte(s, tx == NULL ? 0xFF : tx[i]);
+        if (rx != NULL) {
+            rx[i] = ret;
+        }
+    }
+
+    apple_mt_spi_update_irq(s);
+}
+
 static void apple_mt_spi_send_path_update(AppleMTSPIState *s, uint64_t ts,
                                           uint8_t path_stage)
 {
@@ -1061,6 +1091,7 @@ static void apple_mt_spi_class_init(ObjectClass *klass, const void *data)
 
     k->realize = apple_mt_spi_realize;
     k->transfer = apple_mt_spi_transfer;
+    k->transfer_bulk = apple_mt_spi_transfer_bulk;
 }
 
 static void apple_mt_instance_init(Object *obj)
@@ -19,6 +19,7 @@
 
 #include "hw/arm/apple-silicon/patcher.h"
 #include "qemu/bswap.h"
+#include "qemu/host-utils.h"
 #include "qemu/error-report.h"
 
 CKPatcherRange *ck_patcher_range_from_ptr(const char *name, void *ptr,
@@ -32,15 +33,193 @@ CKPatcherRange *ck_patcher_range_from_ptr(const char *name, void *ptr,
     return range;
 }
 
+typedef struct {
+    const uint8_t *pattern;
+    const uint8_t *mask;
+    size_t len;
+    size_t align;
+    /// Offset of the byte the pattern is keyed on in the scan.
+    size_t key_off;
+    GArray *matches;
+} CKPatcherBatchEntry;
+
+struct CKPatcherBatch {
+    bool scanned;
+    GPtrArray *entries;
+    /// Entries by the value of their key byte.
+    GPtrArray *table[256];
+};
+
+static inline uint8_t ck_patcher_mask_at(const uint8_t *mask, size_t i)
+{
+    return mask == NULL ? 0xFF : mask[i];
+}
+
+static bool ck_patcher_match(const uint8_t *buffer, const uint8_t *pattern,
+                             const uint8_t *mask, size_t len)
+{
+    size_t i;
+
+    if (mask == NULL) {
+        return memcmp(buffer, pattern, len) == 0;
+    }
+
+    for (i = 0; i < len; ++i) {
+        if ((buffer[i] & mask[i]) != pattern[i]) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static void ck_patcher_batch_entry_free(gpointer data)
+{
+    CKPatcherBatchEntry *entry = data;
+
+    g_array_free(entry->matches, true);
+    g_free(entry);
+}
+
+static CKPatcherBatchEntry *ck_patcher_batch_lookup(CKPatcherBatch *batch,
+                                                    const uint8_t *pattern,
+                                                    const uint8_t *mask,
+                                                    size_t len, size_t align)
+{
+    CKPatcherBatchEntry *entry;
+    guint i;
+
+    for (i = 0; i < batch->entries->len; ++i) {
+        entry = g_ptr_array_index(batch->entries, i);
+        if (entry->pattern == pattern && entry->mask == mask &&
+            entry->len == len && entry->align == align) {
+            return entry;
+        }
+    }
+
+    return NULL;
+}
+
+static void ck_patcher_batch_add(CKPatcherBatch *batch, const uint8_t *pattern,
+                                 const uint8_t *mask, size_t len, size_t align)
+{
+    CKPatcherBatchEntry *entry;
+    int best_bits = -1;
+    size_t i;
+
+    if (ck_patcher_batch_lookup(batch, pattern, mask, len, align) != NULL) {
+        return;
+    }
+
+    entry = g_new0(CKPatcherBatchEntry, 1);
+    entry->pattern = pattern;
+    entry->mask = mask;
+    entry->len = len;
+    entry->align = align;
+    entry->matches = g_array_new(false, false, sizeof(size_t));
+
+    // Key on the most specific byte, preferring non-zero bytes, as zero
+    // padding is everywhere. For instructions, this favours the opcode byte.
+    for (i = align - 1; i < len; i += align) {
+        int bits = ctpop8(ck_patcher_mask_at(mask, i)) * 2 + (pattern[i] != 0);
+        if (bits > best_bits) {
+            best_bits = bits;
+            entry->key_off = i;
+        }
+    }
+
+    g_ptr_array_add(batch->entries, entry);
+}
+
+void ck_patcher_batch_begin(CKPatcherRange *range)
+{
+    g_assert_null(range->batch);
+
+    range->batch = g_new0(CKPatcherBatch, 1);
+    range->batch->entries =
+        g_ptr_array_new_with_free_func(ck_patcher_batch_entry_free);
+}
+
+void ck_patcher_batch_scan(CKPatcherRange *range)
+{
+    CKPatcherBatch *batch = range->batch;
+    CKPatcherBatchEntry *entry;
+    const uint8_t *ptr = range->ptr;
+    GPtrArray *bucket;
+    uint8_t key_mask;
+    size_t start;
+    size_t i;
+    guint j;
+    int v;
+
+    g_assert_nonnull(batch);
+    g_assert_false(batch->scanned);
+
+    for (j = 0; j < batch->entries->len; ++j) {
+        entry = g_ptr_array_index(batch->entries, j);
+        key_mask = ck_patcher_mask_at(entry->mask, entry->key_off);
+        for (v = 0; v < ARRAY_SIZE(batch->table); ++v) {
+            if ((v & key_mask) != entry->pattern[entry->key_off]) {
+                continue;
+            }
+            if (batch->table[v] == NULL) {
+                batch->table[v] = g_ptr_array_new();
+            }
+            g_ptr_array_add(batch->table[v], entry);
+        }
+    }
+
+    for (i = 0; i < range->length; ++i) {
+        bucket = batch->table[ptr[i]];
+        if (bucket == NULL) {
+            continue;
+        }
+
+        for (j = 0; j < bucket->len; ++j) {
+            entry = g_ptr_array_index(bucket, j);
+            if (i < entry->key_off) {
+                continue;
+            }
+            start = i - entry->key_off;
+            if (start % entry->align != 0 ||
+                range->length - start < entry->len) {
+                continue;
+            }
+            if (ck_patcher_match(ptr + start, entry->pattern, entry->mask,
+                                 entry->len)) {
+                g_array_append_val(entry->matches, start);
+            }
+        }
+    }
+
+    batch->scanned = true;
+}
+
+void ck_patcher_batch_end(CKPatcherRange *range)
+{
+    CKPatcherBatch *batch = range->batch;
+    int v;
+
+    g_assert_nonnull(batch);
+
+    for (v = 0; v < ARRAY_SIZE(batch->table); ++v) {
+        if (batch->table[v] != NULL) {
+            g_ptr_array_free(batch->table[v], true);
+        }
+    }
+    g_ptr_array_free(batch->entries, true);
+    g_free(batch);
+    range->batch = NULL;
+}
+
 bool ck_patcher_find_callback_ctx(CKPatcherRange *range, const char *name,
                                   const uint8_t *pattern, const uint8_t *mask,
                                   size_t len, size_t align, void *ctx,
                                   CKPatcherCallback callback)
 {
+    CKPatcherBatchEntry *entry = NULL;
     size_t i;
-    size_t match_i;
     uint8_t *match;
-    bool found;
 
     if (align == 0) {
         align = 1;
@@ -53,36 +232,35 @@ bool ck_patcher_find_callback_ctx(CKPatcherRange *range, const char *name,
         return false;
     }
 
-    if (mask == NULL) {
-        for (i = 0; i < range->length; i += align) {
-            found = true;
-            match = range->ptr + i;
-            for (match_i = 0; match_i < len; ++match_i) {
-                if (match[match_i] != pattern[match_i]) {
-                    found = false;
-                    break;
-                }
-            }
-            if (found && callback(ctx, match)) {
+    if (mask != NULL) {
+        for (i = 0; i < len; ++i) {
+            g_assert_cmphex(pattern[i] & mask[i], ==, pattern[i]);
+        }
+    }
+
+    if (range->batch != NULL) {
+        if (!range->batch->scanned) {
+            ck_patcher_batch_add(range->batch, pattern, mask, len, align);
+            return false;
+        }
+        entry =
+            ck_patcher_batch_lookup(range->batch, pattern, mask, len, align);
+    }
+
+    if (entry != NULL) {
+        for (i = 0; i < entry->matches->len; ++i) {
+            match = range->ptr + g_array_index(entry->matches, size_t, i);
+            if (ck_patcher_match(match, pattern, mask, len) &&
+                callback(ctx, match)) {
                 info_report("`%s` patch applied in `%s`.", name, range->name);
                 return true;
             }
         }
     } else {
-        for (i = 0; i < len; ++i) {
-            g_assert_cmphex(pattern[i] & mask[i], ==, pattern[i]);
-        }
-
-        for (i = 0; i < range->length; i += align) {
-            found = true;
+        for (i = 0; i <= range->length - len; i += align) {
             match = range->ptr + i;
-            for (match_i = 0; match_i < len; ++match_i) {
-                if ((match[match_i] & mask[match_i]) != pattern[match_i]) {
-                    found = false;
-                    break;
-                }
-            }
-            if (found && callback(ctx, match)) {
+            if (ck_patcher_match(match, pattern, mask, len) &&
+                callback(ctx, match)) {
                 info_report("`%s` patch applied in `%s`.", name, range->name);
                 return true;
             }
@@ -192,7 +192,7 @@ static void s8000_create_s3c_uart(const AppleS8000MachineState *s8000,
 
 static void s8000_patch_kernel(MachoHeader64 *header)
 {
-    ck_patch_kernel(header);
+    ck_patch_kernel(header, false);
 }
 
 static bool s8000_check_panic(AppleS8000MachineState *s8000)
@@ -313,7 +313,8 @@ static void s8000_load_kernelcache(AppleS8000MachineState *s8000,
     if (machine->initrd_filename) {
         info->ramdisk_addr = phys_ptr;
         apple_boot_load_ramdisk(machine->initrd_filename, &address_space_memory,
-                                info->ramdisk_addr, &info->ramdisk_size);
+                                info->ramdisk_addr, &info->ramdisk_size,
+                                &s8000->ramdisk_mr);
         info->ramdisk_size = ROUND_UP_16K(info->ramdisk_size);
         phys_ptr += info->ramdisk_size;
     }
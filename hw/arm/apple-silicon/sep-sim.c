@@ -299,19 +299,18 @@ static void apple_sep_sim_send_message(AppleSEPSimState *s, uint8_t ep,
                                        uint32_t data)
 {
     AppleA7IOP *a7iop;
-    AppleA7IOPMessage *sent_msg;
+    AppleA7IOPMessage sent_msg = { 0 };
     SEPMessage *sent_sep_msg;
 
     a7iop = APPLE_A7IOP(s);
 
-    sent_msg = g_new0(AppleA7IOPMessage, 1);
-    sent_sep_msg = (SEPMessage *)sent_msg->data;
+    sent_sep_msg = (SEPMessage *)sent_msg.data;
     sent_sep_msg->ep = ep;
     sent_sep_msg->tag = tag;
     sent_sep_msg->op = op;
     sent_sep_msg->param = param;
     sent_sep_msg->data = data;
-    apple_a7iop_send_ap(a7iop, sent_msg);
+    apple_a7iop_send_ap(a7iop, &sent_msg);
 }
 
 static void apple_sep_sim_message_reply(AppleSEPSimState *s, SEPMessage *msg,
@@ -511,7 +510,7 @@ static const uint32_t apple_sep_sim_endpoint_names[] = {
 static void apple_sep_sim_advertise_eps(AppleSEPSimState *s)
 {
     AppleA7IOP *a7iop;
-    AppleA7IOPMessage *msg;
+    AppleA7IOPMessage msg;
     EPAdvertisementMessage *ep_advert_msg;
     OOLAdvertisementMessage *ool_advert_msg;
     size_t i;
@@ -520,22 +519,22 @@ static void apple_sep_sim_advertise_eps(AppleSEPSimState *s)
 
     for (i = 0; i < (sizeof(apple_sep_sim_eps) / sizeof(*apple_sep_sim_eps));
          i++) {
-        msg = g_new0(AppleA7IOPMessage, 1);
-        ep_advert_msg = (EPAdvertisementMessage *)msg->data;
+        memset(&msg, 0, sizeof(msg));
+        ep_advert_msg = (EPAdvertisementMessage *)msg.data;
         ep_advert_msg->ep = EP_DISCOVERY;
         ep_advert_msg->op = DISCOVERY_OP_EP_ADVERT;
         ep_advert_msg->id = apple_sep_sim_eps[i];
         ep_advert_msg->name = apple_sep_sim_endpoint_names[i];
-        apple_a7iop_send_ap(a7iop, msg);
+        apple_a7iop_send_ap(a7iop, &msg);
 
-        msg = g_new0(AppleA7IOPMessage, 1);
-        ool_advert_msg = (OOLAdvertisementMessage *)msg->data;
+        memset(&msg, 0, sizeof(msg));
+        ool_advert_msg = (OOLAdvertisementMessage *)msg.data;
         ool_advert_msg->ep = EP_DISCOVERY;
         ool_advert_msg->op = DISCOVERY_OP_OOL_ADVERT;
         ool_advert_msg->id = apple_sep_sim_eps[i];
         memcpy(&ool_advert_msg->ool_info, s->ool_info + apple_sep_sim_eps[i],
                sizeof(AppleSEPSimOOLInfo));
-        apple_a7iop_send_ap(a7iop, msg);
+        apple_a7iop_send_ap(a7iop, &msg);
     }
 }
 
@@ -987,14 +986,16 @@ static void apple_sep_sim_handle_messages(void *opaque)
 {
     AppleSEPSimState *s = opaque;
     AppleA7IOP *a7iop = opaque;
-    AppleA7IOPMessage *msg;
+    AppleA7IOPMessage msg;
     SEPMessage *sep_msg;
 
     QEMU_LOCK_GUARD(&s->lock);
 
     while (!apple_a7iop_mailbox_is_empty(a7iop->iop_mailbox)) {
-        msg = apple_a7iop_recv_iop(a7iop);
-        sep_msg = (SEPMessage *)msg->data;
+        if (!apple_a7iop_recv_iop(a7iop, &msg)) {
+            break;
+        }
+        sep_msg = (SEPMessage *)msg.data;
 
         switch (sep_msg->ep) {
         case EP_CONTROL:
@@ -1036,8 +1037,6 @@ static void apple_sep_sim_handle_messages(void *opaque)
                           sep_msg->op);
             break;
         }
-
-        g_free(msg);
     }
 }
 
@@ -1089,7 +1088,7 @@ static void apple_sep_sim_reset_hold(Object *obj, ResetType type)
     AppleSEPSimClass *sc;
     AppleA7IOP *a7iop;
     size_t i;
-    AppleA7IOPMessage *msg;
+    AppleA7IOPMessage msg = { 0 };
     SEPMessage *sep_msg;
 
     s = APPLE_SEP_SIM(obj);
@@ -1141,12 +1140,11 @@ static void apple_sep_sim_reset_hold(Object *obj, ResetType type)
 
     s->status = SEP_STATUS_BOOTSTRAP;
 
-    msg = g_new0(AppleA7IOPMessage, 1);
-    sep_msg = (SEPMessage *)msg->data;
+    sep_msg = (SEPMessage *)msg.data;
     sep_msg->ep = EP_BOOTSTRAP;
     sep_msg->op = BOOTSTRAP_OP_ANNOUNCE_STATUS;
     sep_msg->data = s->status;
-    apple_a7iop_send_ap(a7iop, msg);
+    apple_a7iop_send_ap(a7iop, &msg);
 }
 
 static void apple_sep_sim_class_init(ObjectClass *klass, const void *data)
@@ -3680,18 +3680,17 @@ static void apple_sep_send_message(AppleSEPState *s, uint8_t ep, uint8_t tag,
                                    uint8_t op, uint8_t param, uint32_t data)
 {
     AppleA7IOP *a7iop = &s->parent_obj;
-    AppleA7IOPMessage *sent_msg;
+    AppleA7IOPMessage sent_msg = { 0 };
     SEPMessage *sent_sep_msg;
 
-    sent_msg = g_new0(AppleA7IOPMessage, 1);
-    sent_sep_msg = (SEPMessage *)sent_msg->data;
+    sent_sep_msg = (SEPMessage *)sent_msg.data;
     sent_sep_msg->ep = ep;
     sent_sep_msg->tag = tag;
     sent_sep_msg->op = op;
     sent_sep_msg->param = param;
     sent_sep_msg->data = data;
-    ////apple_a7iop_send_ap(a7iop, sent_msg);
-    apple_a7iop_send_iop(a7iop, sent_msg);
+    ////apple_a7iop_send_ap(a7iop, &sent_msg);
+    apple_a7iop_send_iop(a7iop, &sent_msg);
 }
 
 static void progress_reg_write(void *opaque, hwaddr addr, uint64_t data,
@@ -239,9 +239,10 @@ static void t8030_create_s3c_uart(const AppleT8030MachineState *t8030,
     dev->id = g_strdup(name);
 }
 
-static void t8030_patch_kernel(MachoHeader64 *header, uint32_t build_version)
+static void t8030_patch_kernel(MachoHeader64 *header, uint32_t build_version,
+                               bool amx)
 {
-    ck_patch_kernel(header);
+    ck_patch_kernel(header, amx);
 }
 
 static bool t8030_check_panic(AppleT8030MachineState *t8030)
@@ -347,7 +348,8 @@ static void t8030_load_kernelcache(AppleT8030MachineState *t8030,
     if (machine->initrd_filename != NULL) {
         info->ramdisk_addr = phys_ptr;
         apple_boot_load_ramdisk(machine->initrd_filename, &address_space_memory,
-                                info->ramdisk_addr, &info->ramdisk_size);
+                                info->ramdisk_addr, &info->ramdisk_size,
+                                &t8030->ramdisk_mr);
         info->ramdisk_size = ROUND_UP_16K(info->ramdisk_size);
         phys_ptr += info->ramdisk_size;
     }
@@ -998,6 +1000,8 @@ static void t8030_cpu_setup(AppleT8030MachineState *t8030)
 
         t8030->cpus[i] = apple_a13_from_node(node);
         cluster_id = t8030->cpus[i]->cluster_id;
+        object_property_set_bool(OBJECT(t8030->cpus[i]), "amx", t8030->amx,
+                                 &error_fatal);
 
         object_property_add_child(OBJECT(&t8030->clusters[cluster_id]),
                                   DEVICE(t8030->cpus[i])->id,
@@ -2621,6 +2625,8 @@ static void t8030_init_done(Notifier *notifier, void *data)
 static void t8030_init(MachineState *machine)
 {
     AppleT8030MachineState *t8030;
+    g_autofree char *kc_cache_key = NULL;
+    bool kernel_cached = false;
     vaddr kc_end;
     uint32_t build_version;
     AppleDTNode *child;
@@ -2702,7 +2708,21 @@ static void t8030_init(MachineState *machine)
         return;
     }
 
-    t8030->kernel = apple_boot_load_kernel(machine->kernel_filename, NULL);
+    if (t8030->kc_cache_dir != NULL && t8030->securerom_filename == NULL) {
+        kc_cache_key = apple_boot_kernel_cache_key(
+            machine->kernel_filename,
+            t8030->amx ? "t8030-amx-" CK_PATCH_SET_VERSION :
+                         "t8030-" CK_PATCH_SET_VERSION);
+        if (kc_cache_key != NULL) {
+            t8030->kernel = apple_boot_load_cached_kernel(t8030->kc_cache_dir,
+                                                          kc_cache_key);
+            kernel_cached = t8030->kernel != NULL;
+        }
+    }
+
+    if (!kernel_cached) {
+        t8030->kernel = apple_boot_load_kernel(machine->kernel_filename, NULL);
+    }
     if (t8030->kernel == NULL) {
         error_setg(&error_fatal, "Failed to load kernel");
         return;
@@ -2739,7 +2759,13 @@ static void t8030_init(MachineState *machine)
 
         g_phys_base = (hwaddr)apple_boot_get_macho_buffer(t8030->kernel);
 
-        t8030_patch_kernel(t8030->kernel, build_version);
+        if (!kernel_cached) {
+            t8030_patch_kernel(t8030->kernel, build_version, t8030->amx);
+            if (kc_cache_key != NULL) {
+                apple_boot_store_cached_kernel(t8030->kc_cache_dir,
+                                               kc_cache_key, t8030->kernel);
+            }
+        }
 
         t8030->trustcache = apple_boot_load_trustcache_file(
             t8030->trustcache_filename, &t8030->boot_info.trustcache_size);
@@ -2951,12 +2977,14 @@ static char *t8030_get_boot_mode(Object *obj, Error **errp)
 PROP_VISIT_GETTER_SETTER(uint64, ecid);
 PROP_GETTER_SETTER(bool, kaslr_off);
 PROP_GETTER_SETTER(bool, force_dfu);
+PROP_GETTER_SETTER(bool, amx);
 PROP_GETTER_SETTER(int, usb_conn_type);
 PROP_STR_GETTER_SETTER(trustcache_filename);
 PROP_STR_GETTER_SETTER(ticket_filename);
 PROP_STR_GETTER_SETTER(sep_rom_filename);
 PROP_STR_GETTER_SETTER(sep_fw_filename);
 PROP_STR_GETTER_SETTER(securerom_filename);
+PROP_STR_GETTER_SETTER(kc_cache_dir);
 PROP_STR_GETTER_SETTER(usb_conn_addr);
 PROP_VISIT_GETTER_SETTER(uint16, usb_conn_port);
 PROP_STR_GETTER_SETTER(model_number);
@@ -3004,6 +3032,11 @@ static void t8030_class_init(ObjectClass *klass, const void *data)
                                   t8030_get_securerom_filename,
                                   t8030_set_securerom_filename);
     object_class_property_set_description(klass, "securerom", "SecureROM");
+    object_class_property_add_str(klass, "kc-cache-dir",
+                                  t8030_get_kc_cache_dir,
+                                  t8030_set_kc_cache_dir);
+    object_class_property_set_description(klass, "kc-cache-dir",
+                                          "Kernelcache Cache Directory");
     oprop = object_class_property_add_str(
         klass, "boot-mode", t8030_get_boot_mode, t8030_set_boot_mode);
     object_property_set_default_str(oprop, "auto");
@@ -3018,6 +3051,9 @@ static void t8030_class_init(ObjectClass *klass, const void *data)
     object_class_property_add_bool(klass, "force-dfu", t8030_get_force_dfu,
                                    t8030_set_force_dfu);
     object_class_property_set_description(klass, "force-dfu", "Force DFU");
+    object_class_property_add_bool(klass, "amx", t8030_get_amx, t8030_set_amx);
+    object_class_property_set_description(
+        klass, "amx", "Emulate AMX instead of patching it out of the kernel");
     object_class_property_add_enum(
         klass, "usb-conn-type", "USBTCPRemoteConnType",
         &USBTCPRemoteConnType_lookup, t8030_get_usb_conn_type,
@@ -28,6 +28,7 @@
 #include "qemu/cutils.h"
 #include "qemu/log.h"
 #include "system/dma.h"
+#include "system/tcg.h"
 #include "ui/console.h"
 
 #ifdef CONFIG_PIXMAN
@@ -97,6 +98,10 @@ typedef struct {
     uint32_t pixel_format;
     uint16_t dest_width;
     uint16_t dest_height;
+    uint16_t dest_x;
+    uint16_t dest_y;
+    uint16_t src_x;
+    uint16_t src_y;
     uint32_t data_start;
     uint32_t data_end;
     uint32_t stride;
@@ -107,6 +112,11 @@ typedef struct {
     uint32_t buf_capacity;
     /// Cached image, to not remake it every single run.
     pixman_image_t *image;
+    /// RAM the mapped source surface lives in, tracked for dirty scanlines.
+    MemoryRegion *log_mr;
+    ram_addr_t log_off;
+    /// Redraw the whole surface on the next frame.
+    bool full_update;
 } ADPV4GenPipeState;
 
 typedef struct {
@@ -115,10 +125,20 @@ typedef struct {
     ADPV4GenPipeState state;
 } ADPV4GenPipe;
 
+static int adp_v4_gp_post_load(void *opaque, int version_id)
+{
+    ADPV4GenPipe *genpipe = opaque;
+
+    genpipe->state.full_update = true;
+
+    return 0;
+}
+
 static const VMStateDescription vmstate_adp_v4_gp = {
     .name = "ADPV4GenPipe",
-    .version_id = 0,
+    .version_id = 1,
     .minimum_version_id = 0,
+    .post_load = adp_v4_gp_post_load,
     .fields =
         (const VMStateField[]){
             VMSTATE_UINT8(index, ADPV4GenPipe),
@@ -131,6 +151,10 @@ static const VMStateDescription vmstate_adp_v4_gp = {
             VMSTATE_UINT32(state.stride, ADPV4GenPipe),
             VMSTATE_UINT16(state.src_width, ADPV4GenPipe),
             VMSTATE_UINT16(state.src_height, ADPV4GenPipe),
+            VMSTATE_UINT16_V(state.dest_x, ADPV4GenPipe, 1),
+            VMSTATE_UINT16_V(state.dest_y, ADPV4GenPipe, 1),
+            VMSTATE_UINT16_V(state.src_x, ADPV4GenPipe, 1),
+            VMSTATE_UINT16_V(state.src_y, ADPV4GenPipe, 1),
             VMSTATE_UINT32(state.buf_len, ADPV4GenPipe),
             VMSTATE_UINT32(state.buf_capacity, ADPV4GenPipe),
             VMSTATE_VBUFFER_ALLOC_UINT32(state.buf, ADPV4GenPipe, 0, NULL,
@@ -355,6 +379,7 @@ static void adp_v4_gp_image_changed_check(ADPV4GenPipe *genpipe, uint32_t old,
 
     qemu_pixman_image_unref(genpipe->state.image);
     genpipe->state.image = NULL;
+    genpipe->state.full_update = true;
 }
 
 #define ADP_V4_GP_REG_WRITE_SET_WITH_CHECK_VAL(_field, _val)                \
@@ -372,6 +397,9 @@ static void adp_v4_gp_reg_write(ADPV4GenPipe *genpipe, hwaddr addr,
     switch (addr >> 2) {
     case R_GP_CONFIG_CONTROL: {
         ADP_INFO("gp%d: control <- 0x" HWADDR_FMT_plx, genpipe->index, data);
+        if (genpipe->state.config_control != (uint32_t)data) {
+            genpipe->state.full_update = true;
+        }
         genpipe->state.config_control = (uint32_t)data;
         break;
     }
@@ -384,6 +412,9 @@ static void adp_v4_gp_reg_write(ADPV4GenPipe *genpipe, hwaddr addr,
     case R_GP_LAYER_0_DATA_START: {
         ADP_INFO("gp%d: layer 0 data start <- 0x" HWADDR_FMT_plx,
                  genpipe->index, data);
+        if (genpipe->state.data_start != (uint32_t)data) {
+            genpipe->state.full_update = true;
+        }
         genpipe->state.data_start = (uint32_t)data;
         break;
     }
@@ -408,9 +439,26 @@ static void adp_v4_gp_reg_write(ADPV4GenPipe *genpipe, hwaddr addr,
                  genpipe->state.src_height);
         break;
     }
+    case R_GP_SRC_POSITION: {
+        ADP_V4_GP_REG_WRITE_SET_WITH_CHECK_VAL(src_y, data & 0xFFFF);
+        ADP_V4_GP_REG_WRITE_SET_WITH_CHECK_VAL(src_x, (data >> 16) & 0xFFFF);
+        ADP_INFO("gp%d: src position <- 0x" HWADDR_FMT_plx " (%d, %d)",
+                 genpipe->index, data, genpipe->state.src_x,
+                 genpipe->state.src_y);
+        break;
+    }
+    case R_GP_DEST_POSITION: {
+        ADP_V4_GP_REG_WRITE_SET_WITH_CHECK_VAL(dest_y, data & 0xFFFF);
+        ADP_V4_GP_REG_WRITE_SET_WITH_CHECK_VAL(dest_x, (data >> 16) & 0xFFFF);
+        ADP_INFO("gp%d: dest position <- 0x" HWADDR_FMT_plx " (%d, %d)",
+                 genpipe->index, data, genpipe->state.dest_x,
+                 genpipe->state.dest_y);
+        break;
+    }
     case R_GP_DEST_DIMENSIONS: {
-        genpipe->state.dest_height = data & 0xFFFF;
-        genpipe->state.dest_width = (data >> 16) & 0xFFFF;
+        ADP_V4_GP_REG_WRITE_SET_WITH_CHECK_VAL(dest_height, data & 0xFFFF);
+        ADP_V4_GP_REG_WRITE_SET_WITH_CHECK_VAL(dest_width,
+                                               (data >> 16) & 0xFFFF);
         ADP_INFO("gp%d: dest dimensions <- 0x" HWADDR_FMT_plx " (%dx%d)",
                  genpipe->index, data, genpipe->state.dest_width,
                  genpipe->state.dest_height);
@@ -459,6 +507,12 @@ static uint32_t adp_v4_gp_reg_read(ADPV4GenPipe *genpipe, hwaddr addr)
         return ((uint32_t)genpipe->state.src_width << 16) |
                genpipe->state.src_height;
     }
+    case R_GP_SRC_POSITION: {
+        return ((uint32_t)genpipe->state.src_x << 16) | genpipe->state.src_y;
+    }
+    case R_GP_DEST_POSITION: {
+        return ((uint32_t)genpipe->state.dest_x << 16) | genpipe->state.dest_y;
+    }
     case R_GP_DEST_DIMENSIONS: {
         ADP_INFO("gp%d: dest dimensions -> 0x%X (%dx%d)", genpipe->index,
                  (genpipe->state.dest_width << 16) | genpipe->state.dest_height,
@@ -474,11 +528,22 @@ static uint32_t adp_v4_gp_reg_read(ADPV4GenPipe *genpipe, hwaddr addr)
     }
 }
 
+static void adp_v4_gp_stop_dirty_tracking(ADPV4GenPipe *genpipe)
+{
+    if (genpipe->state.log_mr != NULL) {
+        memory_region_unref(genpipe->state.log_mr);
+        genpipe->state.log_mr = NULL;
+    }
+    genpipe->state.full_update = true;
+}
+
 static void adp_v4_gp_reset(ADPV4GenPipe *genpipe)
 {
+    adp_v4_gp_stop_dirty_tracking(genpipe);
     qemu_pixman_image_unref(genpipe->state.image);
     g_free(genpipe->state.buf);
     genpipe->state = (ADPV4GenPipeState){ 0 };
+    genpipe->state.full_update = true;
 }
 
 static void adp_v4_blend_reg_write(ADPV4BlendUnitState *blend, uint64_t addr,
@@ -524,7 +589,13 @@ static uint64_t adp_v4_blend_reg_read(ADPV4BlendUnitState *blend, uint64_t addr)
 
 static void adp_v4_blend_reset(ADPV4BlendUnitState *blend)
 {
+    uint32_t i;
+
     *blend = (ADPV4BlendUnitState){ 0 };
+    // Layer N shows GenPipe N until the guest says otherwise.
+    for (i = 0; i < ADP_V4_LAYER_COUNT; ++i) {
+        blend->layer_config[i] = i;
+    }
 }
 
 static void adp_v4_reg_write(void *opaque, hwaddr addr, uint64_t data,
@@ -548,6 +619,8 @@ static void adp_v4_reg_write(void *opaque, hwaddr addr, uint64_t data,
 
     if (addr >= BLEND_BLOCK_BASE &&
         addr < (BLEND_BLOCK_BASE + BLEND_BLOCK_SIZE)) {
+        adp->genpipe[0].state.full_update = true;
+        adp->genpipe[1].state.full_update = true;
         return adp_v4_blend_reg_write(&adp->blend_unit, addr - BLEND_BLOCK_BASE,
                                       data);
     }
@@ -641,6 +714,10 @@ static const MemoryRegionOps adp_v4_reg_ops = {
 
 static void adp_v4_invalidate(void *opaque)
 {
+    AppleDisplayPipeV4State *adp = opaque;
+
+    adp->genpipe[0].state.full_update = true;
+    adp->genpipe[1].state.full_update = true;
 }
 
 static void adp_v4_gfx_update(void *opaque)
@@ -721,6 +798,7 @@ static void adp_v4_draw_boot_splash(void *opaque)
                            ctx->dest_width);
 
     dpy_gfx_update_full(ctx->adp->console);
+    adp_v4_invalidate(ctx->adp);
 }
 
 static void adp_v4_draw_boot_splash_timer(void *opaque)
@@ -889,51 +967,358 @@ static void adp_v4_register_types(void)
 
 type_init(adp_v4_register_types);
 
-// TODO: handle source/dest position, etc.
-static void adp_v4_gp_draw(ADPV4GenPipe *genpipe, AddressSpace *dma_as,
-                           pixman_image_t *disp_image, QemuConsole *console)
+/*
+ * Map the source surface for direct scan-out. Returns NULL if the surface
+ * cannot be mapped as a single contiguous host range, in which case the
+ * caller must fall back to copying it with `adp_v4_gp_read`.
+ */
+static void *adp_v4_gp_map(ADPV4GenPipe *genpipe, AddressSpace *dma_as,
+                           dma_addr_t *len)
 {
-    pixman_format_code_t fmt;
+    dma_addr_t want;
+    void *ptr;
+
+    if (genpipe->state.pixel_format & GP_PIXEL_FORMAT_COMPRESSED) {
+        return NULL;
+    }
+
+    want = (dma_addr_t)genpipe->state.src_height * genpipe->state.stride;
+    if (want == 0) {
+        return NULL;
+    }
+
+    *len = want;
+    ptr = dma_memory_map(dma_as, genpipe->state.data_start, len,
+                         DMA_DIRECTION_TO_DEVICE, MEMTXATTRS_UNSPECIFIED);
+    if (ptr == NULL) {
+        return NULL;
+    }
+
+    if (*len != want) {
+        ADP_INFO("gp%d: surface is not contiguous, copying.", genpipe->index);
+        dma_memory_unmap(dma_as, ptr, *len, DMA_DIRECTION_TO_DEVICE, 0);
+        return NULL;
+    }
+
+    return ptr;
+}
+
+/*
+ * Track guest writes to the RAM backing the mapped source surface, call
+ * with the GenPipe lock held. Returns the scanlines written since the
+ * previous frame, or NULL if the whole surface has to be redrawn.
+ *
+ * TCG sets the VGA dirty bits on every CPU store to RAM, so logging is not
+ * turned on for the region; that would tax stores to all of guest RAM.
+ * Clearing the bits only re-arms the write tracking for the surface pages.
+ */
+static DirtyBitmapSnapshot *adp_v4_gp_snapshot_dirty(ADPV4GenPipe *genpipe,
+                                                     void *map, dma_addr_t len)
+{
+    DirtyBitmapSnapshot *snap;
+    MemoryRegion *mr;
+    ram_addr_t off;
+    bool full;
+
+    mr = memory_region_from_host(map, &off);
+    if (mr == NULL || !tcg_enabled()) {
+        adp_v4_gp_stop_dirty_tracking(genpipe);
+        return NULL;
+    }
+
+    full = genpipe->state.full_update;
+    if (mr != genpipe->state.log_mr) {
+        adp_v4_gp_stop_dirty_tracking(genpipe);
+        memory_region_ref(mr);
+        genpipe->state.log_mr = mr;
+        full = true;
+    } else if (off != genpipe->state.log_off) {
+        full = true;
+    }
+    genpipe->state.log_off = off;
+    genpipe->state.full_update = false;
+
+    snap =
+        memory_region_snapshot_and_clear_dirty(mr, off, len, DIRTY_MEMORY_VGA);
+    if (full) {
+        g_free(snap);
+        return NULL;
+    }
+    return snap;
+}
+
+static bool adp_v4_gp_row_dirty(ADPV4GenPipe *genpipe, DirtyBitmapSnapshot *snap,
+                                uint32_t y)
+{
+    if (snap == NULL) {
+        return true;
+    }
+    if (y >= genpipe->state.src_height) {
+        return false;
+    }
+    return memory_region_snapshot_get_dirty(
+        genpipe->state.log_mr, snap,
+        genpipe->state.log_off + (hwaddr)genpipe->state.stride * y,
+        genpipe->state.stride);
+}
+
+typedef struct {
+    ADPV4GenPipe *genpipe;
+    uint8_t mode;
     pixman_image_t *image;
+    /// Opaque view of `image`, blended through `image` as mask for ALPHA.
+    pixman_image_t *color;
+    DirtyBitmapSnapshot *snap;
+    void *map;
+    dma_addr_t map_len;
+    pixman_box32_t dest;
+} ADPV4BlendLayer;
+
+static pixman_format_code_t adp_v4_opaque_fmt(pixman_format_code_t fmt)
+{
+    switch (fmt) {
+    case PIXMAN_b8g8r8a8:
+        return PIXMAN_b8g8r8x8;
+    case PIXMAN_a8r8g8b8:
+        return PIXMAN_x8r8g8b8;
+    default:
+        return fmt;
+    }
+}
+
+static bool adp_v4_blend_mode_opaque(uint8_t mode)
+{
+    return mode != BLEND_MODE_ALPHA && mode != BLEND_MODE_PREMULT;
+}
+
+/*
+ * Lock the GenPipe and get its source surface, mapped when possible and
+ * copied otherwise. Returns false if the GenPipe has nothing to show.
+ */
+static bool adp_v4_blend_layer_acquire(AppleDisplayPipeV4State *adp,
+                                       ADPV4BlendLayer *layer)
+{
+    ADPV4GenPipe *genpipe = layer->genpipe;
+    pixman_format_code_t fmt;
 
     if (REG_FIELD_EX32(genpipe->state.config_control, GP_CONFIG_CONTROL, RUN) ==
             0 ||
         REG_FIELD_EX32(genpipe->state.config_control, GP_CONFIG_CONTROL, ENABLED) ==
             0) {
-        return;
+        return false;
     }
 
     qemu_mutex_lock(&genpipe->lock);
-    adp_v4_gp_read(genpipe, dma_as);
-    qemu_mutex_unlock(&genpipe->lock);
-
-    if (genpipe->state.buf_len != 0) {
-        image = genpipe->state.image;
-        if (image == NULL) {
-            fmt = adp_v4_gp_fmt_to_pixman(genpipe);
-            genpipe->state.image = image = pixman_image_create_bits(
-                fmt, genpipe->state.src_width, genpipe->state.src_height,
-                (uint32_t *)genpipe->state.buf, genpipe->state.stride);
+    fmt = adp_v4_gp_fmt_to_pixman(genpipe);
+    layer->map = adp_v4_gp_map(genpipe, &adp->dma_as, &layer->map_len);
+    if (layer->map != NULL) {
+        layer->snap =
+            adp_v4_gp_snapshot_dirty(genpipe, layer->map, layer->map_len);
+        layer->image = pixman_image_create_bits(
+            fmt, genpipe->state.src_width, genpipe->state.src_height,
+            layer->map, genpipe->state.stride);
+    } else {
+        layer->snap = NULL;
+        adp_v4_gp_stop_dirty_tracking(genpipe);
+        adp_v4_gp_read(genpipe, &adp->dma_as);
+        if (genpipe->state.buf_len != 0) {
+            if (genpipe->state.image == NULL) {
+                genpipe->state.image = pixman_image_create_bits(
+                    fmt, genpipe->state.src_width, genpipe->state.src_height,
+                    (uint32_t *)genpipe->state.buf, genpipe->state.stride);
+            }
+            layer->image = pixman_image_ref(genpipe->state.image);
+        }
+    }
+
+    if (layer->image == NULL) {
+        if (layer->map != NULL) {
+            dma_memory_unmap(&adp->dma_as, layer->map, layer->map_len,
+                             DMA_DIRECTION_TO_DEVICE, 0);
         }
+        g_free(layer->snap);
+        qemu_mutex_unlock(&genpipe->lock);
+        return false;
+    }
+
+    if (layer->mode == BLEND_MODE_ALPHA) {
+        layer->color = pixman_image_create_bits(
+            adp_v4_opaque_fmt(fmt), genpipe->state.src_width,
+            genpipe->state.src_height, pixman_image_get_data(layer->image),
+            pixman_image_get_stride(layer->image));
+    }
 
-        pixman_image_composite(PIXMAN_OP_SRC, image, NULL, disp_image, 0, 0, 0,
-                               0, 0, 0, genpipe->state.dest_width,
-                               genpipe->state.dest_height);
+    layer->dest.x1 = MIN(genpipe->state.dest_x, adp->width);
+    layer->dest.y1 = MIN(genpipe->state.dest_y, adp->height);
+    layer->dest.x2 =
+        MIN((uint32_t)genpipe->state.dest_x + genpipe->state.dest_width,
+            adp->width);
+    layer->dest.y2 =
+        MIN((uint32_t)genpipe->state.dest_y + genpipe->state.dest_height,
+            adp->height);
 
-        dpy_gfx_update(console, 0, 0, genpipe->state.dest_width,
-                       genpipe->state.dest_height);
+    return true;
+}
+
+static void adp_v4_blend_layer_release(AppleDisplayPipeV4State *adp,
+                                       ADPV4BlendLayer *layer)
+{
+    qemu_pixman_image_unref(layer->color);
+    pixman_image_unref(layer->image);
+    if (layer->map != NULL) {
+        dma_memory_unmap(&adp->dma_as, layer->map, layer->map_len,
+                         DMA_DIRECTION_TO_DEVICE, layer->map_len);
+    }
+    g_free(layer->snap);
+    qemu_mutex_unlock(&layer->genpipe->lock);
+}
+
+/// Add the destination rows whose source scanlines changed to `damage`.
+static void adp_v4_blend_layer_damage(ADPV4BlendLayer *layer,
+                                      pixman_region32_t *damage)
+{
+    ADPV4GenPipe *genpipe = layer->genpipe;
+    int32_t y, ys;
+    bool dirty;
+
+    ys = -1;
+    for (y = layer->dest.y1; y <= layer->dest.y2; ++y) {
+        dirty = y < layer->dest.y2 &&
+                adp_v4_gp_row_dirty(genpipe, layer->snap,
+                                    y - genpipe->state.dest_y +
+                                        genpipe->state.src_y);
+        if (dirty && ys == -1) {
+            ys = y;
+        }
+        if (!dirty && ys != -1) {
+            pixman_region32_union_rect(damage, damage, layer->dest.x1, ys,
+                                       layer->dest.x2 - layer->dest.x1,
+                                       y - ys);
+            ys = -1;
+        }
+    }
+}
+
+static void adp_v4_blend_rect(ADPV4BlendLayer *layers, uint32_t count,
+                              pixman_image_t *disp_image,
+                              const pixman_box32_t *rect)
+{
+    pixman_color_t black = QEMU_PIXMAN_COLOR_BLACK;
+    pixman_box32_t clip;
+    ADPV4GenPipe *genpipe;
+    uint32_t i, base;
+    int32_t sx, sy;
+
+    // Start from the top-most opaque layer covering the whole rectangle.
+    base = 0;
+    for (i = count; i > 0; --i) {
+        if (adp_v4_blend_mode_opaque(layers[i - 1].mode) &&
+            layers[i - 1].dest.x1 <= rect->x1 &&
+            layers[i - 1].dest.y1 <= rect->y1 &&
+            layers[i - 1].dest.x2 >= rect->x2 &&
+            layers[i - 1].dest.y2 >= rect->y2) {
+            base = i - 1;
+            break;
+        }
+    }
+    if (i == 0) {
+        pixman_image_fill_rectangles(
+            PIXMAN_OP_SRC, disp_image, &black, 1,
+            &(pixman_rectangle16_t){ rect->x1, rect->y1, rect->x2 - rect->x1,
+                                     rect->y2 - rect->y1 });
+    }
+
+    for (i = base; i < count; ++i) {
+        clip.x1 = MAX(rect->x1, layers[i].dest.x1);
+        clip.y1 = MAX(rect->y1, layers[i].dest.y1);
+        clip.x2 = MIN(rect->x2, layers[i].dest.x2);
+        clip.y2 = MIN(rect->y2, layers[i].dest.y2);
+        if (clip.x1 >= clip.x2 || clip.y1 >= clip.y2) {
+            continue;
+        }
+
+        genpipe = layers[i].genpipe;
+        sx = clip.x1 - genpipe->state.dest_x + genpipe->state.src_x;
+        sy = clip.y1 - genpipe->state.dest_y + genpipe->state.src_y;
+        switch (layers[i].mode) {
+        case BLEND_MODE_ALPHA:
+            pixman_image_composite(PIXMAN_OP_OVER, layers[i].color,
+                                   layers[i].image, disp_image, sx, sy, sx, sy,
+                                   clip.x1, clip.y1, clip.x2 - clip.x1,
+                                   clip.y2 - clip.y1);
+            break;
+        case BLEND_MODE_PREMULT:
+            pixman_image_composite(PIXMAN_OP_OVER, layers[i].image, NULL,
+                                   disp_image, sx, sy, 0, 0, clip.x1, clip.y1,
+                                   clip.x2 - clip.x1, clip.y2 - clip.y1);
+            break;
+        default:
+            pixman_image_composite(PIXMAN_OP_SRC, layers[i].image, NULL,
+                                   disp_image, sx, sy, 0, 0, clip.x1, clip.y1,
+                                   clip.x2 - clip.x1, clip.y2 - clip.y1);
+            break;
+        }
     }
 }
 
 static void adp_v4_update_disp_bh(void *opaque)
 {
     AppleDisplayPipeV4State *adp = opaque;
+    ADPV4BlendLayer layers[ADP_V4_LAYER_COUNT];
+    pixman_region32_t damage;
+    pixman_box32_t *rects;
     pixman_image_t *disp_image;
+    uint32_t config, pipe, count, i;
+    bool full;
+    int nrects;
 
     disp_image = qemu_console_surface(adp->console)->image;
 
-    adp_v4_gp_draw(&adp->genpipe[0], &adp->dma_as, disp_image, adp->console);
-    adp_v4_gp_draw(&adp->genpipe[1], &adp->dma_as, disp_image, adp->console);
+    // A GenPipe that went away leaves stale pixels behind, redraw everything.
+    full = adp->genpipe[0].state.full_update ||
+           adp->genpipe[1].state.full_update;
+    count = 0;
+    for (i = 0; i < ADP_V4_LAYER_COUNT; ++i) {
+        config = adp->blend_unit.layer_config[i];
+        pipe = BLEND_LAYER_CONFIG_PIPE(config);
+        if (pipe >= ADP_V4_GP_COUNT ||
+            (count != 0 && layers[0].genpipe == &adp->genpipe[pipe])) {
+            continue;
+        }
+        layers[count] = (ADPV4BlendLayer){
+            .genpipe = &adp->genpipe[pipe],
+            .mode = BLEND_LAYER_CONFIG_MODE(config),
+        };
+        if (adp_v4_blend_layer_acquire(adp, &layers[count])) {
+            full |= layers[count].snap == NULL;
+            ++count;
+        }
+    }
+
+    // With nothing to scan out, keep what is on screen (e.g. boot splash).
+    pixman_region32_init(&damage);
+    if (full && count != 0) {
+        pixman_region32_union_rect(&damage, &damage, 0, 0, adp->width,
+                                   adp->height);
+    } else {
+        for (i = 0; i < count; ++i) {
+            adp_v4_blend_layer_damage(&layers[i], &damage);
+        }
+    }
+
+    rects = pixman_region32_rectangles(&damage, &nrects);
+    for (i = 0; i < (uint32_t)nrects; ++i) {
+        adp_v4_blend_rect(layers, count, disp_image, &rects[i]);
+        dpy_gfx_update(adp->console, rects[i].x1, rects[i].y1,
+                       rects[i].x2 - rects[i].x1, rects[i].y2 - rects[i].y1);
+    }
+    pixman_region32_fini(&damage);
+
+    for (i = 0; i < count; ++i) {
+        adp_v4_blend_layer_release(adp, &layers[i]);
+    }
+    adp->genpipe[0].state.full_update = false;
+    adp->genpipe[1].state.full_update = false;
 
     qatomic_or(&adp->int_status, R_CONTROL_INT_FRAME_PROCESSED_MASK);
     adp_v4_update_irqs(adp);
@@ -25,6 +25,7 @@
 #include "qemu/log.h"
 #include "qemu/queue.h"
 #include "system/dma.h"
+#include "trace.h"
 
 #if 0
 #define SIO_LOG_MSG(ep, msg)                                                \
@@ -68,12 +69,16 @@ typedef struct SIODMAMapRequest {
     QTAILQ_ENTRY(SIODMAMapRequest) next;
 } SIODMAMapRequest;
 
+QTAILQ_HEAD(SIODMAMapRequestList, SIODMAMapRequest);
+
 struct AppleSIODMAEndpoint {
     SIODMAConfig config;
     DMADirection direction;
     QemuMutex mutex;
     uint32_t id;
-    QTAILQ_HEAD(, SIODMAMapRequest) requests;
+    union SIODMAMapRequestList requests;
+    /// Window into the current request handed to transfer callbacks.
+    QEMUIOVector window;
 };
 
 struct AppleSIOClass {
@@ -192,7 +197,6 @@ static void apple_sio_destroy_req(AppleSIODMAEndpoint *ep,
     qemu_iovec_destroy(&req->iov);
     qemu_sglist_destroy(&req->sgl);
     g_free(req->segments);
-    QTAILQ_REMOVE(&ep->requests, req, next);
     g_free(req);
 }
 
@@ -202,35 +206,49 @@ static void apple_sio_stop(AppleSIODMAEndpoint *ep)
     SIODMAMapRequest *req_next;
 
     QTAILQ_FOREACH_SAFE (req, &ep->requests, next, req_next) {
+        QTAILQ_REMOVE(&ep->requests, req, next);
         apple_sio_destroy_req(ep, req);
     }
 }
 
+/// Completes every request in `done`, sharing one end timestamp.
 static void apple_sio_dma_writeback(AppleSIOState *s, AppleSIODMAEndpoint *ep,
-                                    SIODMAMapRequest *req)
+                                    union SIODMAMapRequestList *done)
 {
     AppleRTKit *rtk = &s->parent_obj;
+    SIODMAMapRequest *req;
+    SIODMAMapRequest *req_next;
     SIOMessage m = { 0 };
     dma_addr_t resp_addr;
+    uint64_t timestamps[2];
     uint64_t end_timestamp;
 
+    if (QTAILQ_EMPTY(done)) {
+        return;
+    }
+
     end_timestamp = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+    stq_le_p(&timestamps[1], end_timestamp);
 
     m.op = OP_COMPLETE;
     m.ep = ep->id;
     m.param = BIT(7);
-    m.tag = req->tag;
-    m.data = req->bytes_accessed;
 
-    resp_addr = req->tag * ep->id * 0x10;
-    stq_le_dma(&s->dma_as, s->resp_base + resp_addr, req->start_timestamp,
-               MEMTXATTRS_UNSPECIFIED);
-    stq_le_dma(&s->dma_as, s->resp_base + resp_addr + 8, end_timestamp,
-               MEMTXATTRS_UNSPECIFIED);
+    QTAILQ_FOREACH_SAFE (req, done, next, req_next) {
+        QTAILQ_REMOVE(done, req, next);
 
-    apple_sio_destroy_req(ep, req);
+        m.tag = req->tag;
+        m.data = req->bytes_accessed;
 
-    apple_rtkit_send_user_msg(rtk, EP_CONTROL, m.raw);
+        resp_addr = req->tag * ep->id * 0x10;
+        stq_le_p(&timestamps[0], req->start_timestamp);
+        dma_memory_write(&s->dma_as, s->resp_base + resp_addr, timestamps,
+                         sizeof(timestamps), MEMTXATTRS_UNSPECIFIED);
+
+        apple_sio_destroy_req(ep, req);
+
+        apple_rtkit_send_user_msg(rtk, EP_CONTROL, m.raw);
+    }
 }
 
 static bool apple_sio_map_dma(AppleSIODMAEndpoint *ep, SIODMAMapRequest *req)
@@ -272,17 +290,19 @@ static bool apple_sio_map_dma(AppleSIODMAEndpoint *ep, SIODMAMapRequest *req)
     return true;
 }
 
-uint64_t apple_sio_dma_read(AppleSIODMAEndpoint *ep, void *buffer, uint64_t len)
+uint64_t apple_sio_dma_xfer_iov(AppleSIODMAEndpoint *ep, uint64_t len,
+                                AppleSIODMAIOVFunc *func, void *opaque)
 {
     AppleSIOState *s;
     SIODMAMapRequest *req;
-    uint64_t iovec_len;
+    union SIODMAMapRequestList done = QTAILQ_HEAD_INITIALIZER(done);
+    uint64_t window_len;
+    uint64_t xfer_len;
     uint64_t actual_len = 0;
+    uint32_t completed = 0;
 
     QEMU_LOCK_GUARD(&ep->mutex);
 
-    g_assert_cmpuint(ep->direction, ==, DMA_DIRECTION_TO_DEVICE);
-
     s = container_of(ep, AppleSIOState, eps[ep->id]);
 
     while (len > actual_len) {
@@ -290,47 +310,76 @@ uint64_t apple_sio_dma_read(AppleSIODMAEndpoint *ep, void *buffer, uint64_t len)
         if (req == NULL || !apple_sio_map_dma(ep, req)) {
             break;
         }
-        iovec_len =
-            qemu_iovec_to_buf(&req->iov, req->bytes_accessed, buffer, len);
-        req->bytes_accessed += iovec_len;
+
+        window_len = MIN(len - actual_len, req->iov.size - req->bytes_accessed);
+        qemu_iovec_reset(&ep->window);
+        qemu_iovec_concat(&ep->window, &req->iov, req->bytes_accessed,
+                          window_len);
+
+        xfer_len = MIN(func(opaque, &ep->window), window_len);
+        req->bytes_accessed += xfer_len;
+        actual_len += xfer_len;
+
         if (req->bytes_accessed >= req->iov.size) {
-            apple_sio_dma_writeback(s, ep, req);
+            QTAILQ_REMOVE(&ep->requests, req, next);
+            QTAILQ_INSERT_TAIL(&done, req, next);
+            completed++;
+        } else if (xfer_len < window_len) {
+            break;
         }
-        actual_len += iovec_len;
     }
 
+    qemu_iovec_reset(&ep->window);
+    apple_sio_dma_writeback(s, ep, &done);
+    trace_apple_sio_dma_xfer(ep->id, len, actual_len, completed);
+
     return actual_len;
 }
 
-uint64_t apple_sio_dma_write(AppleSIODMAEndpoint *ep, void *buffer,
-                             uint64_t len)
+typedef struct {
+    uint8_t *buffer;
+    uint64_t offset;
+} AppleSIODMABuffer;
+
+static uint64_t apple_sio_dma_read_iov(void *opaque, QEMUIOVector *qiov)
 {
-    AppleSIOState *s;
-    SIODMAMapRequest *req;
-    uint64_t iovec_len;
-    uint64_t actual_len = 0;
+    AppleSIODMABuffer *buf = opaque;
+    uint64_t len;
 
-    QEMU_LOCK_GUARD(&ep->mutex);
+    len = qemu_iovec_to_buf(qiov, 0, buf->buffer + buf->offset, qiov->size);
+    buf->offset += len;
 
-    g_assert_cmpuint(ep->direction, ==, DMA_DIRECTION_FROM_DEVICE);
+    return len;
+}
 
-    s = container_of(ep, AppleSIOState, eps[ep->id]);
+static uint64_t apple_sio_dma_write_iov(void *opaque, QEMUIOVector *qiov)
+{
+    AppleSIODMABuffer *buf = opaque;
+    uint64_t len;
 
-    while (len > actual_len) {
-        req = QTAILQ_FIRST(&ep->requests);
-        if (req == NULL || !apple_sio_map_dma(ep, req)) {
-            break;
-        }
-        iovec_len =
-            qemu_iovec_from_buf(&req->iov, req->bytes_accessed, buffer, len);
-        req->bytes_accessed += iovec_len;
-        if (req->bytes_accessed >= req->iov.size) {
-            apple_sio_dma_writeback(s, ep, req);
-        }
-        actual_len += iovec_len;
-    }
+    len = qemu_iovec_from_buf(qiov, 0, buf->buffer + buf->offset, qiov->size);
+    buf->offset += len;
 
-    return actual_len;
+    return len;
+}
+
+uint64_t apple_sio_dma_read(AppleSIODMAEndpoint *ep, void *buffer, uint64_t len)
+{
+    AppleSIODMABuffer buf = { .buffer = buffer };
+
+    g_assert_cmpuint(ep->direction, ==, DMA_DIRECTION_TO_DEVICE);
+
+    return apple_sio_dma_xfer_iov(ep, len, apple_sio_dma_read_iov, &buf);
+}
+
+uint64_t apple_sio_dma_write(AppleSIODMAEndpoint *ep, void *buffer,
+                             uint64_t len)
+{
+    AppleSIODMABuffer buf = { .buffer = buffer };
+
+    g_assert_cmpuint(ep->direction, ==, DMA_DIRECTION_FROM_DEVICE);
+
+    return apple_sio_dma_xfer_iov(ep, len, apple_sio_dma_write_iov, &buf);
 }
 
 uint64_t apple_sio_dma_remaining(AppleSIODMAEndpoint *ep)
@@ -601,6 +650,7 @@ static void apple_sio_realize(DeviceState *dev, Error **errp)
             (i & 1) ? DMA_DIRECTION_FROM_DEVICE : DMA_DIRECTION_TO_DEVICE;
         qemu_mutex_init(&s->eps[i].mutex);
         QTAILQ_INIT(&s->eps[i].requests);
+        qemu_iovec_init(&s->eps[i].window, 1);
     }
 }
 
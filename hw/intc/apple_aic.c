@@ -29,6 +29,7 @@
 #include "qemu/log.h"
 #include "qemu/module.h"
 #include "qemu/timer.h"
+#include "hw/qdev-properties.h"
 #include "trace.h"
 
 /*
@@ -120,6 +121,10 @@
 
 #define kAIC_NUM_EIRS AIC_SRC_TO_EIR(kAIC_MAX_EXTID)
 
+/*
+ * Deferred IPIs are held back for this long. Unless `legacy-poll` is set,
+ * everything else is delivered as soon as the state changes.
+ */
 #define kAICWT 64000
 
 #define kCNTFRQ (24000000)
@@ -131,19 +136,38 @@ static inline uint64_t apple_aic_emulate_timer(void)
     return qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) / period_ns;
 }
 
+static inline bool apple_aic_trace_latency(void)
+{
+    return trace_event_get_state_backends(TRACE_AIC_IACK);
+}
+
 /*
- * Check state and interrupt cpus, call with mutex locked
+ * Turn deferred IPIs into pending ones, call with mutex locked
  */
-static void apple_aic_update(AppleAICState *s)
+static void apple_aic_flush_deferred(AppleAICState *s)
 {
-    uint32_t intr = 0;
-    uint32_t potential = 0;
     int i;
 
     for (i = 0; i < s->numCPU; i++) {
+        if (s->cpus[i].deferredIPI == 0) {
+            continue;
+        }
+        if (apple_aic_trace_latency() && s->cpus[i].pendingIPI == 0) {
+            s->cpus[i].ipi_raised_ns = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+        }
         s->cpus[i].pendingIPI |= s->cpus[i].deferredIPI;
         s->cpus[i].deferredIPI = 0;
     }
+}
+
+/*
+ * Check state and interrupt cpus, call with mutex locked
+ */
+static void apple_aic_update(AppleAICState *s)
+{
+    uint32_t intr = 0;
+    uint32_t potential = 0;
+    int i;
 
     for (i = 0; i < s->numCPU; i++) {
         if ((s->cpus[i].pendingIPI & AIC_IPI_SELF) & (~s->cpus[i].ipi_mask)) {
@@ -179,6 +203,10 @@ static void apple_aic_update(AppleAICState *s)
             }
         }
     }
+    if (intr) {
+        trace_aic_update(intr);
+    }
+
     for (i = 0; i < s->numCPU; i++) {
         if (intr & (1 << i)) {
             qemu_irq_raise(s->cpus[i].irq);
@@ -186,6 +214,16 @@ static void apple_aic_update(AppleAICState *s)
     }
 }
 
+/*
+ * Schedule delivery of deferred IPIs, call with mutex locked
+ */
+static void apple_aic_defer(AppleAICState *s)
+{
+    if (!s->legacy_poll && !timer_pending(s->timer)) {
+        timer_mod_ns(s->timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + kAICWT);
+    }
+}
+
 static void apple_aic_set_irq(void *opaque, int irq, int level)
 {
     AppleAICState *s = opaque;
@@ -194,7 +232,13 @@ static void apple_aic_set_irq(void *opaque, int irq, int level)
 
     trace_aic_set_irq(irq, level);
     if (level) {
+        if (apple_aic_trace_latency() && !test_bit32(irq, s->eir_state)) {
+            s->eir_raised_ns[irq] = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+        }
         set_bit32(irq, s->eir_state);
+        if (!s->legacy_poll) {
+            apple_aic_update(s);
+        }
     } else {
         clear_bit32(irq, s->eir_state);
     }
@@ -206,9 +250,12 @@ static void apple_aic_tick(void *opaque)
 
     QEMU_LOCK_GUARD(&s->mutex);
 
+    apple_aic_flush_deferred(s);
     apple_aic_update(s);
 
-    timer_mod_ns(s->timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + kAICWT);
+    if (s->legacy_poll) {
+        timer_mod_ns(s->timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + kAICWT);
+    }
 }
 
 static void apple_aic_reset(DeviceState *dev)
@@ -242,7 +289,7 @@ static void apple_aic_write(void *opaque, hwaddr addr, uint64_t data,
     switch (addr) {
     case REG_AIC_RST:
         apple_aic_reset(DEVICE(s));
-        break;
+        return;
     case REG_AIC_GLB_CFG:
         s->global_cfg = data;
         break;
@@ -251,6 +298,11 @@ static void apple_aic_write(void *opaque, hwaddr addr, uint64_t data,
 
         for (i = 0; i < s->numCPU; i++) {
             if (val & (1 << i)) {
+                if (apple_aic_trace_latency() &&
+                    s->cpus[i].pendingIPI == 0) {
+                    s->cpus[i].ipi_raised_ns =
+                        qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+                }
                 set_bit32(o->cpu_id, &s->cpus[i].pendingIPI);
                 if (~s->cpus[i].ipi_mask & AIC_IPI_NORMAL) {
                     qemu_irq_raise(s->cpus[i].irq);
@@ -259,6 +311,9 @@ static void apple_aic_write(void *opaque, hwaddr addr, uint64_t data,
         }
 
         if (val & AIC_IPI_SELF) {
+            if (apple_aic_trace_latency() && o->pendingIPI == 0) {
+                o->ipi_raised_ns = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+            }
             o->pendingIPI |= AIC_IPI_SELF;
             if (~o->ipi_mask & AIC_IPI_SELF) {
                 qemu_irq_raise(o->irq);
@@ -285,7 +340,7 @@ static void apple_aic_write(void *opaque, hwaddr addr, uint64_t data,
         break;
     case REG_AIC_IPI_MASK_CLR:
         o->ipi_mask &= ~(val & (AIC_IPI_NORMAL | AIC_IPI_SELF));
-        break;
+        goto update;
     case REG_AIC_IPI_DEFER_SET: {
         int i;
 
@@ -298,6 +353,7 @@ static void apple_aic_write(void *opaque, hwaddr addr, uint64_t data,
         if (val & AIC_IPI_SELF) {
             o->deferredIPI |= AIC_IPI_SELF;
         }
+        apple_aic_defer(s);
         break;
     }
     case REG_AIC_IPI_DEFER_CLR: {
@@ -320,15 +376,26 @@ static void apple_aic_write(void *opaque, hwaddr addr, uint64_t data,
             break;
         }
         s->eir_dest[vector] = val;
-        break;
+        goto update;
     }
     case REG_AIC_EIR_SW_SET(0)... REG_AIC_EIR_SW_SET(kAIC_NUM_EIRS): {
         uint32_t eir = (addr - REG_AIC_EIR_SW_SET(0)) / 4;
         if (unlikely(eir >= s->numEIR)) {
             break;
         }
+        if (apple_aic_trace_latency()) {
+            uint32_t raised = val & ~s->eir_state[eir];
+            int64_t now = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+            int bit;
+
+            while (raised) {
+                bit = ctz32(raised);
+                raised &= raised - 1;
+                s->eir_raised_ns[AIC_EIR_TO_SRC(eir, bit)] = now;
+            }
+        }
         s->eir_state[eir] |= val;
-        break;
+        goto update;
     }
     case REG_AIC_EIR_SW_CLR(0)... REG_AIC_EIR_SW_CLR(kAIC_NUM_EIRS): {
         uint32_t eir = (addr - REG_AIC_EIR_SW_CLR(0)) / 4;
@@ -354,7 +421,7 @@ static void apple_aic_write(void *opaque, hwaddr addr, uint64_t data,
         }
 
         s->eir_mask[eir] &= ~val;
-        break;
+        goto update;
     }
     case REG_AIC_WHOAMI_Pn(0)... REG_AIC_WHOAMI_Pn(AIC_CPU_COUNT) - 4: {
         uint32_t cpu = ((addr - 0x5000) / 0x80);
@@ -374,6 +441,12 @@ static void apple_aic_write(void *opaque, hwaddr addr, uint64_t data,
                       addr, o->cpu_id, val);
         break;
     }
+    return;
+
+update:
+    if (!s->legacy_poll) {
+        apple_aic_update(s);
+    }
 }
 
 static uint64_t apple_aic_read(void *opaque, hwaddr addr, unsigned size)
@@ -393,32 +466,44 @@ static uint64_t apple_aic_read(void *opaque, hwaddr addr, unsigned size)
     case REG_AIC_WHOAMI:
         return o->cpu_id;
     case REG_AIC_IACK: {
+        uint32_t vector = kAIC_INT_SPURIOUS;
+        int64_t raised_ns = 0;
         int i;
 
         qemu_irq_lower(o->irq);
         if (o->pendingIPI & AIC_IPI_SELF & ~o->ipi_mask) {
             o->ipi_mask |= AIC_IPI_SELF;
-            return kAIC_INT_IPI | kAIC_INT_IPI_SELF;
+            vector = kAIC_INT_IPI | kAIC_INT_IPI_SELF;
+            raised_ns = o->ipi_raised_ns;
+        } else if ((~o->ipi_mask & AIC_IPI_NORMAL) &&
+                   (o->pendingIPI & ((1 << s->numCPU) - 1))) {
+            o->ipi_mask |= AIC_IPI_NORMAL;
+            vector = kAIC_INT_IPI | kAIC_INT_IPI_NORM;
+            raised_ns = o->ipi_raised_ns;
+        } else {
+            i = -1;
+            while ((i = find_next_bit32(s->eir_state, s->numIRQ, i + 1)) <
+                   s->numIRQ) {
+                if (test_bit32(i, s->eir_mask) == 0 &&
+                    (s->eir_dest[i] & (1 << o->cpu_id))) {
+                    set_bit32(i, s->eir_mask);
+                    vector = kAIC_INT_EXT | AIC_INT_EXTID(i);
+                    raised_ns = s->eir_raised_ns[i];
+                    break;
+                }
+            }
         }
 
-        if (~o->ipi_mask & AIC_IPI_NORMAL) {
-            if (o->pendingIPI & ((1 << s->numCPU) - 1)) {
-                o->ipi_mask |= AIC_IPI_NORMAL;
-                return kAIC_INT_IPI | kAIC_INT_IPI_NORM;
-            }
+        if (vector != kAIC_INT_SPURIOUS && apple_aic_trace_latency()) {
+            trace_aic_iack(o->cpu_id, vector,
+                           qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) - raised_ns);
         }
 
-        i = -1;
-        while ((i = find_next_bit32(s->eir_state, s->numIRQ, i + 1)) <
-               s->numIRQ) {
-            if (test_bit32(i, s->eir_mask) == 0) {
-                if (s->eir_dest[i] & (1 << o->cpu_id)) {
-                    set_bit32(i, s->eir_mask);
-                    return kAIC_INT_EXT | AIC_INT_EXTID(i);
-                }
-            }
+        /* Anything else still pending must keep the line asserted. */
+        if (!s->legacy_poll) {
+            apple_aic_update(s);
         }
-        return kAIC_INT_SPURIOUS;
+        return vector;
     }
     case REG_AIC_EIR_DEST(0)... REG_AIC_EIR_DEST(AIC_INT_COUNT): {
         uint32_t vector = (addr - REG_AIC_EIR_DEST(0)) / 4;
@@ -524,9 +609,12 @@ static void apple_aic_realize(DeviceState *dev, struct Error **errp)
     s->eir_mask = g_new0(uint32_t, s->numEIR);
     s->eir_dest = g_new0(uint32_t, s->numIRQ);
     s->eir_state = g_new0(uint32_t, s->numEIR);
+    s->eir_raised_ns = g_new0(int64_t, s->numIRQ);
 
     s->timer = timer_new_ns(QEMU_CLOCK_VIRTUAL, apple_aic_tick, dev);
-    timer_mod_ns(s->timer, kAICWT);
+    if (s->legacy_poll) {
+        timer_mod_ns(s->timer, kAICWT);
+    }
 
     msi_nonbroken = true;
 }
@@ -535,6 +623,7 @@ static void apple_aic_unrealize(DeviceState *dev)
 {
     AppleAICState *s = APPLE_AIC(dev);
     timer_free(s->timer);
+    g_free(s->eir_raised_ns);
 }
 
 SysBusDevice *apple_aic_create(uint32_t numCPU, AppleDTNode *node,
@@ -584,10 +673,32 @@ static const VMStateDescription vmstate_apple_aic_cpu = {
         }
 };
 
+static int apple_aic_post_load(void *opaque, int version_id)
+{
+    AppleAICState *s = opaque;
+    int i;
+
+    QEMU_LOCK_GUARD(&s->mutex);
+
+    for (i = 0; i < s->numCPU; i++) {
+        if (s->cpus[i].deferredIPI) {
+            apple_aic_defer(s);
+            break;
+        }
+    }
+
+    if (!s->legacy_poll) {
+        apple_aic_update(s);
+    }
+
+    return 0;
+}
+
 static const VMStateDescription vmstate_apple_aic = {
     .name = "apple_aic",
     .version_id = 1,
     .minimum_version_id = 1,
+    .post_load = apple_aic_post_load,
     .fields =
         (const VMStateField[]){
             VMSTATE_UINT32(numEIR, AppleAICState),
@@ -607,6 +718,10 @@ static const VMStateDescription vmstate_apple_aic = {
         }
 };
 
+static const Property apple_aic_properties[] = {
+    DEFINE_PROP_BOOL("legacy-poll", AppleAICState, legacy_poll, false),
+};
+
 static void apple_aic_class_init(ObjectClass *klass, const void *data)
 {
     DeviceClass *dc = DEVICE_CLASS(klass);
@@ -616,6 +731,7 @@ static void apple_aic_class_init(ObjectClass *klass, const void *data)
     device_class_set_legacy_reset(dc, apple_aic_reset);
     dc->desc = "Apple Interrupt Controller";
     dc->vmsd = &vmstate_apple_aic;
+    device_class_set_props(dc, apple_aic_properties);
 }
 
 static const TypeInfo apple_aic_info = {
@@ -25,24 +25,24 @@
 #include "qemu/bitops.h"
 #include "qemu/lockable.h"
 
-void apple_a7iop_send_ap(AppleA7IOP *s, AppleA7IOPMessage *msg)
+void apple_a7iop_send_ap(AppleA7IOP *s, const AppleA7IOPMessage *msg)
 {
     apple_a7iop_mailbox_send_ap(s->iop_mailbox, msg);
 }
 
-AppleA7IOPMessage *apple_a7iop_recv_ap(AppleA7IOP *s)
+bool apple_a7iop_recv_ap(AppleA7IOP *s, AppleA7IOPMessage *msg)
 {
-    return apple_a7iop_mailbox_recv_ap(s->iop_mailbox);
+    return apple_a7iop_mailbox_recv_ap(s->iop_mailbox, msg);
 }
 
-void apple_a7iop_send_iop(AppleA7IOP *s, AppleA7IOPMessage *msg)
+void apple_a7iop_send_iop(AppleA7IOP *s, const AppleA7IOPMessage *msg)
 {
     apple_a7iop_mailbox_send_iop(s->ap_mailbox, msg);
 }
 
-AppleA7IOPMessage *apple_a7iop_recv_iop(AppleA7IOP *s)
+bool apple_a7iop_recv_iop(AppleA7IOP *s, AppleA7IOPMessage *msg)
 {
-    return apple_a7iop_mailbox_recv_iop(s->ap_mailbox);
+    return apple_a7iop_mailbox_recv_iop(s->ap_mailbox, msg);
 }
 
 void apple_a7iop_cpu_start(AppleA7IOP *s, bool wake)
@@ -34,6 +34,7 @@
 #include "qemu/log.h"
 #include "qemu/main-loop.h"
 #include "qemu/queue.h"
+#include "qemu/timer.h"
 
 #define MAX_MESSAGE_COUNT (15)
 
@@ -46,6 +47,71 @@
 #define CTRL_COUNT_MASK (MAX_MESSAGE_COUNT << CTRL_COUNT_SHIFT)
 #define CTRL_COUNT(v) (((v) << CTRL_COUNT_SHIFT) & CTRL_COUNT_MASK)
 
+#define RING_MASK (APPLE_A7IOP_MAILBOX_RING_SIZE - 1)
+QEMU_BUILD_BUG_ON(APPLE_A7IOP_MAILBOX_RING_SIZE & RING_MASK);
+
+static inline uint32_t apple_a7iop_ring_count(AppleA7IOPMessageRing *r)
+{
+    return qatomic_load_acquire(&r->tail) - qatomic_load_acquire(&r->head);
+}
+
+static inline bool apple_a7iop_ring_is_empty(AppleA7IOPMessageRing *r)
+{
+    return apple_a7iop_ring_count(r) == 0;
+}
+
+static bool apple_a7iop_ring_push(AppleA7IOPMessageRing *r,
+                                  const uint8_t *data)
+{
+    uint32_t tail = qatomic_read(&r->tail);
+
+    if (tail - qatomic_load_acquire(&r->head) ==
+        APPLE_A7IOP_MAILBOX_RING_SIZE) {
+        return false;
+    }
+
+    memcpy(r->msgs[tail & RING_MASK].data, data,
+           sizeof(r->msgs[0].data));
+    qatomic_store_release(&r->tail, tail + 1);
+    return true;
+}
+
+static AppleA7IOPMessage *apple_a7iop_ring_peek(AppleA7IOPMessageRing *r)
+{
+    uint32_t head = qatomic_read(&r->head);
+
+    if (head == qatomic_load_acquire(&r->tail)) {
+        return NULL;
+    }
+
+    return &r->msgs[head & RING_MASK];
+}
+
+static inline void apple_a7iop_ring_pop(AppleA7IOPMessageRing *r)
+{
+    qatomic_store_release(&r->head, qatomic_read(&r->head) + 1);
+}
+
+static bool apple_a7iop_int_status_to_bit(uint32_t status, unsigned long *bit)
+{
+    uint32_t group = status >> 16;
+    uint32_t index = status & 0xFFFF;
+
+    if (status == 0 || group >= APPLE_A7IOP_INT_STATUS_GROUPS ||
+        index >= APPLE_A7IOP_INT_STATUS_INDICES) {
+        return false;
+    }
+
+    *bit = group * APPLE_A7IOP_INT_STATUS_INDICES + index;
+    return true;
+}
+
+static inline uint32_t apple_a7iop_int_status_from_bit(unsigned long bit)
+{
+    return ((bit / APPLE_A7IOP_INT_STATUS_INDICES) << 16) |
+           (bit % APPLE_A7IOP_INT_STATUS_INDICES);
+}
+
 static bool is_interrupt_enabled(AppleA7IOPMailbox *s, uint32_t status)
 {
     if (!s->sepd_enabled) {
@@ -114,10 +180,14 @@ static bool is_interrupt_enabled(AppleA7IOPMailbox *s, uint32_t status)
 
 static bool apple_mbox_interrupt_status_empty(AppleA7IOPMailbox *s)
 {
-    AppleA7IOPInterruptStatusMessage *msg;
+    unsigned long bit;
 
-    QTAILQ_FOREACH (msg, &s->interrupt_status, entry) {
-        if (is_interrupt_enabled(s, msg->status)) {
+    for (bit = find_first_bit(s->interrupt_status_set,
+                              APPLE_A7IOP_INT_STATUS_BITS);
+         bit < APPLE_A7IOP_INT_STATUS_BITS;
+         bit = find_next_bit(s->interrupt_status_set,
+                             APPLE_A7IOP_INT_STATUS_BITS, bit + 1)) {
+        if (is_interrupt_enabled(s, apple_a7iop_int_status_from_bit(bit))) {
             return false;
         }
     }
@@ -156,8 +226,8 @@ void apple_a7iop_mailbox_update_irq_status(AppleA7IOPMailbox *s)
     bool ap_nonempty_unmasked;
     bool ap_empty_unmasked;
 
-    iop_empty = QTAILQ_EMPTY(&s->iop_mailbox->inbox);
-    ap_empty = QTAILQ_EMPTY(&s->ap_mailbox->inbox);
+    iop_empty = apple_a7iop_ring_is_empty(&s->iop_mailbox->inbox_ring);
+    ap_empty = apple_a7iop_ring_is_empty(&s->ap_mailbox->inbox_ring);
     iop_underflow = s->iop_mailbox->underflow;
     ap_underflow = s->ap_mailbox->underflow;
     iop_nonempty_unmasked = iop_nonempty_is_unmasked(s->int_mask);
@@ -212,11 +282,29 @@ bool apple_a7iop_mailbox_is_empty(AppleA7IOPMailbox *s)
 {
     QEMU_LOCK_GUARD(&s->lock);
 
-    return s->underflow || QTAILQ_EMPTY(&s->inbox);
+    return s->underflow || apple_a7iop_ring_is_empty(&s->inbox_ring);
+}
+
+static void apple_a7iop_mailbox_account_send(AppleA7IOPMailbox *s)
+{
+    uint64_t now = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    uint64_t elapsed = now - s->rate_window_start;
+
+    s->sent++;
+    s->rate_window_sent++;
+
+    if (elapsed >= NANOSECONDS_PER_SECOND) {
+        s->messages_per_sec =
+            muldiv64(s->rate_window_sent, NANOSECONDS_PER_SECOND, elapsed);
+        trace_apple_a7iop_mailbox_rate(s->role, s->messages_per_sec, s->sent,
+                                       s->received);
+        s->rate_window_start = now;
+        s->rate_window_sent = 0;
+    }
 }
 
 static void apple_a7iop_mailbox_send(AppleA7IOPMailbox *s,
-                                     AppleA7IOPMessage *msg)
+                                     const AppleA7IOPMessage *msg)
 {
     g_assert_nonnull(msg);
 
@@ -225,8 +313,13 @@ static void apple_a7iop_mailbox_send(AppleA7IOPMailbox *s,
     trace_apple_a7iop_mailbox_send(s->role, ldq_le_p(msg->data),
                                    ldq_le_p(msg->data + sizeof(uint64_t)));
 
-    QTAILQ_INSERT_TAIL(&s->inbox, msg, next);
-    s->count++;
+    if (!apple_a7iop_ring_push(&s->inbox_ring, msg->data)) {
+        qemu_log_mask(LOG_GUEST_ERROR, "%s: %s overflowed.\n", __FUNCTION__,
+                      s->role);
+        return;
+    }
+
+    apple_a7iop_mailbox_account_send(s);
     apple_a7iop_mailbox_update_irq(s);
 
     if (s->handle_messages_bh != NULL) {
@@ -234,7 +327,8 @@ static void apple_a7iop_mailbox_send(AppleA7IOPMailbox *s,
     }
 }
 
-void apple_a7iop_mailbox_send_ap(AppleA7IOPMailbox *s, AppleA7IOPMessage *msg)
+void apple_a7iop_mailbox_send_ap(AppleA7IOPMailbox *s,
+                                 const AppleA7IOPMessage *msg)
 {
     WITH_QEMU_LOCK_GUARD(&s->lock)
     {
@@ -248,7 +342,8 @@ void apple_a7iop_mailbox_send_ap(AppleA7IOPMailbox *s, AppleA7IOPMessage *msg)
     apple_a7iop_mailbox_send(s->ap_mailbox, msg);
 }
 
-void apple_a7iop_mailbox_send_iop(AppleA7IOPMailbox *s, AppleA7IOPMessage *msg)
+void apple_a7iop_mailbox_send_iop(AppleA7IOPMailbox *s,
+                                  const AppleA7IOPMessage *msg)
 {
     WITH_QEMU_LOCK_GUARD(&s->lock)
     {
@@ -262,66 +357,63 @@ void apple_a7iop_mailbox_send_iop(AppleA7IOPMailbox *s, AppleA7IOPMessage *msg)
     apple_a7iop_mailbox_send(s->iop_mailbox, msg);
 }
 
+/// The returned message is only valid until the next receive.
 AppleA7IOPMessage *apple_a7iop_inbox_peek(AppleA7IOPMailbox *s)
 {
-    return QTAILQ_FIRST(&s->inbox);
+    return apple_a7iop_ring_peek(&s->inbox_ring);
 }
 
-static AppleA7IOPMessage *apple_a7iop_mailbox_recv(AppleA7IOPMailbox *s)
+static bool apple_a7iop_mailbox_recv(AppleA7IOPMailbox *s,
+                                     AppleA7IOPMessage *msg)
 {
-    AppleA7IOPMessage *msg;
+    AppleA7IOPMessage *head;
+    uint32_t count;
 
     if (s->underflow) {
-        return NULL;
+        return false;
     }
 
-    msg = QTAILQ_FIRST(&s->inbox);
-    if (msg == NULL) {
+    head = apple_a7iop_ring_peek(&s->inbox_ring);
+    if (head == NULL) {
         s->underflow = true;
         qemu_log_mask(LOG_GUEST_ERROR, "%s: %s underflowed.\n", __FUNCTION__,
                       s->role);
         apple_a7iop_mailbox_update_irq(s);
-        return NULL;
+        return false;
     }
 
-    QTAILQ_REMOVE(&s->inbox, msg, next);
-    stl_le_p(msg->data + 0xC, CTRL_COUNT(s->count));
+    count = apple_a7iop_ring_count(&s->inbox_ring);
+    memcpy(msg->data, head->data, sizeof(msg->data));
+    apple_a7iop_ring_pop(&s->inbox_ring);
+    stl_le_p(msg->data + 0xC, CTRL_COUNT(count));
     trace_apple_a7iop_mailbox_recv(s->role, ldq_le_p(msg->data),
                                    ldq_le_p(msg->data + sizeof(uint64_t)));
-    s->count--;
+    s->received++;
     apple_a7iop_mailbox_update_irq(s);
 
-    return msg;
+    return true;
 }
 
-AppleA7IOPMessage *apple_a7iop_mailbox_recv_iop(AppleA7IOPMailbox *s)
+bool apple_a7iop_mailbox_recv_iop(AppleA7IOPMailbox *s, AppleA7IOPMessage *msg)
 {
-    AppleA7IOPMessage *msg;
-
     if (!s->iop_dir_en) {
         qemu_log_mask(LOG_GUEST_ERROR, "%s: %s direction not enabled.\n",
                       __FUNCTION__, s->role);
-        return NULL;
+        return false;
     }
 
-    msg = apple_a7iop_mailbox_recv(s->iop_mailbox);
-
-    return msg;
+    return apple_a7iop_mailbox_recv(s->iop_mailbox, msg);
 }
 
-AppleA7IOPMessage *apple_a7iop_mailbox_recv_ap(AppleA7IOPMailbox *s)
+bool apple_a7iop_mailbox_recv_ap(AppleA7IOPMailbox *s, AppleA7IOPMessage *msg)
 {
-    AppleA7IOPMessage *msg;
-
     if (!s->ap_dir_en) {
         qemu_log_mask(LOG_GUEST_ERROR, "%s: %s direction not enabled.\n",
                       __FUNCTION__, s->role);
-        return NULL;
+        return false;
     }
 
-    msg = apple_a7iop_mailbox_recv(s->ap_mailbox);
-
-    return msg;
+    return apple_a7iop_mailbox_recv(s->ap_mailbox, msg);
 }
 
 uint32_t apple_a7iop_mailbox_get_int_mask(AppleA7IOPMailbox *s)
@@ -349,13 +441,16 @@ void apple_a7iop_mailbox_clear_int_mask(AppleA7IOPMailbox *s, uint32_t value)
 
 static inline uint32_t apple_a7iop_mailbox_ctrl(AppleA7IOPMailbox *s)
 {
+    uint32_t count;
+
     if (s->underflow) {
         return CTRL_UNDERFLOW;
     }
 
-    return (s->count >= MAX_MESSAGE_COUNT ? CTRL_FULL : 0) |
-           (QTAILQ_EMPTY(&s->inbox) ? CTRL_EMPTY : 0) |
-           CTRL_COUNT(MIN(s->count, MAX_MESSAGE_COUNT));
+    count = apple_a7iop_ring_count(&s->inbox_ring);
+    return (count >= MAX_MESSAGE_COUNT ? CTRL_FULL : 0) |
+           (count == 0 ? CTRL_EMPTY : 0) |
+           CTRL_COUNT(MIN(count, MAX_MESSAGE_COUNT));
 }
 
 uint32_t apple_a7iop_mailbox_get_iop_ctrl(AppleA7IOPMailbox *s)
@@ -390,52 +485,54 @@ void apple_a7iop_mailbox_set_ap_ctrl(AppleA7IOPMailbox *s, uint32_t value)
 
 void apple_a7iop_interrupt_status_push(AppleA7IOPMailbox *s, uint32_t status)
 {
-    AppleA7IOPInterruptStatusMessage *msg;
+    unsigned long bit;
 
-#if 1
-    QTAILQ_FOREACH (msg, &s->interrupt_status, entry) {
-        if (msg->status == status) {
-            apple_a7iop_mailbox_update_irq(s);
-            return;
-        }
-    }
-#endif
     // DON'T TEST FOR interrupts_enabled DURING PUSH!!
-    // and maybe don't push when the status is already in the list
-    msg = g_new0(struct AppleA7IOPInterruptStatusMessage, 1);
-    msg->status = status;
-    QTAILQ_INSERT_TAIL(&s->interrupt_status, msg, entry);
+    // Pushing a status that is already pending is a no-op.
+    if (apple_a7iop_int_status_to_bit(status, &bit)) {
+        set_bit(bit, s->interrupt_status_set);
+    } else {
+        qemu_log_mask(LOG_GUEST_ERROR,
+                      "%s: %s interrupt status 0x%x out of range.\n",
+                      __FUNCTION__, s->role, status);
+    }
     apple_a7iop_mailbox_update_irq(s);
 }
 
+// Group 7 is preferred, then the lowest group; lowest index within a group.
+static const uint8_t apple_a7iop_int_status_group_order[] = {
+    7, 0, 1, 2, 3, 4, 5, 6,
+};
+QEMU_BUILD_BUG_ON(ARRAY_SIZE(apple_a7iop_int_status_group_order) !=
+                  APPLE_A7IOP_INT_STATUS_GROUPS);
+
 uint32_t apple_a7iop_interrupt_status_pop(AppleA7IOPMailbox *s)
 {
     uint32_t ret = 0;
-    AppleA7IOPInterruptStatusMessage *msg, *preferred_msg = NULL;
-    uint32_t interrupt_group_msg = 0, interrupt_group_preferred_msg = 0;
+    unsigned long start;
+    unsigned long end;
+    unsigned long bit;
+    int i;
 
     // order should be 0x4, 0x7, 0x1, but 0x4 shouldn't be handled here at all.
 
-    QTAILQ_FOREACH (msg, &s->interrupt_status, entry) {
-        interrupt_group_msg = (msg->status >> 16) & 0x7;
-        if (is_interrupt_enabled(s, msg->status)) {
-            if (preferred_msg == NULL ||
-                (interrupt_group_msg == interrupt_group_preferred_msg &&
-                 msg->status < preferred_msg->status) ||
-                (interrupt_group_msg != interrupt_group_preferred_msg &&
-                 interrupt_group_msg == 0x7)) {
-                preferred_msg = msg;
-                interrupt_group_preferred_msg = interrupt_group_msg;
+    for (i = 0; i < ARRAY_SIZE(apple_a7iop_int_status_group_order); i++) {
+        start = apple_a7iop_int_status_group_order[i] *
+                APPLE_A7IOP_INT_STATUS_INDICES;
+        end = start + APPLE_A7IOP_INT_STATUS_INDICES;
+        for (bit = find_next_bit(s->interrupt_status_set, end, start);
+             bit < end;
+             bit = find_next_bit(s->interrupt_status_set, end, bit + 1)) {
+            if (is_interrupt_enabled(s,
+                                     apple_a7iop_int_status_from_bit(bit))) {
+                clear_bit(bit, s->interrupt_status_set);
+                ret = apple_a7iop_int_status_from_bit(bit);
+                goto out;
             }
         }
     }
 
-    if (preferred_msg) {
-        QTAILQ_REMOVE(&s->interrupt_status, preferred_msg, entry);
-        ret = preferred_msg->status;
-        g_free(preferred_msg);
-    }
-
+out:
     apple_a7iop_mailbox_update_irq(s);
 
     return ret;
@@ -552,6 +649,12 @@ AppleA7IOPMailbox *apple_a7iop_mailbox_new(const char *role,
     s = APPLE_A7IOP_MAILBOX(dev);
 
     s->role = g_strdup(role);
+    object_property_add_uint64_ptr(OBJECT(s), "messages-sent", &s->sent,
+                                   OBJ_PROP_FLAG_READ);
+    object_property_add_uint64_ptr(OBJECT(s), "messages-received",
+                                   &s->received, OBJ_PROP_FLAG_READ);
+    object_property_add_uint64_ptr(OBJECT(s), "messages-per-sec",
+                                   &s->messages_per_sec, OBJ_PROP_FLAG_READ);
     s->iop_mailbox = iop_mailbox ? iop_mailbox : s;
     s->ap_mailbox = ap_mailbox ? ap_mailbox : s;
     if (handle_messages_func != NULL) {
@@ -590,13 +693,28 @@ AppleA7IOPMailbox *apple_a7iop_mailbox_new(const char *role,
     return s;
 }
 
-static void apple_a7iop_mailbox_reset(DeviceState *dev)
+static void apple_a7iop_mailbox_free_migration_lists(AppleA7IOPMailbox *s)
 {
-    AppleA7IOPMailbox *s;
     AppleA7IOPMessage *msg;
     AppleA7IOPMessage *msg_next;
     AppleA7IOPInterruptStatusMessage *intr_status_msg;
     AppleA7IOPInterruptStatusMessage *intr_status_msg_next;
+
+    QTAILQ_FOREACH_SAFE (msg, &s->inbox, next, msg_next) {
+        QTAILQ_REMOVE(&s->inbox, msg, next);
+        g_free(msg);
+    }
+
+    QTAILQ_FOREACH_SAFE (intr_status_msg, &s->interrupt_status, entry,
+                         intr_status_msg_next) {
+        QTAILQ_REMOVE(&s->interrupt_status, intr_status_msg, entry);
+        g_free(intr_status_msg);
+    }
+}
+
+static void apple_a7iop_mailbox_reset(DeviceState *dev)
+{
+    AppleA7IOPMailbox *s;
     int i;
 
     s = APPLE_A7IOP_MAILBOX(dev);
@@ -606,6 +724,9 @@ static void apple_a7iop_mailbox_reset(DeviceState *dev)
     g_assert_false(s->iop_mailbox == s->ap_mailbox);
 
     s->count = 0;
+    s->inbox_ring.head = 0;
+    s->inbox_ring.tail = 0;
+    bitmap_zero(s->interrupt_status_set, APPLE_A7IOP_INT_STATUS_BITS);
     s->iop_dir_en = true;
     s->ap_dir_en = true;
     s->underflow = false;
@@ -614,16 +735,7 @@ static void apple_a7iop_mailbox_reset(DeviceState *dev)
     memset(s->iop_send_reg, 0, sizeof(s->iop_send_reg));
     memset(s->ap_send_reg, 0, sizeof(s->ap_send_reg));
 
-    QTAILQ_FOREACH_SAFE (msg, &s->inbox, next, msg_next) {
-        QTAILQ_REMOVE(&s->inbox, msg, next);
-        g_free(msg);
-    }
-
-    QTAILQ_FOREACH_SAFE (intr_status_msg, &s->interrupt_status, entry,
-                         intr_status_msg_next) {
-        QTAILQ_REMOVE(&s->interrupt_status, intr_status_msg, entry);
-        g_free(intr_status_msg);
-    }
+    apple_a7iop_mailbox_free_migration_lists(s);
 
     for (i = 0; i < ARRAY_SIZE(s->interrupts_enabled); i++) {
         s->interrupts_enabled[i] = 0;
@@ -664,10 +776,78 @@ static const VMStateDescription vmstate_apple_a7iop_int_status_message = {
         }
 };
 
+static int apple_a7iop_mailbox_pre_save(void *opaque)
+{
+    AppleA7IOPMailbox *s = opaque;
+    AppleA7IOPMessageRing *r = &s->inbox_ring;
+    AppleA7IOPMessage *msg;
+    AppleA7IOPInterruptStatusMessage *intr_status_msg;
+    unsigned long bit;
+    uint32_t i;
+
+    s->count = apple_a7iop_ring_count(r);
+
+    for (i = r->head; i != r->tail; i++) {
+        msg = g_new0(AppleA7IOPMessage, 1);
+        memcpy(msg->data, r->msgs[i & RING_MASK].data, sizeof(msg->data));
+        QTAILQ_INSERT_TAIL(&s->inbox, msg, next);
+    }
+
+    for (bit = find_first_bit(s->interrupt_status_set,
+                              APPLE_A7IOP_INT_STATUS_BITS);
+         bit < APPLE_A7IOP_INT_STATUS_BITS;
+         bit = find_next_bit(s->interrupt_status_set,
+                             APPLE_A7IOP_INT_STATUS_BITS, bit + 1)) {
+        intr_status_msg = g_new0(AppleA7IOPInterruptStatusMessage, 1);
+        intr_status_msg->status = apple_a7iop_int_status_from_bit(bit);
+        QTAILQ_INSERT_TAIL(&s->interrupt_status, intr_status_msg, entry);
+    }
+
+    return 0;
+}
+
+static int apple_a7iop_mailbox_post_save(void *opaque)
+{
+    apple_a7iop_mailbox_free_migration_lists(opaque);
+
+    return 0;
+}
+
+static int apple_a7iop_mailbox_post_load(void *opaque, int version_id)
+{
+    AppleA7IOPMailbox *s = opaque;
+    AppleA7IOPMessage *msg;
+    AppleA7IOPInterruptStatusMessage *intr_status_msg;
+    unsigned long bit;
+
+    s->inbox_ring.head = 0;
+    s->inbox_ring.tail = 0;
+    QTAILQ_FOREACH (msg, &s->inbox, next) {
+        if (!apple_a7iop_ring_push(&s->inbox_ring, msg->data)) {
+            apple_a7iop_mailbox_free_migration_lists(s);
+            return -EINVAL;
+        }
+    }
+
+    bitmap_zero(s->interrupt_status_set, APPLE_A7IOP_INT_STATUS_BITS);
+    QTAILQ_FOREACH (intr_status_msg, &s->interrupt_status, entry) {
+        if (apple_a7iop_int_status_to_bit(intr_status_msg->status, &bit)) {
+            set_bit(bit, s->interrupt_status_set);
+        }
+    }
+
+    apple_a7iop_mailbox_free_migration_lists(s);
+
+    return 0;
+}
+
 static const VMStateDescription vmstate_apple_a7iop_mailbox = {
     .name = "Apple A7IOP Mailbox State",
     .version_id = 0,
     .minimum_version_id = 0,
+    .pre_save = apple_a7iop_mailbox_pre_save,
+    .post_save = apple_a7iop_mailbox_post_save,
+    .post_load = apple_a7iop_mailbox_post_load,
     .fields =
         (const VMStateField[]){
             VMSTATE_APPLE_A7IOP_MESSAGE(inbox, AppleA7IOPMailbox),
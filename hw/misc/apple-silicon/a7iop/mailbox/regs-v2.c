@@ -39,7 +39,7 @@ static void apple_a7iop_v2_mailbox_reg_write(void *opaque, hwaddr addr,
                                              const uint64_t data, unsigned size)
 {
     AppleA7IOPMailbox *s = opaque;
-    AppleA7IOPMessage *msg;
+    AppleA7IOPMessage msg;
 
     switch (addr) {
     case REG_INT_MASK_SET:
@@ -59,10 +59,9 @@ static void apple_a7iop_v2_mailbox_reg_write(void *opaque, hwaddr addr,
         qemu_mutex_lock(&s->lock);
         memcpy(s->iop_send_reg + (addr - REG_IOP_SEND0), &data, size);
         if (addr + size - 4 == REG_IOP_SEND1) {
-            msg = g_new0(AppleA7IOPMessage, 1);
-            memcpy(msg->data, s->iop_send_reg, sizeof(msg->data));
+            memcpy(msg.data, s->iop_send_reg, sizeof(msg.data));
             qemu_mutex_unlock(&s->lock);
-            apple_a7iop_mailbox_send_iop(s, msg);
+            apple_a7iop_mailbox_send_iop(s, &msg);
         } else {
             qemu_mutex_unlock(&s->lock);
         }
@@ -72,10 +71,9 @@ static void apple_a7iop_v2_mailbox_reg_write(void *opaque, hwaddr addr,
         qemu_mutex_lock(&s->lock);
         memcpy(s->ap_send_reg + (addr - REG_AP_SEND0), &data, size);
         if (addr + size - 4 == REG_AP_SEND1) {
-            msg = g_new0(AppleA7IOPMessage, 1);
-            memcpy(msg->data, s->ap_send_reg, sizeof(msg->data));
+            memcpy(msg.data, s->ap_send_reg, sizeof(msg.data));
             qemu_mutex_unlock(&s->lock);
-            apple_a7iop_mailbox_send_ap(s, msg);
+            apple_a7iop_mailbox_send_ap(s, &msg);
         } else {
             qemu_mutex_unlock(&s->lock);
         }
@@ -92,7 +90,8 @@ static uint64_t apple_a7iop_v2_mailbox_reg_read(void *opaque, hwaddr addr,
                                                 unsigned size)
 {
     AppleA7IOPMailbox *s = opaque;
-    AppleA7IOPMessage *msg;
+    AppleA7IOPMessage msg;
+    bool received;
     uint64_t ret = 0;
 
     switch (addr) {
@@ -105,14 +104,13 @@ static uint64_t apple_a7iop_v2_mailbox_reg_read(void *opaque, hwaddr addr,
     case REG_AP_CTRL:
         return apple_a7iop_mailbox_get_ap_ctrl(s);
     case REG_IOP_RECV0:
-        msg = apple_a7iop_mailbox_recv_iop(s);
+        received = apple_a7iop_mailbox_recv_iop(s, &msg);
         WITH_QEMU_LOCK_GUARD(&s->lock)
         {
-            if (msg == NULL) {
-                memset(s->iop_recv_reg, 0, sizeof(s->iop_recv_reg));
+            if (received) {
+                memcpy(s->iop_recv_reg, msg.data, sizeof(s->iop_recv_reg));
             } else {
-                memcpy(s->iop_recv_reg, msg->data, sizeof(s->iop_recv_reg));
-                g_free(msg);
+                memset(s->iop_recv_reg, 0, sizeof(s->iop_recv_reg));
             }
         }
         QEMU_FALLTHROUGH;
@@ -123,12 +121,11 @@ static uint64_t apple_a7iop_v2_mailbox_reg_read(void *opaque, hwaddr addr,
         }
         break;
     case REG_AP_RECV0:
-        msg = apple_a7iop_mailbox_recv_ap(s);
+        received = apple_a7iop_mailbox_recv_ap(s, &msg);
         WITH_QEMU_LOCK_GUARD(&s->lock)
         {
-            if (msg) {
-                memcpy(s->ap_recv_reg, msg->data, sizeof(s->ap_recv_reg));
-                g_free(msg);
+            if (received) {
+                memcpy(s->ap_recv_reg, msg.data, sizeof(s->ap_recv_reg));
             } else {
                 memset(s->ap_recv_reg, 0, sizeof(s->ap_recv_reg));
             }
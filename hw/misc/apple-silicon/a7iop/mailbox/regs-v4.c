@@ -64,7 +64,7 @@ static void apple_a7iop_v4_mailbox_reg_write(void *opaque, hwaddr addr,
                                              const uint64_t data, unsigned size)
 {
     AppleA7IOPMailbox *s = opaque;
-    AppleA7IOPMessage *msg;
+    AppleA7IOPMessage msg;
 
     switch (addr) {
     case REG_INT_MASK_SET:
@@ -86,11 +86,10 @@ static void apple_a7iop_v4_mailbox_reg_write(void *opaque, hwaddr addr,
         qemu_mutex_lock(&s->lock);
         memcpy(s->iop_send_reg + (addr - REG_IOP_SEND0), &data, size);
         if (addr + size - 4 == REG_IOP_SEND3) {
-            msg = g_new0(AppleA7IOPMessage, 1);
-            memcpy(msg->data, s->iop_send_reg, sizeof(msg->data));
+            memcpy(msg.data, s->iop_send_reg, sizeof(msg.data));
             qemu_mutex_unlock(&s->lock);
-            apple_a7iop_mailbox_send_iop(s, msg);
-            IOP_LOG_MSG(s, "AP sent", msg);
+            apple_a7iop_mailbox_send_iop(s, &msg);
+            IOP_LOG_MSG(s, "AP sent", &msg);
         } else {
             qemu_mutex_unlock(&s->lock);
         }
@@ -105,11 +104,10 @@ static void apple_a7iop_v4_mailbox_reg_write(void *opaque, hwaddr addr,
         qemu_mutex_lock(&s->lock);
         memcpy(s->ap_send_reg + (addr - REG_AP_SEND0), &data, size);
         if (addr + size - 4 == REG_AP_SEND3) {
-            msg = g_new0(AppleA7IOPMessage, 1);
-            memcpy(msg->data, s->ap_send_reg, sizeof(msg->data));
+            memcpy(msg.data, s->ap_send_reg, sizeof(msg.data));
             qemu_mutex_unlock(&s->lock);
-            apple_a7iop_mailbox_send_ap(s, msg);
-            IOP_LOG_MSG(s, "IOP sent", msg);
+            apple_a7iop_mailbox_send_ap(s, &msg);
+            IOP_LOG_MSG(s, "IOP sent", &msg);
         } else {
             qemu_mutex_unlock(&s->lock);
         }
@@ -126,7 +124,7 @@ static uint64_t apple_a7iop_v4_mailbox_reg_read(void *opaque, hwaddr addr,
                                                 unsigned size)
 {
     AppleA7IOPMailbox *s = opaque;
-    AppleA7IOPMessage *msg;
+    AppleA7IOPMessage msg;
     uint64_t ret = 0;
 
     switch (addr) {
@@ -141,13 +139,11 @@ static uint64_t apple_a7iop_v4_mailbox_reg_read(void *opaque, hwaddr addr,
     case REG_IOP_RECV0:
         WITH_QEMU_LOCK_GUARD(&s->lock)
         {
-            msg = apple_a7iop_mailbox_recv_iop(s);
-            if (msg == NULL) {
-                memset(s->iop_recv_reg, 0, sizeof(s->iop_recv_reg));
+            if (apple_a7iop_mailbox_recv_iop(s, &msg)) {
+                memcpy(s->iop_recv_reg, msg.data, sizeof(s->iop_recv_reg));
+                IOP_LOG_MSG(s, "IOP received", &msg);
             } else {
-                memcpy(s->iop_recv_reg, msg->data, sizeof(s->iop_recv_reg));
-                IOP_LOG_MSG(s, "IOP received", msg);
-                g_free(msg);
+                memset(s->iop_recv_reg, 0, sizeof(s->iop_recv_reg));
             }
         }
         QEMU_FALLTHROUGH;
@@ -162,13 +158,11 @@ static uint64_t apple_a7iop_v4_mailbox_reg_read(void *opaque, hwaddr addr,
     case REG_AP_RECV0:
         WITH_QEMU_LOCK_GUARD(&s->lock)
         {
-            msg = apple_a7iop_mailbox_recv_ap(s);
-            if (msg == NULL) {
-                memset(s->ap_recv_reg, 0, sizeof(s->ap_recv_reg));
+            if (apple_a7iop_mailbox_recv_ap(s, &msg)) {
+                memcpy(s->ap_recv_reg, msg.data, sizeof(s->ap_recv_reg));
+                IOP_LOG_MSG(s, "AP received", &msg);
             } else {
-                memcpy(s->ap_recv_reg, msg->data, sizeof(s->ap_recv_reg));
-                IOP_LOG_MSG(s, "AP received", msg);
-                g_free(msg);
+                memset(s->ap_recv_reg, 0, sizeof(s->ap_recv_reg));
             }
         }
         QEMU_FALLTHROUGH;
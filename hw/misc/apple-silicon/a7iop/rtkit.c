@@ -119,22 +119,33 @@ const VMStateDescription vmstate_apple_rtkit = {
         },
 };
 
-static AppleA7IOPMessage *apple_rtkit_construct_msg(uint8_t ep, uint64_t data)
+static void apple_rtkit_construct_msg(AppleA7IOPMessage *msg, uint8_t ep,
+                                      uint64_t data)
 {
-    AppleA7IOPMessage *msg;
     AppleRTKitMessage *rtk_msg;
 
-    msg = g_new0(AppleA7IOPMessage, 1);
+    memset(msg->data, 0, sizeof(msg->data));
     rtk_msg = (AppleRTKitMessage *)msg->data;
     rtk_msg->endpoint = ep;
     rtk_msg->msg = data;
-
-    return msg;
 }
 
 static void apple_rtkit_send_msg(AppleRTKit *s, uint8_t ep, uint64_t data)
 {
-    apple_a7iop_send_ap(&s->parent_obj, apple_rtkit_construct_msg(ep, data));
+    AppleA7IOPMessage msg;
+
+    apple_rtkit_construct_msg(&msg, ep, data);
+    apple_a7iop_send_ap(&s->parent_obj, &msg);
+}
+
+static void apple_rtkit_send_next_rollcall(AppleRTKit *s)
+{
+    AppleA7IOPMessage *msg;
+
+    msg = QTAILQ_FIRST(&s->rollcall);
+    QTAILQ_REMOVE(&s->rollcall, msg, next);
+    apple_a7iop_send_ap(&s->parent_obj, msg);
+    g_free(msg);
 }
 
 void apple_rtkit_send_control_msg(AppleRTKit *s, uint8_t ep, uint64_t data)
@@ -229,7 +240,6 @@ static void apple_rtkit_mgmt_rollcall_v10(AppleRTKit *s)
 
 static void apple_rtkit_mgmt_rollcall_v11(AppleRTKit *s)
 {
-    AppleA7IOP *a7iop = &s->parent_obj;
     AppleA7IOPMessage *msg;
     AppleRTKitManagementMessage mgmt_msg = { 0 };
     AppleRTKitEPTable_it_t it;
@@ -250,7 +260,8 @@ static void apple_rtkit_mgmt_rollcall_v11(AppleRTKit *s)
             mgmt_msg.rollcall_v11.mask = mask;
             mgmt_msg.rollcall_v11.block = last_block;
             mgmt_msg.rollcall_v11.end = false;
-            msg = apple_rtkit_construct_msg(EP_MANAGEMENT, mgmt_msg.raw);
+            msg = g_new0(AppleA7IOPMessage, 1);
+            apple_rtkit_construct_msg(msg, EP_MANAGEMENT, mgmt_msg.raw);
             QTAILQ_INSERT_TAIL(&s->rollcall, msg, next);
             mask = 0;
         }
@@ -263,12 +274,11 @@ static void apple_rtkit_mgmt_rollcall_v11(AppleRTKit *s)
     mgmt_msg.rollcall_v11.mask = mask;
     mgmt_msg.rollcall_v11.block = last_block;
     mgmt_msg.rollcall_v11.end = true;
-    msg = apple_rtkit_construct_msg(EP_MANAGEMENT, mgmt_msg.raw);
+    msg = g_new0(AppleA7IOPMessage, 1);
+    apple_rtkit_construct_msg(msg, EP_MANAGEMENT, mgmt_msg.raw);
     QTAILQ_INSERT_TAIL(&s->rollcall, msg, next);
 
-    msg = QTAILQ_FIRST(&s->rollcall);
-    QTAILQ_REMOVE(&s->rollcall, msg, next);
-    apple_a7iop_send_ap(a7iop, msg);
+    apple_rtkit_send_next_rollcall(s);
 }
 
 static void apple_rtkit_mgmt_handle_msg(void *opaque, uint8_t ep,
@@ -352,9 +362,7 @@ static void apple_rtkit_mgmt_handle_msg(void *opaque, uint8_t ep,
                 s->ops->boot_done(s->opaque);
             }
         } else {
-            AppleA7IOPMessage *m2 = QTAILQ_FIRST(&s->rollcall);
-            QTAILQ_REMOVE(&s->rollcall, m2, next);
-            apple_a7iop_send_ap(a7iop, m2);
+            apple_rtkit_send_next_rollcall(s);
         }
         break;
     default:
@@ -393,14 +401,16 @@ static void apple_rtkit_handle_messages_bh(void *opaque)
     AppleRTKit *s = opaque;
     AppleA7IOP *a7iop = opaque;
     AppleRTKitEPData *data;
-    AppleA7IOPMessage *msg;
+    AppleA7IOPMessage msg;
     AppleRTKitMessage *rtk_msg;
 
     QEMU_LOCK_GUARD(&s->lock);
 
     while (!apple_a7iop_mailbox_is_empty(a7iop->iop_mailbox)) {
-        msg = apple_a7iop_recv_iop(a7iop);
-        rtk_msg = (AppleRTKitMessage *)msg->data;
+        if (!apple_a7iop_recv_iop(a7iop, &msg)) {
+            break;
+        }
+        rtk_msg = (AppleRTKitMessage *)msg.data;
         data = AppleRTKitEPTable_get(s->endpoints, rtk_msg->endpoint);
         if (data != NULL && data->handler != NULL) {
             data->handler(data->opaque,
@@ -408,7 +418,6 @@ static void apple_rtkit_handle_messages_bh(void *opaque)
                                        rtk_msg->endpoint,
                           rtk_msg->msg);
         }
-        g_free(msg);
     }
 }
 
@@ -32,12 +32,19 @@
 #include "qemu/log.h"
 #include "qemu/main-loop.h"
 #include "qemu/module.h"
+#include "qemu/range.h"
 #include "qemu/rcu.h"
+#include "qemu/timer.h"
+#include "qemu/units.h"
 #include "system/dma.h"
 #include "trace.h"
 
 OBJECT_DECLARE_SIMPLE_TYPE(AppleAESState, APPLE_AES)
 
+/* Upper bounds for merging queued DATA commands into one cipher call */
+#define AES_BATCH_MAX_COMMANDS (32)
+#define AES_BATCH_MAX_BYTES (1 * MiB)
+
 typedef struct AESCommand {
     uint32_t command;
     uint32_t *data;
@@ -80,6 +87,9 @@ struct AppleAESState {
     uint8_t iv[4][16];
     bool stopped;
     uint32_t board_id;
+    /* Bounce buffer for DATA commands, only touched by the AES thread */
+    uint8_t *buffer;
+    size_t buffer_size;
 };
 
 static uint32_t key_size(uint8_t len)
@@ -126,6 +136,8 @@ static QCryptoCipherMode key_mode(block_mode_t mode)
 
 static void apple_aes_reset(DeviceState *s);
 static void *aes_thread(void *opaque);
+static bool aes_process_data(AppleAESState *s, AESCommand **batch,
+                             uint32_t count);
 
 static void aes_update_irq(AppleAESState *s)
 {
@@ -190,6 +202,252 @@ static void aes_stop(AppleAESState *s)
     }
 }
 
+static int aes_crypt(AESKey *key, const void *in, void *out, size_t len)
+{
+    Error *local_err = NULL;
+    int res;
+
+    if (key->encrypt) {
+        res = qcrypto_cipher_encrypt(key->cipher, in, out, len, &local_err);
+    } else {
+        res = qcrypto_cipher_decrypt(key->cipher, in, out, len, &local_err);
+    }
+    if (res != 0) {
+        fprintf(stderr, "AES %scryption failed: %s\n",
+                key->encrypt ? "en" : "de", error_get_pretty(local_err));
+        error_free(local_err);
+    }
+    return res;
+}
+
+/*
+ * Run the cipher straight on guest memory. Returns false if either buffer
+ * cannot be mapped in one piece, or they partially overlap.
+ */
+static bool aes_crypt_mapped(AppleAESState *s, AESKey *key,
+                             dma_addr_t source_addr, dma_addr_t dest_addr,
+                             uint32_t len)
+{
+    dma_addr_t source_len = len;
+    dma_addr_t dest_len = len;
+    void *source;
+    void *dest;
+
+    if (source_addr != dest_addr && source_addr < dest_addr + len &&
+        dest_addr < source_addr + len) {
+        return false;
+    }
+
+    source = dma_memory_map(&s->dma_as, source_addr, &source_len,
+                            DMA_DIRECTION_TO_DEVICE, MEMTXATTRS_UNSPECIFIED);
+    if (source == NULL) {
+        return false;
+    }
+    if (source_len != len) {
+        dma_memory_unmap(&s->dma_as, source, source_len,
+                         DMA_DIRECTION_TO_DEVICE, 0);
+        return false;
+    }
+
+    dest = dma_memory_map(&s->dma_as, dest_addr, &dest_len,
+                          DMA_DIRECTION_FROM_DEVICE, MEMTXATTRS_UNSPECIFIED);
+    if (dest == NULL || dest_len != len) {
+        if (dest != NULL) {
+            dma_memory_unmap(&s->dma_as, dest, dest_len,
+                             DMA_DIRECTION_FROM_DEVICE, 0);
+        }
+        dma_memory_unmap(&s->dma_as, source, source_len,
+                         DMA_DIRECTION_TO_DEVICE, 0);
+        return false;
+    }
+
+    aes_crypt(key, source, dest, len);
+
+    dma_memory_unmap(&s->dma_as, dest, dest_len, DMA_DIRECTION_FROM_DEVICE,
+                     len);
+    dma_memory_unmap(&s->dma_as, source, source_len, DMA_DIRECTION_TO_DEVICE,
+                     len);
+    return true;
+}
+
+static void aes_data_addrs(command_data_t *c, dma_addr_t *source_addr,
+                           dma_addr_t *dest_addr)
+{
+    *source_addr =
+        c->source_addr |
+        ((dma_addr_t)COMMAND_DATA_UPPER_ADDR_SOURCE(c->upper_addr) << 32);
+    *dest_addr = c->dest_addr |
+                 ((dma_addr_t)COMMAND_DATA_UPPER_ADDR_DEST(c->upper_addr)
+                  << 32);
+}
+
+/*
+ * Whether `next` reads memory that a command already in the batch writes.
+ * The batch reads every source before writing any destination, so such a
+ * command would see the data from before the earlier command ran.
+ */
+static bool aes_batch_feeds(AESCommand **batch, uint32_t count,
+                            AESCommand *next)
+{
+    command_data_t *c = (command_data_t *)next->data;
+    uint32_t len = COMMAND_DATA_COMMAND_LENGTH(c->command);
+    dma_addr_t source_addr;
+    dma_addr_t dest_addr;
+    dma_addr_t unused;
+    uint32_t dest_len;
+    uint32_t i;
+
+    if (len == 0) {
+        return false;
+    }
+    aes_data_addrs(c, &source_addr, &dest_addr);
+
+    for (i = 0; i < count; ++i) {
+        c = (command_data_t *)batch[i]->data;
+        dest_len = COMMAND_DATA_COMMAND_LENGTH(c->command);
+        if (dest_len == 0) {
+            continue;
+        }
+        aes_data_addrs(c, &unused, &dest_addr);
+        if (ranges_overlap(source_addr, len, dest_addr, dest_len)) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/*
+ * Pull the DATA commands queued right behind batch[0] that continue its
+ * key and IV context, so that they go through the cipher in one call.
+ */
+static uint32_t aes_collect_data_batch(AppleAESState *s, AESCommand **batch)
+{
+    uint32_t command = batch[0]->data[0];
+    uint32_t total = COMMAND_DATA_COMMAND_LENGTH(command);
+    uint32_t count = 1;
+    AESCommand *next;
+    uint32_t len;
+
+    if (total & 0xf) {
+        return count;
+    }
+
+    QEMU_LOCK_GUARD(&s->queue_mutex);
+    while (count < AES_BATCH_MAX_COMMANDS) {
+        next = QTAILQ_FIRST(&s->queue);
+        if (next == NULL || COMMAND_OPCODE(next->command) != OPCODE_DATA) {
+            break;
+        }
+        len = COMMAND_DATA_COMMAND_LENGTH(next->data[0]);
+        if (COMMAND_DATA_COMMAND_KEY_CONTEXT(next->data[0]) !=
+                COMMAND_DATA_COMMAND_KEY_CONTEXT(command) ||
+            COMMAND_DATA_COMMAND_IV_CONTEXT(next->data[0]) !=
+                COMMAND_DATA_COMMAND_IV_CONTEXT(command) ||
+            (len & 0xf) || total + len > AES_BATCH_MAX_BYTES ||
+            aes_batch_feeds(batch, count, next)) {
+            break;
+        }
+        QTAILQ_REMOVE(&s->queue, next, next);
+        batch[count++] = next;
+        total += len;
+    }
+
+    return count;
+}
+
+/*
+ * Process DATA commands sharing a key and IV context as one stream.
+ * A single command is run in place on guest memory when possible; batches
+ * are gathered into the bounce buffer and scattered back after the cipher.
+ */
+static bool aes_process_data(AppleAESState *s, AESCommand **batch,
+                             uint32_t count)
+{
+    command_data_t *c = (command_data_t *)batch[0]->data;
+    uint32_t key_ctx = COMMAND_DATA_COMMAND_KEY_CONTEXT(c->command);
+    uint32_t iv_ctx = COMMAND_DATA_COMMAND_IV_CONTEXT(c->command);
+    AESKey *key = &s->keys[key_ctx];
+    dma_addr_t source_addr;
+    dma_addr_t dest_addr;
+    uint32_t total;
+    uint32_t len;
+    uint32_t off;
+    uint32_t i;
+    int64_t start = 0;
+
+    if (COMMAND_DATA_COMMAND_LENGTH(c->command) & 0xf) {
+        bql_lock();
+        s->reg.int_status.invalid_data_length = true;
+        return true;
+    }
+    if (key->disabled || !key->cipher) {
+        bql_lock();
+        if (key_ctx) {
+            s->reg.int_status.key_1_disabled = true;
+        } else {
+            s->reg.int_status.key_0_disabled = true;
+        }
+        return true;
+    }
+
+    if (trace_event_get_state_backends(TRACE_APPLE_AES_DATA)) {
+        start = get_clock();
+    }
+
+    if (key->mode != BLOCK_MODE_ECB) {
+        qcrypto_cipher_setiv(key->cipher, s->iv[iv_ctx], 16, NULL);
+    }
+
+    total = 0;
+    for (i = 0; i < count; ++i) {
+        total += COMMAND_DATA_COMMAND_LENGTH(batch[i]->data[0]);
+    }
+
+    aes_data_addrs(c, &source_addr, &dest_addr);
+    if (count != 1 ||
+        !aes_crypt_mapped(s, key, source_addr, dest_addr, total)) {
+        if (s->buffer_size < total) {
+            g_free(s->buffer);
+            s->buffer = g_malloc(total);
+            s->buffer_size = total;
+        }
+
+        WITH_RCU_READ_LOCK_GUARD()
+        {
+            for (i = 0, off = 0; i < count; ++i, off += len) {
+                c = (command_data_t *)batch[i]->data;
+                len = COMMAND_DATA_COMMAND_LENGTH(c->command);
+                aes_data_addrs(c, &source_addr, &dest_addr);
+                dma_memory_read(&s->dma_as, source_addr, s->buffer + off, len,
+                                MEMTXATTRS_UNSPECIFIED);
+            }
+        }
+
+        aes_crypt(key, s->buffer, s->buffer, total);
+
+        for (i = 0, off = 0; i < count; ++i, off += len) {
+            c = (command_data_t *)batch[i]->data;
+            len = COMMAND_DATA_COMMAND_LENGTH(c->command);
+            aes_data_addrs(c, &source_addr, &dest_addr);
+            dma_memory_write(&s->dma_as, dest_addr, s->buffer + off, len,
+                             MEMTXATTRS_UNSPECIFIED);
+        }
+    }
+
+    if (key->mode != BLOCK_MODE_ECB) {
+        qcrypto_cipher_getiv(key->cipher, s->iv[iv_ctx], 16, NULL);
+    }
+
+    if (trace_event_get_state_backends(TRACE_APPLE_AES_DATA)) {
+        int64_t ns = MAX(get_clock() - start, 1);
+        trace_apple_aes_data(key->mode, count, total, ns,
+                             (uint64_t)total * 1000 / ns);
+    }
+
+    return false;
+}
+
 static bool aes_process_command(AppleAESState *s, AESCommand *cmd)
 {
     trace_apple_aes_process_command(COMMAND_OPCODE(cmd->command));
@@ -269,69 +527,8 @@ static bool aes_process_command(AppleAESState *s, AESCommand *cmd)
         // qemu_hexdump(stderr, "AP AES: OPCODE_DSB: arr1", &cmd->data[5], 16);
         break;
     }
-    case OPCODE_DATA: {
-        command_data_t *c = (command_data_t *)cmd->data;
-        uint32_t key_ctx = COMMAND_DATA_COMMAND_KEY_CONTEXT(c->command);
-        uint32_t iv_ctx = COMMAND_DATA_COMMAND_IV_CONTEXT(c->command);
-        uint32_t len = COMMAND_DATA_COMMAND_LENGTH(c->command);
-        dma_addr_t source_addr = c->source_addr;
-        dma_addr_t dest_addr = c->dest_addr;
-        g_autofree uint8_t *buffer = NULL;
-        g_autofree Error *errp = NULL;
-
-        source_addr |=
-            ((dma_addr_t)COMMAND_DATA_UPPER_ADDR_SOURCE(c->upper_addr)) << 32;
-        dest_addr |= ((dma_addr_t)COMMAND_DATA_UPPER_ADDR_DEST(c->upper_addr))
-                     << 32;
-        if (len & 0xf) {
-            lock_reg();
-            s->reg.int_status.invalid_data_length = true;
-            break;
-        }
-        if (s->keys[key_ctx].disabled || !s->keys[key_ctx].cipher) {
-            lock_reg();
-            if (key_ctx) {
-                s->reg.int_status.key_1_disabled = true;
-            } else {
-                s->reg.int_status.key_0_disabled = true;
-            }
-            break;
-        }
-
-        buffer = g_malloc0(len);
-
-        WITH_RCU_READ_LOCK_GUARD()
-        {
-            dma_memory_read(&s->dma_as, source_addr, buffer, len,
-                            MEMTXATTRS_UNSPECIFIED);
-        }
-        qcrypto_cipher_setiv(s->keys[key_ctx].cipher, s->iv[iv_ctx], 16, &errp);
-
-        // qemu_hexdump(stderr, "AP AES: OPCODE_DATA: key", s->keys[key_ctx].key, s->keys[key_ctx].len);
-        // qemu_hexdump(stderr, "AP AES: OPCODE_DATA: iv_in", s->iv[iv_ctx], 16);
-        // qemu_hexdump(stderr, "AP AES: OPCODE_DATA: data_in", buffer, len);
-        int res;
-        if (s->keys[key_ctx].encrypt) {
-            res = qcrypto_cipher_encrypt(s->keys[key_ctx].cipher, buffer,
-                                         buffer, len, &errp);
-        } else {
-            res = qcrypto_cipher_decrypt(s->keys[key_ctx].cipher, buffer,
-                                         buffer, len, &errp);
-        }
-        if (res != 0) {
-            fprintf(stderr, "AES %scryption failed, res = %s\n",
-                    s->keys[key_ctx].encrypt ? "en" : "de", strerror(-res));
-        // } else {
-        //     fprintf(stderr, "AES %scryption success, res = %s\n",
-        //             s->keys[key_ctx].encrypt ? "en" : "de", strerror(-res));
-        }
-        qcrypto_cipher_getiv(s->keys[key_ctx].cipher, s->iv[iv_ctx], 16, &errp);
-        // qemu_hexdump(stderr, "AP AES: OPCODE_DATA: iv_out", s->iv[iv_ctx], 16);
-        // qemu_hexdump(stderr, "AP AES: OPCODE_DATA: data_out", buffer, len);
-        dma_memory_write(&s->dma_as, dest_addr, buffer, len,
-                         MEMTXATTRS_UNSPECIFIED);
-        break;
-    }
+    case OPCODE_DATA:
+        return aes_process_data(s, &cmd, 1);
     case OPCODE_STORE_IV: {
         command_store_iv_t *c = (command_store_iv_t *)cmd->data;
         dma_addr_t dest_addr = 0;
@@ -379,17 +576,30 @@ static void *aes_thread(void *opaque)
             }
         }
         if (cmd) {
-            if (!aes_process_command(s, cmd)) {
+            AESCommand *batch[AES_BATCH_MAX_COMMANDS] = { cmd };
+            uint32_t count = 1;
+            bool locked;
+
+            if (COMMAND_OPCODE(cmd->command) == OPCODE_DATA) {
+                trace_apple_aes_process_command(OPCODE_DATA);
+                count = aes_collect_data_batch(s, batch);
+                locked = aes_process_data(s, batch, count);
+            } else {
+                locked = aes_process_command(s, cmd);
+            }
+            if (!locked) {
                 bql_lock();
             }
-            s->reg.command_fifo_status.level -= cmd->data_len;
+            for (uint32_t i = 0; i < count; i++) {
+                s->reg.command_fifo_status.level -= batch[i]->data_len;
+            }
             aes_update_command_fifo_status(s);
             bql_unlock();
 
-            if (cmd->data) {
-                g_free(cmd->data);
+            for (uint32_t i = 0; i < count; i++) {
+                g_free(batch[i]->data);
+                g_free(batch[i]);
             }
-            g_free(cmd);
         }
         WITH_QEMU_LOCK_GUARD(&s->queue_mutex)
         {
@@ -712,6 +922,9 @@ static void apple_aes_unrealize(DeviceState *dev)
     AppleAESState *s = APPLE_AES(dev);
 
     apple_aes_reset(dev);
+    g_free(s->buffer);
+    s->buffer = NULL;
+    s->buffer_size = 0;
     qemu_cond_destroy(&s->thread_cond);
     qemu_mutex_destroy(&s->queue_mutex);
 }
@@ -23,6 +23,7 @@
 #include "hw/misc/apple-silicon/smc.h"
 #include "migration/vmstate.h"
 #include "qapi/error.h"
+#include "qapi/visitor.h"
 #include "qemu/memalign.h"
 #include "qemu/queue.h"
 #include "system/runstate.h"
@@ -59,7 +60,12 @@ struct AppleSMCState {
     AppleRTKit parent_obj;
 
     MemoryRegion iomems[2];
-    QTAILQ_HEAD(, SMCKey) keys;
+    /// Keys sorted by their four-CC, which is the order of key indices.
+    GPtrArray *keys;
+    GHashTable *key_index;
+    /// Sensor keys in the order they were added.
+    GPtrArray *sensors;
+    /// Only kept for migration, keys point to their data directly.
     QTAILQ_HEAD(, SMCKeyData) key_data;
     uint8_t *sram;
     uint32_t sram_size;
@@ -68,28 +74,14 @@ struct AppleSMCState {
 
 SMCKey *apple_smc_get_key(AppleSMCState *s, uint32_t key)
 {
-    SMCKey *key_entry;
-
-    QTAILQ_FOREACH (key_entry, &s->keys, next) {
-        if (key_entry->key == key) {
-            return key_entry;
-        }
-    }
-
-    return NULL;
+    return g_hash_table_lookup(s->key_index, GUINT_TO_POINTER(key));
 }
 
 SMCKeyData *apple_smc_get_key_data(AppleSMCState *s, uint32_t key)
 {
-    SMCKeyData *data_entry;
-
-    QTAILQ_FOREACH (data_entry, &s->key_data, next) {
-        if (data_entry->key == key) {
-            return data_entry;
-        }
-    }
+    SMCKey *key_entry = apple_smc_get_key(s, key);
 
-    return NULL;
+    return key_entry == NULL ? NULL : key_entry->data;
 }
 
 static SMCKey *apple_smc_new_key(uint32_t key, uint8_t size, SMCKeyType type,
@@ -118,6 +110,7 @@ static SMCKey *apple_smc_new_key(uint32_t key, uint8_t size, SMCKeyType type,
         memcpy(data_entry->data, data, size);
     }
 
+    key_entry->data = data_entry;
     *out_data_entry = data_entry;
 
     return key_entry;
@@ -126,13 +119,31 @@ static SMCKey *apple_smc_new_key(uint32_t key, uint8_t size, SMCKeyType type,
 static void apple_smc_insert_key(AppleSMCState *s, SMCKey *key_entry,
                                  SMCKeyData *data_entry)
 {
+    guint lo = 0;
+    guint hi = s->keys->len;
+    guint mid;
+
     if (apple_smc_get_key(s, key_entry->key) != NULL) {
         error_setg(&error_fatal, "duplicate SMC key `%c%c%c%c`",
                    SMC_KEY_FORMAT(key_entry->key));
         return;
     }
 
-    QTAILQ_INSERT_TAIL(&s->keys, key_entry, next);
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (((SMCKey *)g_ptr_array_index(s->keys, mid))->key < key_entry->key) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    g_ptr_array_insert(s->keys, lo, key_entry);
+    g_hash_table_insert(s->key_index, GUINT_TO_POINTER(key_entry->key),
+                        key_entry);
+    if (key_entry->is_sensor) {
+        g_ptr_array_add(s->sensors, key_entry);
+    }
     QTAILQ_INSERT_TAIL(&s->key_data, data_entry, next);
 }
 
@@ -222,14 +233,8 @@ static SMCResult smc_key_count_read(SMCKey *key, SMCKeyData *data,
                                     const void *in, uint8_t in_length)
 {
     AppleSMCState *s = key->opaque;
-    SMCKey *cur;
-    uint32_t key_count = 0;
 
-    QTAILQ_FOREACH (cur, &s->keys, next) {
-        ++key_count;
-    }
-
-    stl_be_p(data->data, key_count);
+    stl_be_p(data->data, s->keys->len);
 
     return SMC_RESULT_SUCCESS;
 }
@@ -283,16 +288,8 @@ static SMCResult apple_smc_sensor_count_read(SMCKey *key, SMCKeyData *data,
                                              const void *in, uint8_t in_length)
 {
     AppleSMCState *s = key->opaque;
-    SMCKey *cur;
-    uint32_t count = 0;
-
-    QTAILQ_FOREACH (cur, &s->keys, next) {
-        if (cur->is_sensor) {
-            ++count;
-        }
-    }
 
-    stl_le_p(data->data, count);
+    stl_le_p(data->data, s->sensors->len);
 
     return SMC_RESULT_SUCCESS;
 }
@@ -303,26 +300,19 @@ static SMCResult apple_smc_sensor_query_read(SMCKey *key, SMCKeyData *data,
     AppleSMCState *s = key->opaque;
     uint32_t queried_i;
     SMCKey *cur;
-    uint32_t i = 0;
 
     if (in == NULL || in_length != sizeof(uint32_t)) {
         return SMC_RESULT_BAD_ARGUMENT_ERROR;
     }
 
     queried_i = ldl_le_p(in);
-    QTAILQ_FOREACH (cur, &s->keys, next) {
-        if (cur->is_sensor) {
-            if (i == queried_i) {
-                stl_le_p(data->data, cur->key);
-                return SMC_RESULT_SUCCESS;
-            }
-
-            ++i;
-        }
+    if (queried_i >= s->sensors->len) {
+        return SMC_RESULT_BAD_ARGUMENT_ERROR;
     }
 
-
-    return SMC_RESULT_BAD_ARGUMENT_ERROR;
+    cur = g_ptr_array_index(s->sensors, queried_i);
+    stl_le_p(data->data, cur->key);
+    return SMC_RESULT_SUCCESS;
 }
 
 static void apple_smc_handle_key_endpoint(void *opaque, uint8_t ep,
@@ -351,10 +341,11 @@ static void apple_smc_handle_key_endpoint(void *opaque, uint8_t ep,
     case SMC_READ_KEY:
     case SMC_READ_KEY_PAYLOAD: {
         key_entry = apple_smc_get_key(s, key);
-        data_entry = apple_smc_get_key_data(s, key);
         if (key_entry == NULL) {
             resp.status = SMC_RESULT_KEY_NOT_FOUND;
         } else if (key_entry->info.attr & SMC_ATTR_R) {
+            data_entry = key_entry->data;
+            ++key_entry->reads;
             if (key_entry->read != NULL) {
                 resp.status =
                     key_entry->read(key_entry, data_entry,
@@ -377,10 +368,11 @@ static void apple_smc_handle_key_endpoint(void *opaque, uint8_t ep,
     }
     case SMC_WRITE_KEY: {
         key_entry = apple_smc_get_key(s, key);
-        data_entry = apple_smc_get_key_data(s, key);
         if (key_entry == NULL) {
             resp.status = SMC_RESULT_KEY_NOT_FOUND;
         } else if (key_entry->info.attr & SMC_ATTR_W) {
+            data_entry = key_entry->data;
+            ++key_entry->writes;
             if (key_entry->info.size != kmsg->length) {
                 resp.status = SMC_RESULT_KEY_SIZE_MISMATCH;
             } else if (key_entry->write != NULL) {
@@ -400,14 +392,7 @@ static void apple_smc_handle_key_endpoint(void *opaque, uint8_t ep,
         break;
     }
     case SMC_GET_KEY_BY_INDEX: {
-        uint32_t i = 0;
-
-        QTAILQ_FOREACH (key_entry, &s->keys, next) {
-            if (i == key) {
-                break;
-            }
-            ++i;
-        }
+        key_entry = key < s->keys->len ? g_ptr_array_index(s->keys, key) : NULL;
 
         if (key_entry == NULL) {
             resp.status = SMC_RESULT_KEY_INDEX_RANGE_ERROR;
@@ -534,7 +519,9 @@ SysBusDevice *apple_smc_create(AppleDTNode *node, AppleA7IOPVersion version,
     apple_dt_set_prop_u32(child, "pre-loaded", 1);
     apple_dt_set_prop_u32(child, "running", 1);
 
-    QTAILQ_INIT(&s->keys);
+    s->keys = g_ptr_array_new();
+    s->key_index = g_hash_table_new(NULL, NULL);
+    s->sensors = g_ptr_array_new();
     QTAILQ_INIT(&s->key_data);
 
     apple_smc_add_key_func(s, '#KEY', 4, SMC_KEY_TYPE_UINT32, 0, s,
@@ -704,13 +691,25 @@ static const VMStateDescription vmstate_apple_smc_key_data = {
         },
 };
 
+static int vmstate_apple_smc_pre_load(void *opaque)
+{
+    AppleSMCState *s = opaque;
+
+    // Keys keep their data, the incoming copies get merged in post_load.
+    QTAILQ_INIT(&s->key_data);
+
+    return 0;
+}
+
 static int vmstate_apple_smc_post_load(void *opaque, int version_id)
 {
     AppleSMCState *s = opaque;
     SMCKey *key;
-    SMCKey *key_next;
     SMCKeyData *data;
     SMCKeyData *data_next;
+    uint32_t loaded = 0;
+    guint i;
+    int ret = 0;
 
     QTAILQ_FOREACH_SAFE (data, &s->key_data, next, data_next) {
         key = apple_smc_get_key(s, data->key);
@@ -718,34 +717,41 @@ static int vmstate_apple_smc_post_load(void *opaque, int version_id)
             fprintf(stderr,
                     "Key `%c%c%c%c` was removed, state cannot be loaded.\n",
                     SMC_KEY_FORMAT(data->key));
-            return -1;
-        }
-
-        if (key->info.size != data->size) {
+            ret = -1;
+        } else if (key->info.size != data->size) {
             fprintf(stderr,
                     "Key `%c%c%c%c` has mismatched length, state cannot be "
                     "loaded.\n",
                     SMC_KEY_FORMAT(key->key));
-            return -1;
+            ret = -1;
+        } else {
+            memcpy(key->data->data, data->data, data->size);
+            ++loaded;
         }
+
+        QTAILQ_REMOVE(&s->key_data, data, next);
+        g_free(data->data);
+        g_free(data);
     }
 
-    QTAILQ_FOREACH_SAFE (key, &s->keys, next, key_next) {
-        if (apple_smc_get_key_data(s, key->key) == NULL) {
-            fprintf(stderr,
-                    "New key `%c%c%c%c` encountered, state cannot be loaded.\n",
-                    SMC_KEY_FORMAT(key->key));
-            return -1;
-        }
+    for (i = 0; i < s->keys->len; ++i) {
+        key = g_ptr_array_index(s->keys, i);
+        QTAILQ_INSERT_TAIL(&s->key_data, key->data, next);
     }
 
-    return 0;
+    if (ret == 0 && loaded != s->keys->len) {
+        fprintf(stderr, "New keys encountered, state cannot be loaded.\n");
+        ret = -1;
+    }
+
+    return ret;
 }
 
 static const VMStateDescription vmstate_apple_smc = {
     .name = "AppleSMCState",
     .version_id = 0,
     .minimum_version_id = 0,
+    .pre_load = vmstate_apple_smc_pre_load,
     .post_load = vmstate_apple_smc_post_load,
     .fields =
         (const VMStateField[]){
@@ -775,6 +781,37 @@ static void apple_smc_reset_hold(Object *obj, ResetType type)
     s->is_booted = false;
 }
 
+static void apple_smc_get_key_stats(Object *obj, Visitor *v,
+                                    const char *name, void *opaque,
+                                    Error **errp)
+{
+    AppleSMCState *s = APPLE_SMC_IOP(obj);
+    char key_name[5];
+    SMCKey *key;
+    guint i;
+
+    if (!visit_start_struct(v, name, NULL, 0, errp)) {
+        return;
+    }
+
+    for (i = 0; i < s->keys->len; ++i) {
+        key = g_ptr_array_index(s->keys, i);
+        snprintf(key_name, sizeof(key_name), "%c%c%c%c",
+                 SMC_KEY_FORMAT(key->key));
+
+        if (!visit_start_struct(v, key_name, NULL, 0, errp)) {
+            break;
+        }
+        if (visit_type_uint64(v, "reads", &key->reads, errp) &&
+            visit_type_uint64(v, "writes", &key->writes, errp)) {
+            visit_check_struct(v, errp);
+        }
+        visit_end_struct(v, NULL);
+    }
+
+    visit_end_struct(v, NULL);
+}
+
 static void apple_smc_class_init(ObjectClass *klass, const void *data)
 {
     ResettableClass *rc;
@@ -791,6 +828,11 @@ static void apple_smc_class_init(ObjectClass *klass, const void *data)
     dc->desc = "Apple System Management Controller IOP";
     dc->vmsd = &vmstate_apple_smc;
     set_bit(DEVICE_CATEGORY_MISC, dc->categories);
+
+    object_class_property_add(klass, "key-stats", "AppleSMCKeyStats",
+                              apple_smc_get_key_stats, NULL, NULL, NULL);
+    object_class_property_set_description(
+        klass, "key-stats", "Guest reads and writes of each SMC key");
 }
 
 static const TypeInfo apple_smc_info = {
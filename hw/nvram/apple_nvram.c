@@ -22,13 +22,7 @@ static inline uint8_t chrp_checksum(ChrpNvramPartHdr *header)
 
 env_var *env_find(AppleNvramState *s, const char *name)
 {
-    env_var *v;
-    QTAILQ_FOREACH (v, &s->env, entry) {
-        if (!strcmp(v->name, name)) {
-            return v;
-        }
-    }
-    return NULL;
+    return g_hash_table_lookup(s->env_index, name);
 }
 
 const char *env_get(AppleNvramState *s, const char *name)
@@ -85,6 +79,7 @@ int env_unset(AppleNvramState *s, const char *name)
     }
 
     QTAILQ_REMOVE(&s->env, v, entry);
+    g_hash_table_remove(s->env_index, v->name);
 
     g_free(v->str);
     g_free(v);
@@ -121,6 +116,7 @@ int env_set(AppleNvramState *s, const char *name, const char *val,
     v->flags = flags;
 
     QTAILQ_INSERT_TAIL(&s->env, v, entry);
+    g_hash_table_insert(s->env_index, v->name, v);
 
     g_steal_pointer(&v);
     return 0;
@@ -413,12 +409,79 @@ static void apple_nvram_cleanup(AppleNvramState *s)
         v = next;
     }
     QTAILQ_INIT(&s->env);
+    g_hash_table_remove_all(s->env_index);
 }
 
-void apple_nvram_save(AppleNvramState *s)
+/*
+ * Find the next run of sectors at or after `*offset` which differ from what
+ * is in the backing store.
+ */
+static bool apple_nvram_next_dirty(AppleNvramState *s, const uint8_t *buf,
+                                   size_t len, size_t *offset, size_t *bytes)
+{
+    size_t start = *offset;
+    size_t end;
+
+    if (s->disk == NULL || s->disk_len != len) {
+        if (start != 0) {
+            return false;
+        }
+        *bytes = len;
+        return true;
+    }
+
+    while (start < len &&
+           memcmp(buf + start, s->disk + start,
+                  MIN(BDRV_SECTOR_SIZE, len - start)) == 0) {
+        start += BDRV_SECTOR_SIZE;
+    }
+    if (start >= len) {
+        return false;
+    }
+
+    end = start;
+    while (end < len && memcmp(buf + end, s->disk + end,
+                               MIN(BDRV_SECTOR_SIZE, len - end)) != 0) {
+        end += BDRV_SECTOR_SIZE;
+    }
+
+    *offset = start;
+    *bytes = MIN(end, len) - start;
+    return true;
+}
+
+static void apple_nvram_written(AppleNvramState *s, const uint8_t *buf,
+                                size_t len, size_t offset, size_t bytes)
+{
+    if (s->disk == NULL || s->disk_len != len) {
+        g_free(s->disk);
+        s->disk = g_memdup2(buf, len);
+        s->disk_len = len;
+    } else {
+        memcpy(s->disk + offset, buf + offset, bytes);
+    }
+}
+
+static void apple_nvram_write(AppleNvramState *s, const uint8_t *buf,
+                              size_t len)
 {
     NvmeNamespace *ns = NVME_NS(s);
-    g_autofree void *buf = g_malloc0(s->len);
+    size_t offset = 0;
+    size_t bytes;
+
+    while (apple_nvram_next_dirty(s, buf, len, &offset, &bytes)) {
+        if (blk_pwrite(ns->blkconf.blk, offset, bytes, buf + offset, 0) < 0) {
+            error_report("%s: Failed to write NVRAM", __func__);
+            return;
+        }
+        apple_nvram_written(s, buf, len, offset, bytes);
+        offset += bytes;
+    }
+}
+
+void apple_nvram_save(AppleNvramState *s)
+{
+    g_autofree uint8_t *buf = g_malloc0(s->len);
     ssize_t len = apple_nvram_serialize(s, buf, s->len);
 
     if (len < 0) {
@@ -426,10 +489,7 @@ void apple_nvram_save(AppleNvramState *s)
         return;
     }
 
-    if (blk_pwrite(ns->blkconf.blk, 0, len, buf, 0) < 0) {
-        error_report("%s: Failed to write NVRAM", __func__);
-        return;
-    }
+    apple_nvram_write(s, buf, len);
 }
 
 void apple_nvram_load(AppleNvramState *s)
@@ -453,6 +513,9 @@ void apple_nvram_load(AppleNvramState *s)
     }
 
     apple_nvram_cleanup(s);
+    g_free(s->disk);
+    s->disk = g_memdup2(buffer, len);
+    s->disk_len = len;
     s->len = len;
     s->bank = nvram_parse(buffer, len);
     QTAILQ_INIT(&s->env);
@@ -490,6 +553,8 @@ static void apple_nvram_unrealize(DeviceState *dev)
     anc->parent_unrealize(dev);
 
     apple_nvram_cleanup(s);
+    g_free(s->disk);
+    s->disk = NULL;
 }
 
 static void apple_nvram_class_init(ObjectClass *klass, const void *data)
@@ -508,6 +573,17 @@ static void apple_nvram_class_init(ObjectClass *klass, const void *data)
 
 static void apple_nvram_instance_init(Object *obj)
 {
+    AppleNvramState *s = APPLE_NVRAM(obj);
+
+    QTAILQ_INIT(&s->env);
+    s->env_index = g_hash_table_new(g_str_hash, g_str_equal);
+}
+
+static void apple_nvram_instance_finalize(Object *obj)
+{
+    AppleNvramState *s = APPLE_NVRAM(obj);
+
+    g_hash_table_destroy(s->env_index);
 }
 
 static const TypeInfo apple_nvram_info = {
@@ -517,6 +593,7 @@ static const TypeInfo apple_nvram_info = {
     .class_init = apple_nvram_class_init,
     .instance_size = sizeof(AppleNvramState),
     .instance_init = apple_nvram_instance_init,
+    .instance_finalize = apple_nvram_instance_finalize,
 };
 
 static void apple_nvram_register_types(void)
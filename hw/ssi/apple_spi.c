@@ -95,6 +95,8 @@ struct AppleSPIState {
     Fifo32 rx_fifo;
     Fifo32 tx_fifo;
     uint32_t regs[APPLE_SPI_MMIO_SIZE >> 2];
+    uint8_t *bulk_rx;
+    size_t bulk_rx_size;
 
     int tx_chan_id;
     int rx_chan_id;
@@ -272,6 +274,99 @@ static void apple_spi_cs_set(void *opaque, int pin, int level)
     apple_spi_update_cs(spi);
 }
 
+typedef struct {
+    AppleSPIState *spi;
+    uint8_t *rx;
+    uint64_t pos;
+} AppleSPIBulkXfer;
+
+static uint64_t apple_spi_bulk_tx_iov(void *opaque, QEMUIOVector *qiov)
+{
+    AppleSPIBulkXfer *xfer = opaque;
+    int i;
+
+    for (i = 0; i < qiov->niov; i++) {
+        ssi_transfer_bulk(xfer->spi->ssi_bus, qiov->iov[i].iov_base,
+                          xfer->rx == NULL ? NULL : xfer->rx + xfer->pos,
+                          qiov->iov[i].iov_len);
+        xfer->pos += qiov->iov[i].iov_len;
+    }
+
+    return qiov->size;
+}
+
+/*
+ * While both FIFOs are idle in DMA mode, clock the TX segments straight out
+ * of guest memory instead of going through the FIFO a word at a time.
+ */
+static void apple_spi_run_bulk(AppleSPIState *spi)
+{
+    AppleSPIBulkXfer xfer = { .spi = spi };
+    uint32_t word_size;
+    uint64_t words;
+    uint64_t rx_words;
+    uint64_t len;
+    uint64_t i;
+
+    if (REG_CFG_MODE(REG(spi, REG_CFG)) != REG_CFG_MODE_DMA ||
+        !fifo32_is_empty(&spi->tx_fifo) || !fifo32_is_empty(&spi->rx_fifo)) {
+        return;
+    }
+
+    word_size = apple_spi_word_size(spi);
+    words = MIN(REG(spi, REG_TXCNT),
+                apple_sio_dma_remaining(spi->tx_chan) / word_size);
+    if (words == 0) {
+        return;
+    }
+
+    rx_words = MIN(words, REG(spi, REG_RXCNT));
+    if (rx_words * word_size > apple_sio_dma_remaining(spi->rx_chan)) {
+        // Leave it to the FIFO path, which reports the overflow.
+        return;
+    }
+
+    len = words * word_size;
+    if (rx_words != 0) {
+        if (spi->bulk_rx_size < len) {
+            spi->bulk_rx = g_realloc(spi->bulk_rx, len);
+            spi->bulk_rx_size = len;
+        }
+        xfer.rx = spi->bulk_rx;
+    }
+
+    len = apple_sio_dma_xfer_iov(spi->tx_chan, len, apple_spi_bulk_tx_iov,
+                                 &xfer);
+    words = len / word_size;
+    REG(spi, REG_TXCNT) -= words;
+
+    rx_words = MIN(rx_words, words);
+    if (rx_words != 0) {
+        // The FIFO path assembles received words MSB first.
+        switch (word_size) {
+        case sizeof(uint8_t):
+            break;
+        case sizeof(uint16_t):
+            for (i = 0; i < rx_words * word_size; i += word_size) {
+                stw_be_p(xfer.rx + i, lduw_le_p(xfer.rx + i));
+            }
+            break;
+        case sizeof(uint32_t):
+            for (i = 0; i < rx_words * word_size; i += word_size) {
+                stl_be_p(xfer.rx + i, ldl_le_p(xfer.rx + i));
+            }
+            break;
+        default:
+            g_assert_not_reached();
+        }
+        apple_sio_dma_write(spi->rx_chan, xfer.rx, rx_words * word_size);
+        REG(spi, REG_RXCNT) -= rx_words;
+    }
+
+    apple_spi_update_xfer_tx(spi);
+    apple_spi_update_xfer_rx(spi);
+}
+
 static void apple_spi_run(AppleSPIState *spi)
 {
     uint32_t tx;
@@ -292,6 +387,7 @@ static void apple_spi_run(AppleSPIState *spi)
         return;
     }
 
+    apple_spi_run_bulk(spi);
     apple_spi_update_xfer_tx(spi);
 
     while (REG(spi, REG_TXCNT) && !fifo32_is_empty(&spi->tx_fifo)) {
@@ -82,13 +82,20 @@ static void ssi_cs_default(void *opaque, int n, int level)
     s->cs = cs;
 }
 
+static bool ssi_peripheral_selected(SSIPeripheral *dev)
+{
+    SSIPeripheralClass *ssc = dev->spc;
+
+    return (dev->cs && ssc->cs_polarity == SSI_CS_HIGH) ||
+           (!dev->cs && ssc->cs_polarity == SSI_CS_LOW) ||
+           ssc->cs_polarity == SSI_CS_NONE;
+}
+
 static uint32_t ssi_transfer_raw_default(SSIPeripheral *dev, uint32_t val)
 {
     SSIPeripheralClass *ssc = dev->spc;
 
-    if ((dev->cs && ssc->cs_polarity == SSI_CS_HIGH) ||
-        (!dev->cs && ssc->cs_polarity == SSI_CS_LOW) ||
-        ssc->cs_polarity == SSI_CS_NONE) {
+    if (ssi_peripheral_selected(dev)) {
         return ssc->transfer(dev, val);
     }
     return 0;
@@ -167,6 +174,49 @@ uint32_t ssi_transfer(SSIBus *bus, uint32_t val)
     return r;
 }
 
+void ssi_transfer_bulk(SSIBus *bus, const uint8_t *tx, uint8_t *rx,
+                       size_t len)
+{
+    BusState *b = &bus->parent_obj;
+    BusChild *kid;
+    SSIPeripheral *target = NULL;
+    uint32_t r;
+    size_t i;
+
+    QTAILQ_FOREACH(kid, &b->children, sibling) {
+        SSIPeripheral *p = SSI_PERIPHERAL(kid->child);
+
+        if (p->spc->transfer_raw != ssi_transfer_raw_default) {
+            goto fallback;
+        }
+        if (!ssi_peripheral_selected(p)) {
+            continue;
+        }
+        if (target != NULL || p->spc->transfer_bulk == NULL) {
+            goto fallback;
+        }
+        target = p;
+    }
+
+    if (target == NULL) {
+        if (rx != NULL) {
+            memset(rx, 0, len);
+        }
+        return;
+    }
+
+    target->spc->transfer_bulk(target, tx, rx, len);
+    return;
+
+fallback:
+    for (i = 0; i < len; i++) {
+        r = ssi_transfer(bus, tx == NULL ? 0xff : tx[i]);
+        if (rx != NULL) {
+            rx[i] = r;
+        }
+    }
+}
+
 const VMStateDescription vmstate_ssi_peripheral = {
     .name = "SSISlave",
     .version_id = 1,
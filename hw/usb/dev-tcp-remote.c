@@ -25,10 +25,12 @@
 #include "migration/blocker.h"
 #include "qapi/error.h"
 #include "qemu/error-report.h"
+#include "qemu/iov.h"
 #include "qemu/lockable.h"
 #include "qemu/main-loop.h"
 #include "qemu/module.h"
 #include "qemu/sockets.h"
+#include "qemu/timer.h"
 #include "qom/object.h"
 #include "trace.h"
 
@@ -60,6 +62,92 @@ usb_tcp_remote_find_inflight_packet(USBTCPRemoteState *s, int pid, uint8_t ep,
     return NULL;
 }
 
+static guint usb_tcp_remote_async_packet_hash(gconstpointer key)
+{
+    const USBTCPAsyncPacket *a = key;
+
+    return g_int64_hash(&a->id) ^ ((guint)a->pid << 8) ^ a->ep;
+}
+
+static gboolean usb_tcp_remote_async_packet_equal(gconstpointer a,
+                                                  gconstpointer b)
+{
+    const USBTCPAsyncPacket *x = a;
+    const USBTCPAsyncPacket *y = b;
+
+    return x->pid == y->pid && x->ep == y->ep && x->id == y->id;
+}
+
+static USBTCPAsyncPacket *
+usb_tcp_remote_find_async_packet(USBTCPRemoteState *s, int pid, uint8_t ep,
+                                 uint64_t id)
+{
+    USBTCPAsyncPacket key = {
+        .pid = pid,
+        .ep = ep,
+        .id = id,
+    };
+
+    QEMU_LOCK_GUARD(&s->queue_mutex);
+
+    return g_hash_table_lookup(s->async_packets, &key);
+}
+
+static void usb_tcp_remote_remove_async_packet(USBTCPRemoteState *s,
+                                               USBTCPAsyncPacket *a)
+{
+    QEMU_LOCK_GUARD(&s->queue_mutex);
+
+    g_hash_table_remove(s->async_packets, a);
+    s->inflight -= 1;
+}
+
+/*
+ * Fail every asynchronous packet we still own, in endpoint queue order so
+ * that `usb_packet_complete` sees them in the order they were submitted.
+ */
+static void usb_tcp_remote_flush_async_packets(USBTCPRemoteState *s)
+{
+    USBDevice *dev = USB_DEVICE(s);
+    USBEndpoint *eps[1 + USB_MAX_ENDPOINTS * 2];
+    USBTCPAsyncPacket *a;
+    USBPacket *p;
+    int i;
+
+    if (g_hash_table_size(s->async_packets) == 0) {
+        return;
+    }
+
+    eps[0] = &dev->ep_ctl;
+    for (i = 0; i < USB_MAX_ENDPOINTS; i++) {
+        eps[1 + i * 2] = &dev->ep_in[i];
+        eps[2 + i * 2] = &dev->ep_out[i];
+    }
+
+    for (i = 0; i < G_N_ELEMENTS(eps); i++) {
+        while (!QTAILQ_EMPTY(&eps[i]->queue)) {
+            p = QTAILQ_FIRST(&eps[i]->queue);
+            if (p->state != USB_PACKET_ASYNC) {
+                break;
+            }
+            a = usb_tcp_remote_find_async_packet(s, p->pid, p->ep->nr, p->id);
+            if (a == NULL) {
+                break;
+            }
+            usb_tcp_remote_remove_async_packet(s, a);
+            p->status = USB_RET_STALL;
+            usb_packet_complete(dev, p);
+        }
+    }
+
+    /* Anything left over was already dequeued by the HCD. */
+    WITH_QEMU_LOCK_GUARD(&s->queue_mutex)
+    {
+        g_hash_table_remove_all(s->async_packets);
+        s->inflight = 0;
+    }
+}
+
 static void usb_tcp_remote_clean_inflight_queue(USBTCPRemoteState *s)
 {
     USBTCPInflightPacket *p;
@@ -101,13 +189,18 @@ static void usb_tcp_remote_cleanup(void *opaque)
         return;
     }
 
+    /* Wakes the reader if it is blocked in recv() */
+    shutdown(s->fd, SHUT_RDWR);
     close(s->fd);
 
     s->fd = -1;
     s->closed = true;
     s->addr = 0;
+    s->version = TCP_USB_VERSION_1;
 
     usb_tcp_remote_clean_completed_queue(s);
+    usb_tcp_remote_flush_async_packets(s);
+    timer_del(s->nak_timer);
 
     if (USB_DEVICE(s)->attached) {
         usb_device_detach(USB_DEVICE(s));
@@ -176,12 +269,31 @@ static void usb_tcp_remote_closed(USBTCPRemoteState *s)
     qemu_bh_schedule(s->cleanup_bh);
 }
 
+static bool usb_tcp_remote_in_frame(USBTCPRemoteState *s)
+{
+    return s->rx_frame_pos < s->rx_frame_len;
+}
+
 static int usb_tcp_remote_read(USBTCPRemoteState *s, void *buffer,
                                unsigned int length)
 {
     int ret = 0;
     int n = 0;
-    bool locked = bql_locked();
+    bool locked;
+
+    if (usb_tcp_remote_in_frame(s)) {
+        if (s->rx_frame_len - s->rx_frame_pos < length) {
+            error_report("%s: message crosses the end of its frame",
+                         __func__);
+            usb_tcp_remote_closed(s);
+            return -EINVAL;
+        }
+        memcpy(buffer, s->rx_frame + s->rx_frame_pos, length);
+        s->rx_frame_pos += length;
+        return length;
+    }
+
+    locked = bql_locked();
     if (locked) {
         bql_unlock();
     }
@@ -225,6 +337,92 @@ static int usb_tcp_remote_write(USBTCPRemoteState *s, void *buffer,
     return n;
 }
 
+static int usb_tcp_remote_writev(USBTCPRemoteState *s, struct iovec *iov,
+                                 unsigned int niov)
+{
+    size_t length = iov_size(iov, niov);
+    ssize_t ret;
+
+    ret = iov_send(s->fd, iov, niov, 0, length);
+    if (ret < 0 || ret < length) {
+        usb_tcp_remote_closed(s);
+        return -errno;
+    }
+
+    return ret;
+}
+
+static bool usb_tcp_remote_read_frame(USBTCPRemoteState *s)
+{
+    tcp_usb_frame_header fhdr = { 0 };
+
+    if (usb_tcp_remote_in_frame(s)) {
+        error_report("%s: nested TCP_USB_FRAME", __func__);
+        usb_tcp_remote_closed(s);
+        return false;
+    }
+
+    if (usb_tcp_remote_read(s, &fhdr, sizeof(fhdr)) < sizeof(fhdr)) {
+        return false;
+    }
+
+    if (fhdr.length > TCP_USB_FRAME_MAX_LENGTH) {
+        error_report("%s: frame too large (0x%x bytes)", __func__,
+                     fhdr.length);
+        usb_tcp_remote_closed(s);
+        return false;
+    }
+
+    s->rx_frame = g_realloc(s->rx_frame, fhdr.length);
+    s->rx_frame_len = 0;
+    s->rx_frame_pos = 0;
+    if (usb_tcp_remote_read(s, s->rx_frame, fhdr.length) < fhdr.length) {
+        return false;
+    }
+    s->rx_frame_len = fhdr.length;
+
+    return true;
+}
+
+static bool usb_tcp_remote_read_hello(USBTCPRemoteState *s)
+{
+    tcp_usb_header_t hdr = { 0 };
+    tcp_usb_hello_header hello = { 0 };
+    struct iovec iov[2];
+
+    if (usb_tcp_remote_read(s, &hello, sizeof(hello)) < sizeof(hello)) {
+        return false;
+    }
+
+    if (hello.magic != TCP_USB_HELLO_MAGIC ||
+        hello.version < TCP_USB_VERSION_1) {
+        error_report("%s: invalid TCP_USB_HELLO", __func__);
+        usb_tcp_remote_closed(s);
+        return false;
+    }
+
+    hdr.type = TCP_USB_HELLO;
+    hello.version = MIN(hello.version, s->max_version);
+
+    iov[0].iov_base = &hdr;
+    iov[0].iov_len = sizeof(hdr);
+    iov[1].iov_base = &hello;
+    iov[1].iov_len = sizeof(hello);
+
+    /* Everything we send after the reply may use the agreed version. */
+    WITH_QEMU_LOCK_GUARD(&s->request_mutex)
+    {
+        if (usb_tcp_remote_writev(s, iov, ARRAY_SIZE(iov)) < 0) {
+            return false;
+        }
+        s->version = hello.version;
+    }
+
+    DPRINTF("%s: using protocol version %u\n", __func__, s->version);
+
+    return true;
+}
+
 static bool usb_tcp_remote_read_one(USBTCPRemoteState *s)
 {
     tcp_usb_header_t hdr = { 0 };
@@ -234,24 +432,65 @@ static bool usb_tcp_remote_read_one(USBTCPRemoteState *s)
     }
 
     switch (hdr.type) {
+    case TCP_USB_FRAME:
+        return usb_tcp_remote_read_frame(s);
+
+    case TCP_USB_HELLO:
+        return usb_tcp_remote_read_hello(s);
+
     case TCP_USB_RESPONSE: {
-        tcp_usb_response_header rhdr = { 0 };
+        tcp_usb_response_header_v2 rhdr = { 0 };
         USBPacket *p = NULL;
         USBTCPInflightPacket *pkt = NULL;
+        USBTCPAsyncPacket *apkt = NULL;
+        g_autofree void *buffer = NULL;
         bool cancelled = false;
 
-        if (usb_tcp_remote_read(s, &rhdr, sizeof(rhdr)) < sizeof(rhdr)) {
-            return false;
+        if (usb_tcp_remote_in_frame(s)) {
+            if (usb_tcp_remote_read(s, &rhdr, sizeof(rhdr)) < sizeof(rhdr)) {
+                return false;
+            }
+        } else {
+            tcp_usb_response_header rhdr_v1 = { 0 };
+
+            if (usb_tcp_remote_read(s, &rhdr_v1, sizeof(rhdr_v1)) <
+                sizeof(rhdr_v1)) {
+                return false;
+            }
+            rhdr.addr = rhdr_v1.addr;
+            rhdr.pid = rhdr_v1.pid;
+            rhdr.ep = rhdr_v1.ep;
+            rhdr.id = rhdr_v1.id;
+            rhdr.status = rhdr_v1.status;
+            rhdr.length = rhdr_v1.length;
+        }
+
+        /*
+         * Reading drops the BQL, during which the packet may be cancelled
+         * and freed, so only look it up once the payload is in.
+         */
+        if (rhdr.length > 0 && rhdr.status != USB_RET_ASYNC &&
+            rhdr.pid == USB_TOKEN_IN) {
+            buffer = g_malloc(rhdr.length);
+            if (usb_tcp_remote_read(s, buffer, rhdr.length) < rhdr.length) {
+                return false;
+            }
         }
 
         smp_rmb();
         pkt =
             usb_tcp_remote_find_inflight_packet(s, rhdr.pid, rhdr.ep, rhdr.id);
         if (pkt == NULL) {
+            apkt = usb_tcp_remote_find_async_packet(s, rhdr.pid, rhdr.ep,
+                                                    rhdr.id);
+        }
+        if (pkt != NULL) {
+            p = pkt->p;
+        } else if (apkt != NULL) {
+            p = apkt->p;
+        } else {
             p = usb_ep_find_packet_by_id(USB_DEVICE(s), rhdr.pid, rhdr.ep,
                                          rhdr.id);
-        } else {
-            p = pkt->p;
         }
         DPRINTF("%s: TCP_USB_RESPONSE "
                 "Received packet pid: 0x%x ep: %d id: 0x%" PRIx64
@@ -267,16 +506,10 @@ static bool usb_tcp_remote_read_one(USBTCPRemoteState *s)
             /* When an EP is aborted, all of its queued packets are removed */
         }
 
-        if (rhdr.length > 0 && rhdr.status != USB_RET_ASYNC) {
-            g_autofree void *buffer = g_malloc(rhdr.length);
-            if (rhdr.pid == USB_TOKEN_IN) {
-                if (usb_tcp_remote_read(s, buffer, rhdr.length) < rhdr.length) {
-                    return false;
-                }
-                if (p) {
-                    usb_packet_copy(p, buffer, rhdr.length);
-                }
-            } else if (p) {
+        if (rhdr.length > 0 && rhdr.status != USB_RET_ASYNC && p) {
+            if (buffer != NULL) {
+                usb_packet_copy(p, buffer, rhdr.length);
+            } else {
                 p->actual_length += rhdr.length;
             }
         }
@@ -285,7 +518,36 @@ static bool usb_tcp_remote_read_one(USBTCPRemoteState *s)
             return true;
         }
 
+        if (apkt != NULL) {
+            switch (rhdr.status) {
+            case USB_RET_ASYNC:
+                /* Queued on the remote side, the real status follows. */
+                return true;
+            case USB_RET_NAK:
+                /* Retried from the NAK timer, like an HCD would next frame. */
+                p->actual_length = 0;
+                apkt->nak = true;
+                if (!timer_pending(s->nak_timer)) {
+                    timer_mod(s->nak_timer,
+                              qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) +
+                                  SCALE_MS);
+                }
+                return true;
+            default:
+                usb_tcp_remote_remove_async_packet(s, apkt);
+                break;
+            }
+        }
+
         p->status = rhdr.status;
+        if (p->status != USB_RET_ASYNC && p->status != USB_RET_NAK) {
+            if (p->pid == USB_TOKEN_IN) {
+                s->stat_bytes_in += rhdr.length;
+            } else {
+                s->stat_bytes_out += rhdr.length;
+            }
+            s->stat_packets += 1;
+        }
         if (p->state == USB_PACKET_ASYNC) {
             if (p->status == USB_RET_NAK || p->status == USB_RET_ASYNC) {
                 fprintf(stderr,
@@ -347,6 +609,10 @@ static void *usb_tcp_remote_read_thread(void *opaque)
     while (usb_tcp_remote_read_one(s) && !s->closed) {
         continue;
     }
+    /* The frame buffer belongs to the reader, it may be inside recv() */
+    g_clear_pointer(&s->rx_frame, g_free);
+    s->rx_frame_len = 0;
+    s->rx_frame_pos = 0;
     bql_unlock();
 
     return NULL;
@@ -382,9 +648,13 @@ static void *usb_tcp_remote_thread(void *arg)
             bql_lock();
             usb_device_attach(USB_DEVICE(s), &error_abort);
             bql_unlock();
+            if (s->read_thread_started) {
+                qemu_thread_join(&s->read_thread);
+            }
             qemu_thread_create(&s->read_thread, TYPE_USB_TCP_REMOTE ".read",
                                usb_tcp_remote_read_thread, s,
                                QEMU_THREAD_JOINABLE);
+            s->read_thread_started = true;
         }
 
         while (!s->closed) {
@@ -535,6 +805,13 @@ static void usb_tcp_remote_realize(USBDevice *dev, Error **errp)
 {
     USBTCPRemoteState *s = USB_TCP_REMOTE(dev);
 
+    if (s->max_version < TCP_USB_VERSION_1 ||
+        s->max_version > TCP_USB_VERSION_2) {
+        error_setg(errp, "max-version must be between %d and %d",
+                   TCP_USB_VERSION_1, TCP_USB_VERSION_2);
+        return;
+    }
+
     dev->speed = USB_SPEED_HIGH;
     dev->speedmask = USB_SPEED_MASK_HIGH;
     dev->flags |= (1 << USB_DEV_FLAG_IS_HOST);
@@ -546,6 +823,11 @@ static void usb_tcp_remote_realize(USBDevice *dev, Error **errp)
 
     qemu_mutex_init(&s->queue_mutex);
     QTAILQ_INIT(&s->queue);
+    s->async_packets =
+        g_hash_table_new_full(usb_tcp_remote_async_packet_hash,
+                              usb_tcp_remote_async_packet_equal, g_free, NULL);
+    s->nak_timer =
+        timer_new_ns(QEMU_CLOCK_VIRTUAL, usb_tcp_remote_nak_timer, s);
 
     qemu_mutex_init(&s->completed_queue_mutex);
     qemu_cond_init(&s->completed_queue_cond);
@@ -555,9 +837,19 @@ static void usb_tcp_remote_realize(USBDevice *dev, Error **errp)
     s->addr_bh = qemu_bh_new(usb_tcp_remote_update_addr_bh, s);
     s->cleanup_bh = qemu_bh_new(usb_tcp_remote_cleanup, s);
 
+    object_property_add_uint64_ptr(OBJECT(s), "stat-bytes-in",
+                                   &s->stat_bytes_in, OBJ_PROP_FLAG_READ);
+    object_property_add_uint64_ptr(OBJECT(s), "stat-bytes-out",
+                                   &s->stat_bytes_out, OBJ_PROP_FLAG_READ);
+    object_property_add_uint64_ptr(OBJECT(s), "stat-packets", &s->stat_packets,
+                                   OBJ_PROP_FLAG_READ);
+    object_property_add_uint64_ptr(OBJECT(s), "stat-inflight-peak",
+                                   &s->stat_inflight_peak, OBJ_PROP_FLAG_READ);
+
     s->socket = -1;
     s->fd = -1;
     s->closed = true;
+    s->version = TCP_USB_VERSION_1;
 
     switch (s->conn_type) {
     case TCP_REMOTE_CONN_TYPE_UNIX:
@@ -611,6 +903,9 @@ static void usb_tcp_remote_unrealize(USBDevice *dev)
     s->stopped = true;
     usb_tcp_remote_clean_inflight_queue(s);
     usb_tcp_remote_clean_completed_queue(s);
+    usb_tcp_remote_flush_async_packets(s);
+    timer_free(s->nak_timer);
+    g_hash_table_destroy(s->async_packets);
 }
 
 static void usb_tcp_remote_handle_reset(USBDevice *dev)
@@ -625,6 +920,7 @@ static void usb_tcp_remote_handle_reset(USBDevice *dev)
     DPRINTF("%s\n", __func__);
     usb_tcp_remote_clean_inflight_queue(s);
     usb_tcp_remote_clean_completed_queue(s);
+    usb_tcp_remote_flush_async_packets(s);
     s->addr = 0;
     hdr.type = TCP_USB_RESET;
 
@@ -634,10 +930,25 @@ static void usb_tcp_remote_handle_reset(USBDevice *dev)
     }
 }
 
+static void usb_tcp_remote_send_cancel(USBTCPRemoteState *s,
+                                       tcp_usb_header_t *hdr,
+                                       tcp_usb_cancel_header *pkt)
+{
+    struct iovec iov[2] = {
+        { .iov_base = hdr, .iov_len = sizeof(*hdr) },
+        { .iov_base = pkt, .iov_len = sizeof(*pkt) },
+    };
+
+    QEMU_LOCK_GUARD(&s->request_mutex);
+
+    usb_tcp_remote_writev(s, iov, ARRAY_SIZE(iov));
+}
+
 static void usb_tcp_remote_cancel_packet(USBDevice *dev, USBPacket *p)
 {
     USBTCPRemoteState *s = USB_TCP_REMOTE(dev);
     USBTCPInflightPacket inflightPacket = { 0 };
+    USBTCPAsyncPacket *apkt;
     tcp_usb_header_t hdr = { 0 };
     tcp_usb_cancel_header pkt = { 0 };
     bool locked = bql_locked();
@@ -648,6 +959,11 @@ static void usb_tcp_remote_cancel_packet(USBDevice *dev, USBPacket *p)
         return;
     }
 
+    apkt = usb_tcp_remote_find_async_packet(s, p->pid, p->ep->nr, p->id);
+    if (apkt != NULL) {
+        usb_tcp_remote_remove_async_packet(s, apkt);
+    }
+
     if (s->closed) {
         return;
     }
@@ -661,6 +977,15 @@ static void usb_tcp_remote_cancel_packet(USBDevice *dev, USBPacket *p)
     DPRINTF("%s: pid: 0x%x ep %d id 0x%" PRIx64 "\n", __func__, pkt.pid, pkt.ep,
             pkt.id);
 
+    if (apkt != NULL) {
+        /*
+         * The remote answers with whatever it had transferred so far; that
+         * response no longer matches anything and is dropped by the reader.
+         */
+        usb_tcp_remote_send_cancel(s, &hdr, &pkt);
+        return;
+    }
+
     inflightPacket.p = p;
     inflightPacket.addr = dev->addr;
     qatomic_set(&inflightPacket.handled, 0);
@@ -670,11 +995,7 @@ static void usb_tcp_remote_cancel_packet(USBDevice *dev, USBPacket *p)
         QTAILQ_INSERT_TAIL(&s->queue, &inflightPacket, queue);
     }
 
-    WITH_QEMU_LOCK_GUARD(&s->request_mutex)
-    {
-        usb_tcp_remote_write(s, &hdr, sizeof(hdr));
-        usb_tcp_remote_write(s, &pkt, sizeof(pkt));
-    }
+    usb_tcp_remote_send_cancel(s, &hdr, &pkt);
     /* TODO: wait for status */
 
     DPRINTF("%s: waiting for response\n", __func__);
@@ -699,19 +1020,17 @@ static void usb_tcp_remote_cancel_packet(USBDevice *dev, USBPacket *p)
     }
 }
 
-static void usb_tcp_remote_handle_packet(USBDevice *dev, USBPacket *p)
+static bool usb_tcp_remote_send_request(USBTCPRemoteState *s, USBPacket *p)
 {
-    USBTCPRemoteState *s = USB_TCP_REMOTE(dev);
+    tcp_usb_header_t fhdr_type = { 0 };
+    tcp_usb_frame_header fhdr = { 0 };
     tcp_usb_header_t hdr = { 0 };
-    tcp_usb_request_header pkt = { 0 };
-    USBTCPInflightPacket inflightPacket = { 0 };
+    tcp_usb_request_header_v2 pkt = { 0 };
+    tcp_usb_request_header pkt_v1 = { 0 };
     g_autofree void *buffer = NULL;
-    bool locked = bql_locked();
-
-    if (s->closed) {
-        p->status = USB_RET_STALL;
-        return;
-    }
+    struct iovec iov[5];
+    unsigned int niov = 0;
+    uint32_t length;
 
     hdr.type = TCP_USB_REQUEST;
     pkt.addr = s->addr;
@@ -740,6 +1059,129 @@ static void usb_tcp_remote_handle_packet(USBDevice *dev, USBPacket *p)
         }
     }
 
+    QEMU_LOCK_GUARD(&s->request_mutex);
+
+    if (s->version >= TCP_USB_VERSION_2) {
+        fhdr_type.type = TCP_USB_FRAME;
+        fhdr.count = 1;
+        fhdr.length = sizeof(hdr) + sizeof(pkt);
+        /* Payloads too large for a frame follow it unframed */
+        if (buffer &&
+            fhdr.length + pkt.length <= TCP_USB_FRAME_MAX_LENGTH) {
+            fhdr.length += pkt.length;
+        }
+        iov[niov].iov_base = &fhdr_type;
+        iov[niov++].iov_len = sizeof(fhdr_type);
+        iov[niov].iov_base = &fhdr;
+        iov[niov++].iov_len = sizeof(fhdr);
+        iov[niov].iov_base = &hdr;
+        iov[niov++].iov_len = sizeof(hdr);
+        iov[niov].iov_base = &pkt;
+        iov[niov++].iov_len = sizeof(pkt);
+        length = pkt.length;
+    } else {
+        if (pkt.length > UINT16_MAX) {
+            warn_report_once("%s: transfer of 0x%x bytes truncated, "
+                             "version 1 lengths are 16-bit",
+                             __func__, pkt.length);
+        }
+        pkt_v1.addr = pkt.addr;
+        pkt_v1.pid = pkt.pid;
+        pkt_v1.ep = pkt.ep;
+        pkt_v1.id = pkt.id;
+        pkt_v1.stream = pkt.stream;
+        pkt_v1.short_not_ok = pkt.short_not_ok;
+        pkt_v1.int_req = pkt.int_req;
+        pkt_v1.length = pkt.length;
+        iov[niov].iov_base = &hdr;
+        iov[niov++].iov_len = sizeof(hdr);
+        iov[niov].iov_base = &pkt_v1;
+        iov[niov++].iov_len = sizeof(pkt_v1);
+        length = pkt_v1.length;
+    }
+
+    if (buffer && length) {
+        iov[niov].iov_base = buffer;
+        iov[niov++].iov_len = length;
+    }
+
+    return usb_tcp_remote_writev(s, iov, niov) >= 0;
+}
+
+static void usb_tcp_remote_nak_timer(void *opaque)
+{
+    USBTCPRemoteState *s = opaque;
+    g_autoptr(GPtrArray) retry = g_ptr_array_new();
+    GHashTableIter iter;
+    USBTCPAsyncPacket *a;
+    int i;
+
+    WITH_QEMU_LOCK_GUARD(&s->queue_mutex)
+    {
+        g_hash_table_iter_init(&iter, s->async_packets);
+        while (g_hash_table_iter_next(&iter, (gpointer *)&a, NULL)) {
+            if (a->nak) {
+                a->nak = false;
+                g_ptr_array_add(retry, a->p);
+            }
+        }
+    }
+
+    for (i = 0; i < retry->len && !s->closed; i++) {
+        usb_tcp_remote_send_request(s, g_ptr_array_index(retry, i));
+    }
+}
+
+static void usb_tcp_remote_handle_packet_async(USBTCPRemoteState *s,
+                                               USBPacket *p)
+{
+    USBTCPAsyncPacket *a = g_new0(USBTCPAsyncPacket, 1);
+
+    /*
+     * Endpoints are not pipelined: a NAKed packet is retried later, and
+     * `usb_packet_complete` requires completions in queue order, so only
+     * one packet per endpoint is in flight. Endpoints still overlap.
+     */
+    a->p = p;
+    a->pid = p->pid;
+    a->ep = p->ep->nr;
+    a->id = p->id;
+
+    WITH_QEMU_LOCK_GUARD(&s->queue_mutex)
+    {
+        g_hash_table_add(s->async_packets, a);
+        s->inflight += 1;
+        if (s->inflight > s->stat_inflight_peak) {
+            s->stat_inflight_peak = s->inflight;
+        }
+    }
+
+    /* The reader needs the BQL, so it cannot see the response before us. */
+    if (!usb_tcp_remote_send_request(s, p)) {
+        usb_tcp_remote_remove_async_packet(s, a);
+        p->status = USB_RET_STALL;
+        return;
+    }
+
+    p->status = USB_RET_ASYNC;
+}
+
+static void usb_tcp_remote_handle_packet(USBDevice *dev, USBPacket *p)
+{
+    USBTCPRemoteState *s = USB_TCP_REMOTE(dev);
+    USBTCPInflightPacket inflightPacket = { 0 };
+    bool locked = bql_locked();
+
+    if (s->closed) {
+        p->status = USB_RET_STALL;
+        return;
+    }
+
+    if (s->async) {
+        usb_tcp_remote_handle_packet_async(s, p);
+        return;
+    }
+
     inflightPacket.p = p;
     inflightPacket.addr = dev->addr;
     qatomic_set(&inflightPacket.handled, 0);
@@ -751,24 +1193,9 @@ static void usb_tcp_remote_handle_packet(USBDevice *dev, USBPacket *p)
     /* Retire the writes so that the read thread can find it */
     smp_wmb();
 
-    WITH_QEMU_LOCK_GUARD(&s->request_mutex)
-    {
-        if (usb_tcp_remote_write(s, &hdr, sizeof(hdr)) < sizeof(hdr)) {
-            p->status = USB_RET_STALL;
-            goto out;
-        }
-
-        if (usb_tcp_remote_write(s, &pkt, sizeof(pkt)) < sizeof(pkt)) {
-            p->status = USB_RET_STALL;
-            goto out;
-        }
-
-        if (buffer) {
-            if (usb_tcp_remote_write(s, buffer, pkt.length) < pkt.length) {
-                p->status = USB_RET_STALL;
-                goto out;
-            }
-        }
+    if (!usb_tcp_remote_send_request(s, p)) {
+        p->status = USB_RET_STALL;
+        goto out;
     }
 
     if (locked) {
@@ -800,6 +1227,9 @@ static const Property usb_tcp_remote_dev_props[] = {
                                          conn_type, TCP_REMOTE_CONN_TYPE_UNIX),
     DEFINE_PROP_STRING("conn-addr", USBTCPRemoteState, conn_addr),
     DEFINE_PROP_UINT16("conn-port", USBTCPRemoteState, conn_port, 0),
+    DEFINE_PROP_BOOL("async", USBTCPRemoteState, async, false),
+    DEFINE_PROP_UINT32("max-version", USBTCPRemoteState, max_version,
+                       TCP_USB_VERSION_2),
 };
 
 static void usb_tcp_remote_dev_class_init(ObjectClass *klass, const void *data)
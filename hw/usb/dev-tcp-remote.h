@@ -31,6 +31,14 @@ typedef struct USBTCPInflightPacket {
     uint8_t addr;
 } USBTCPInflightPacket;
 
+typedef struct USBTCPAsyncPacket {
+    USBPacket *p;
+    int pid;
+    uint8_t ep;
+    uint64_t id;
+    bool nak;
+} USBTCPAsyncPacket;
+
 typedef struct USBTCPCompletedPacket {
     USBPacket *p;
     QTAILQ_ENTRY(USBTCPCompletedPacket) queue;
@@ -42,12 +50,15 @@ struct USBTCPRemoteState {
 
     QemuThread thread;
     QemuThread read_thread;
+    bool read_thread_started;
     QemuCond cond;
     QemuMutex thr_mutex;
     QemuMutex request_mutex;
 
     QemuMutex queue_mutex;
     QTAILQ_HEAD(, USBTCPInflightPacket) queue;
+    GHashTable *async_packets;
+    QEMUTimer *nak_timer;
 
     QemuMutex completed_queue_mutex;
     QemuCond completed_queue_cond;
@@ -65,6 +76,18 @@ struct USBTCPRemoteState {
     uint8_t addr;
     bool closed;
     bool stopped;
+    bool async;
+    uint32_t max_version;
+    uint32_t version;
+    uint8_t *rx_frame;
+    uint32_t rx_frame_len;
+    uint32_t rx_frame_pos;
+
+    uint64_t stat_bytes_in;
+    uint64_t stat_bytes_out;
+    uint64_t stat_packets;
+    uint64_t stat_inflight_peak;
+    uint32_t inflight;
 };
 
 #define TYPE_USB_TCP_REMOTE "usb-tcp-remote"
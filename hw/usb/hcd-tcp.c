@@ -46,6 +46,26 @@
     } while (0)
 #endif
 
+/*
+ * Responses queued for the next `TCP_USB_FRAME` are flushed early once the
+ * frame grows past these limits.
+ */
+#define TCP_USB_COALESCE_MAX_LENGTH (64 * KiB)
+#define TCP_USB_COALESCE_MAX_IOV (128)
+
+typedef struct QEMU_PACKED USBTCPResponseMessage {
+    tcp_usb_header_t hdr;
+    tcp_usb_response_header_v2 resp;
+} USBTCPResponseMessage;
+
+static void usb_tcp_host_tx_reset(USBTCPHostState *s)
+{
+    g_array_set_size(s->tx_iov, 0);
+    g_ptr_array_remove_range(s->tx_buffers, 0, s->tx_buffers->len);
+    s->tx_count = 0;
+    s->tx_length = 0;
+}
+
 static void usb_tcp_host_closed(USBTCPHostState *s)
 {
     DPRINTF("%s\n", __func__);
@@ -56,6 +76,8 @@ static void usb_tcp_host_closed(USBTCPHostState *s)
         s->ioc = NULL;
     }
     s->closed = true;
+    s->version = TCP_USB_VERSION_1;
+    usb_tcp_host_tx_reset(s);
     migrate_del_blocker(&s->migration_blocker);
 }
 
@@ -89,9 +111,9 @@ static ssize_t tcp_usb_read(QIOChannel *ioc, void *buf, size_t len)
     return (ret <= 0) ? ret : iov.iov_len;
 }
 
-static bool tcp_usb_write(QIOChannel *ioc, void *buf, ssize_t len)
+static bool tcp_usb_writev(QIOChannel *ioc, const struct iovec *iov,
+                           size_t niov)
 {
-    struct iovec iov = { .iov_base = buf, .iov_len = len };
     bool iolock = bql_locked();
     bool iothread = qemu_in_iothread();
     bool ret = false;
@@ -107,7 +129,7 @@ static bool tcp_usb_write(QIOChannel *ioc, void *buf, ssize_t len)
         bql_unlock();
     }
 
-    if (!qio_channel_writev_full_all(ioc, &iov, 1, NULL, 0, 0, &err)) {
+    if (!qio_channel_writev_full_all(ioc, iov, niov, NULL, 0, 0, &err)) {
         ret = true;
     }
 
@@ -121,6 +143,167 @@ static bool tcp_usb_write(QIOChannel *ioc, void *buf, ssize_t len)
     return ret;
 }
 
+static bool tcp_usb_write(QIOChannel *ioc, void *buf, ssize_t len)
+{
+    struct iovec iov = { .iov_base = buf, .iov_len = len };
+
+    return tcp_usb_writev(ioc, &iov, 1);
+}
+
+static ssize_t usb_tcp_host_read(USBTCPHostState *s, void *buf, size_t len)
+{
+    if (s->rx_frame_pos >= s->rx_frame_len) {
+        return tcp_usb_read(s->ioc, buf, len);
+    }
+
+    if (s->rx_frame_len - s->rx_frame_pos < len) {
+        error_report("%s: message crosses the end of its frame", __func__);
+        return -1;
+    }
+
+    memcpy(buf, s->rx_frame + s->rx_frame_pos, len);
+    s->rx_frame_pos += len;
+    return len;
+}
+
+static bool usb_tcp_host_read_frame(USBTCPHostState *s)
+{
+    tcp_usb_frame_header fhdr = { 0 };
+
+    if (s->rx_frame_pos < s->rx_frame_len) {
+        error_report("%s: nested TCP_USB_FRAME", __func__);
+        return false;
+    }
+
+    if (tcp_usb_read(s->ioc, &fhdr, sizeof(fhdr)) != sizeof(fhdr)) {
+        return false;
+    }
+
+    if (fhdr.length > TCP_USB_FRAME_MAX_LENGTH) {
+        error_report("%s: frame too large (0x%x bytes)", __func__,
+                     fhdr.length);
+        return false;
+    }
+
+    s->rx_frame = g_realloc(s->rx_frame, fhdr.length);
+    s->rx_frame_len = 0;
+    s->rx_frame_pos = 0;
+    if (fhdr.length > 0 &&
+        tcp_usb_read(s->ioc, s->rx_frame, fhdr.length) != fhdr.length) {
+        return false;
+    }
+    s->rx_frame_len = fhdr.length;
+
+    return true;
+}
+
+/* Must be called with `write_mutex` held. */
+static bool coroutine_fn usb_tcp_host_tx_flush_locked(USBTCPHostState *s)
+{
+    tcp_usb_header_t hdr = { .type = TCP_USB_FRAME };
+    tcp_usb_frame_header fhdr = { 0 };
+    struct iovec *iov;
+    bool ret;
+
+    if (s->tx_iov->len == 0) {
+        return true;
+    }
+
+    fhdr.length = s->tx_length;
+    fhdr.count = s->tx_count;
+
+    /* The first two slots are reserved for the frame header. */
+    iov = &g_array_index(s->tx_iov, struct iovec, 0);
+    iov[0].iov_base = &hdr;
+    iov[0].iov_len = sizeof(hdr);
+    iov[1].iov_base = &fhdr;
+    iov[1].iov_len = sizeof(fhdr);
+
+    ret = tcp_usb_writev(s->ioc, iov, s->tx_iov->len);
+    usb_tcp_host_tx_reset(s);
+    return ret;
+}
+
+static void coroutine_fn usb_tcp_host_tx_flush_co(void *opaque)
+{
+    USBTCPHostState *s = opaque;
+
+    WITH_QEMU_LOCK_GUARD(&s->write_mutex)
+    {
+        if (!s->closed && !usb_tcp_host_tx_flush_locked(s)) {
+            usb_tcp_host_closed(s);
+        }
+    }
+}
+
+static void usb_tcp_host_tx_bh(void *opaque)
+{
+    USBTCPHostState *s = opaque;
+    Coroutine *co;
+
+    co = qemu_coroutine_create(usb_tcp_host_tx_flush_co, s);
+    qemu_coroutine_enter(co);
+}
+
+/*
+ * Appends a response to the pending frame, taking ownership of `buffer`.
+ * Must be called with `write_mutex` held.
+ */
+static bool coroutine_fn usb_tcp_host_tx_queue_locked(
+    USBTCPHostState *s, const tcp_usb_response_header_v2 *resp, void *buffer)
+{
+    USBTCPResponseMessage *msg;
+    struct iovec iov;
+    /* Payloads too large for a frame follow it unframed */
+    bool unframed = buffer != NULL &&
+                    sizeof(*msg) + resp->length > TCP_USB_FRAME_MAX_LENGTH;
+    size_t frame_bytes = sizeof(*msg) + (unframed ? 0 : resp->length);
+
+    if (s->tx_iov->len != 0 &&
+        s->tx_length + frame_bytes > TCP_USB_FRAME_MAX_LENGTH &&
+        !usb_tcp_host_tx_flush_locked(s)) {
+        g_free(buffer);
+        return false;
+    }
+
+    msg = g_new0(USBTCPResponseMessage, 1);
+    if (s->tx_iov->len == 0) {
+        g_array_set_size(s->tx_iov, 2);
+    }
+
+    msg->hdr.type = TCP_USB_RESPONSE;
+    msg->resp = *resp;
+    g_ptr_array_add(s->tx_buffers, msg);
+    iov.iov_base = msg;
+    iov.iov_len = sizeof(*msg);
+    g_array_append_val(s->tx_iov, iov);
+    s->tx_count += 1;
+    s->tx_length += sizeof(*msg);
+
+    if (unframed) {
+        g_autofree void *payload = buffer;
+
+        return usb_tcp_host_tx_flush_locked(s) &&
+               tcp_usb_write(s->ioc, payload, resp->length);
+    }
+
+    if (buffer != NULL) {
+        g_ptr_array_add(s->tx_buffers, buffer);
+        iov.iov_base = buffer;
+        iov.iov_len = resp->length;
+        g_array_append_val(s->tx_iov, iov);
+        s->tx_length += resp->length;
+    }
+
+    if (!s->coalesce || s->tx_length >= TCP_USB_COALESCE_MAX_LENGTH ||
+        s->tx_iov->len >= TCP_USB_COALESCE_MAX_IOV) {
+        return usb_tcp_host_tx_flush_locked(s);
+    }
+
+    qemu_bh_schedule(s->tx_bh);
+    return true;
+}
+
 static USBPort *usb_tcp_host_find_active_port(USBTCPHostState *s)
 {
     for (int i = 0; i < G_N_ELEMENTS(s->ports) - 1; i++) {
@@ -137,9 +320,12 @@ static void coroutine_fn usb_tcp_host_respond_packet_co(void *opaque)
     USBTCPHostState *s = pkt->s;
     USBPacket *p = &pkt->p;
     tcp_usb_header_t hdr = { 0 };
-    tcp_usb_response_header resp = { 0 };
+    tcp_usb_response_header_v2 resp = { 0 };
+    tcp_usb_response_header resp_v1 = { 0 };
     g_autofree void *buffer = NULL;
     USBPort *port = usb_tcp_host_find_active_port(s);
+    struct iovec iov[3];
+    size_t niov = 0;
 
     WITH_QEMU_LOCK_GUARD(&s->write_mutex)
     {
@@ -156,23 +342,39 @@ static void coroutine_fn usb_tcp_host_respond_packet_co(void *opaque)
                 resp.length = p->actual_length;
             }
 
+            if (s->version < TCP_USB_VERSION_2) {
+                resp.length = MIN(resp.length, UINT16_MAX);
+            }
+
             if (p->pid == USB_TOKEN_IN && p->status != USB_RET_ASYNC) {
                 buffer = g_malloc(resp.length);
                 iov_to_buf(p->iov.iov, p->iov.niov, 0, buffer, resp.length);
             }
 
-            if (!tcp_usb_write(s->ioc, &hdr, sizeof(hdr))) {
-                usb_tcp_host_closed(s);
-                return;
-            }
-
-            if (!tcp_usb_write(s->ioc, &resp, sizeof(resp))) {
-                usb_tcp_host_closed(s);
-                return;
-            }
+            if (s->version >= TCP_USB_VERSION_2) {
+                if (!usb_tcp_host_tx_queue_locked(s, &resp,
+                                                  g_steal_pointer(&buffer))) {
+                    usb_tcp_host_closed(s);
+                    return;
+                }
+            } else {
+                resp_v1.addr = resp.addr;
+                resp_v1.pid = resp.pid;
+                resp_v1.ep = resp.ep;
+                resp_v1.id = resp.id;
+                resp_v1.status = resp.status;
+                resp_v1.length = resp.length;
+
+                iov[niov].iov_base = &hdr;
+                iov[niov++].iov_len = sizeof(hdr);
+                iov[niov].iov_base = &resp_v1;
+                iov[niov++].iov_len = sizeof(resp_v1);
+                if (buffer) {
+                    iov[niov].iov_base = buffer;
+                    iov[niov++].iov_len = resp_v1.length;
+                }
 
-            if (buffer) {
-                if (!tcp_usb_write(s->ioc, buffer, resp.length)) {
+                if (!tcp_usb_writev(s->ioc, iov, niov)) {
                     usb_tcp_host_closed(s);
                     return;
                 }
@@ -196,34 +398,102 @@ static void usb_tcp_host_respond_packet(USBTCPHostState *s, USBTCPPacket *pkt)
     qemu_coroutine_enter(co);
 }
 
-static void coroutine_fn usb_tcp_host_msg_loop_co(void *opaque)
+static void coroutine_fn usb_tcp_host_msg_loop(USBTCPHostState *s)
 {
-    USBTCPHostState *s;
     USBPort *port;
     QIOChannel *ioc;
     tcp_usb_header_t hdr;
 
-    s = opaque;
     port = usb_tcp_host_find_active_port(s);
     ioc = s->ioc;
 
+    if (s->max_version >= TCP_USB_VERSION_2) {
+        tcp_usb_hello_header hello = {
+            .magic = TCP_USB_HELLO_MAGIC,
+            .version = s->max_version,
+        };
+        struct iovec iov[2] = {
+            { .iov_base = &hdr, .iov_len = sizeof(hdr) },
+            { .iov_base = &hello, .iov_len = sizeof(hello) },
+        };
+
+        hdr.type = TCP_USB_HELLO;
+        WITH_QEMU_LOCK_GUARD(&s->write_mutex)
+        {
+            if (!tcp_usb_writev(ioc, iov, ARRAY_SIZE(iov))) {
+                usb_tcp_host_closed(s);
+                return;
+            }
+        }
+    }
+
     for (;;) {
-        if (unlikely((tcp_usb_read(ioc, &hdr, sizeof(hdr)) != sizeof(hdr)))) {
+        if (unlikely(
+                (usb_tcp_host_read(s, &hdr, sizeof(hdr)) != sizeof(hdr)))) {
             usb_tcp_host_closed(s);
             return;
         }
 
         switch (hdr.type) {
+        case TCP_USB_FRAME:
+            if (!usb_tcp_host_read_frame(s)) {
+                usb_tcp_host_closed(s);
+                return;
+            }
+            break;
+        case TCP_USB_HELLO: {
+            tcp_usb_hello_header hello = { 0 };
+
+            if (unlikely(usb_tcp_host_read(s, &hello, sizeof(hello)) !=
+                         sizeof(hello))) {
+                usb_tcp_host_closed(s);
+                return;
+            }
+
+            if (hello.magic != TCP_USB_HELLO_MAGIC ||
+                hello.version < TCP_USB_VERSION_1 ||
+                hello.version > s->max_version) {
+                error_report("%s: invalid TCP_USB_HELLO", __func__);
+                usb_tcp_host_closed(s);
+                return;
+            }
+
+            WITH_QEMU_LOCK_GUARD(&s->write_mutex)
+            {
+                s->version = hello.version;
+            }
+            DPRINTF("%s: using protocol version %u\n", __func__, s->version);
+            break;
+        }
         case TCP_USB_REQUEST: {
-            tcp_usb_request_header pkt_hdr;
+            tcp_usb_request_header_v2 pkt_hdr = { 0 };
             g_autofree void *buffer = NULL;
             g_autofree USBTCPPacket *pkt = g_new0(USBTCPPacket, 1);
             USBEndpoint *ep = NULL;
 
-            if (unlikely(tcp_usb_read(ioc, &pkt_hdr, sizeof(pkt_hdr)) !=
-                         sizeof(pkt_hdr))) {
-                usb_tcp_host_closed(s);
-                return;
+            if (s->rx_frame_pos < s->rx_frame_len) {
+                if (unlikely(usb_tcp_host_read(s, &pkt_hdr, sizeof(pkt_hdr)) !=
+                             sizeof(pkt_hdr))) {
+                    usb_tcp_host_closed(s);
+                    return;
+                }
+            } else {
+                tcp_usb_request_header pkt_hdr_v1;
+
+                if (unlikely(usb_tcp_host_read(s, &pkt_hdr_v1,
+                                               sizeof(pkt_hdr_v1)) !=
+                             sizeof(pkt_hdr_v1))) {
+                    usb_tcp_host_closed(s);
+                    return;
+                }
+                pkt_hdr.addr = pkt_hdr_v1.addr;
+                pkt_hdr.pid = pkt_hdr_v1.pid;
+                pkt_hdr.ep = pkt_hdr_v1.ep;
+                pkt_hdr.id = pkt_hdr_v1.id;
+                pkt_hdr.stream = pkt_hdr_v1.stream;
+                pkt_hdr.short_not_ok = pkt_hdr_v1.short_not_ok;
+                pkt_hdr.int_req = pkt_hdr_v1.int_req;
+                pkt_hdr.length = pkt_hdr_v1.length;
             }
 
             DPRINTF("%s: TCP_USB_REQUEST pid: 0x%x ep: %d id: 0x%" PRIx64 "\n",
@@ -243,7 +513,7 @@ static void coroutine_fn usb_tcp_host_msg_loop_co(void *opaque)
                 buffer = g_malloc0(pkt_hdr.length);
 
                 if (pkt_hdr.pid != USB_TOKEN_IN) {
-                    if (unlikely(tcp_usb_read(s->ioc, buffer, pkt_hdr.length) !=
+                    if (unlikely(usb_tcp_host_read(s, buffer, pkt_hdr.length) !=
                                  pkt_hdr.length)) {
                         usb_tcp_host_closed(s);
                         usb_packet_cleanup(&pkt->p);
@@ -275,7 +545,7 @@ static void coroutine_fn usb_tcp_host_msg_loop_co(void *opaque)
             USBTCPPacket *pkt = NULL;
             USBPacket *p = NULL;
 
-            if (unlikely(tcp_usb_read(ioc, &pkt_hdr, sizeof(pkt_hdr)) !=
+            if (unlikely(usb_tcp_host_read(s, &pkt_hdr, sizeof(pkt_hdr)) !=
                          sizeof(pkt_hdr))) {
                 usb_tcp_host_closed(s);
                 return;
@@ -317,6 +587,21 @@ static void coroutine_fn usb_tcp_host_msg_loop_co(void *opaque)
     return;
 }
 
+static void coroutine_fn usb_tcp_host_msg_loop_co(void *opaque)
+{
+    USBTCPHostState *s = opaque;
+
+    usb_tcp_host_msg_loop(s);
+
+    /*
+     * The frame buffer belongs to the loop; the connection may have been
+     * closed elsewhere while it was waiting for the rest of a frame.
+     */
+    g_clear_pointer(&s->rx_frame, g_free);
+    s->rx_frame_len = 0;
+    s->rx_frame_pos = 0;
+}
+
 #ifdef WIN32
 static int usb_tcp_host_connect_unix(USBTCPHostState *s, Error **errp)
 {
@@ -548,6 +833,13 @@ static void usb_tcp_host_realize(DeviceState *dev, Error **errp)
 
     s = USB_TCP_HOST(dev);
 
+    if (s->max_version < TCP_USB_VERSION_1 ||
+        s->max_version > TCP_USB_VERSION_2) {
+        error_setg(errp, "max-version must be between %d and %d",
+                   TCP_USB_VERSION_1, TCP_USB_VERSION_2);
+        return;
+    }
+
     usb_bus_new(&s->bus, sizeof(s->bus), &usb_tcp_bus_ops, dev);
     for (i = 0; i < G_N_ELEMENTS(s->ports); i++) {
         usb_register_port(&s->bus, &s->ports[i], s, i, &usb_tcp_host_port_ops,
@@ -556,7 +848,11 @@ static void usb_tcp_host_realize(DeviceState *dev, Error **errp)
     }
 
     s->closed = true;
+    s->version = TCP_USB_VERSION_1;
     qemu_co_mutex_init(&s->write_mutex);
+    s->tx_iov = g_array_new(false, true, sizeof(struct iovec));
+    s->tx_buffers = g_ptr_array_new_with_free_func(g_free);
+    s->tx_bh = qemu_bh_new(usb_tcp_host_tx_bh, s);
 }
 
 static void usb_tcp_host_unrealize(DeviceState *dev)
@@ -571,6 +867,11 @@ static void usb_tcp_host_unrealize(DeviceState *dev)
 
     s->closed = true;
     s->stopped = true;
+
+    qemu_bh_delete(s->tx_bh);
+    g_array_free(s->tx_iov, true);
+    g_ptr_array_free(s->tx_buffers, true);
+    g_free(s->rx_frame);
 }
 
 static void usb_tcp_host_init(Object *obj)
@@ -587,6 +888,9 @@ static const Property usb_tcp_host_props[] = {
                                          conn_type, TCP_REMOTE_CONN_TYPE_UNIX),
     DEFINE_PROP_STRING("conn-addr", USBTCPHostState, conn_addr),
     DEFINE_PROP_UINT16("conn-port", USBTCPHostState, conn_port, 0),
+    DEFINE_PROP_UINT32("max-version", USBTCPHostState, max_version,
+                       TCP_USB_VERSION_1),
+    DEFINE_PROP_BOOL("coalesce", USBTCPHostState, coalesce, true),
 };
 
 static void usb_tcp_host_class_init(ObjectClass *klass, const void *data)
@@ -22,6 +22,7 @@
 
 #include "qemu/osdep.h"
 #include "qapi/util.h"
+#include "qemu/units.h"
 
 #define USB_TCP_REMOTE_UNIX_DEFAULT ("/tmp/InfernoUSBRemote")
 
@@ -39,11 +40,29 @@ extern const PropertyInfo qdev_usb_tcp_remote_conn_type;
     DEFINE_PROP_UNSIGNED(_name, _state, _fld, _default,                     \
                          qdev_usb_tcp_remote_conn_type, USBTCPRemoteConnType)
 
+/*
+ * Protocol versions:
+ *  1: every message is a type byte, a header with a 16-bit length and the
+ *     payload.
+ *  2: adds `TCP_USB_FRAME`, a container carrying one or more requests or
+ *     responses with 32-bit lengths. A peer may only send frames once the
+ *     other side has agreed to version 2 through `TCP_USB_HELLO`.
+ *     A payload that would take its frame past `TCP_USB_FRAME_MAX_LENGTH`
+ *     is sent right after the frame instead, whose last message is then
+ *     the header it belongs to.
+ */
+#define TCP_USB_VERSION_1 (1)
+#define TCP_USB_VERSION_2 (2)
+#define TCP_USB_HELLO_MAGIC (0x55534254) // 'USBT'
+#define TCP_USB_FRAME_MAX_LENGTH (16 * MiB)
+
 enum {
     TCP_USB_REQUEST = 1,
     TCP_USB_RESPONSE,
     TCP_USB_RESET,
-    TCP_USB_CANCEL
+    TCP_USB_CANCEL,
+    TCP_USB_HELLO,
+    TCP_USB_FRAME,
 };
 
 typedef struct QEMU_PACKED tcp_usb_header {
@@ -77,4 +96,35 @@ typedef struct QEMU_PACKED tcp_usb_cancel_header {
     uint64_t id;
 } tcp_usb_cancel_header;
 
+typedef struct QEMU_PACKED tcp_usb_hello_header {
+    uint32_t magic;
+    uint32_t version;
+} tcp_usb_hello_header;
+
+typedef struct QEMU_PACKED tcp_usb_frame_header {
+    uint32_t length;
+    uint32_t count;
+} tcp_usb_frame_header;
+
+/* Version 2 headers, only valid inside a `TCP_USB_FRAME`. */
+typedef struct QEMU_PACKED tcp_usb_request_header_v2 {
+    uint8_t addr;
+    int pid;
+    uint8_t ep;
+    uint64_t id;
+    unsigned int stream;
+    uint8_t short_not_ok;
+    uint8_t int_req;
+    uint32_t length;
+} tcp_usb_request_header_v2;
+
+typedef struct QEMU_PACKED tcp_usb_response_header_v2 {
+    uint8_t addr;
+    int pid;
+    uint8_t ep;
+    uint64_t id;
+    uint32_t status;
+    uint32_t length;
+} tcp_usb_response_header_v2;
+
 #endif /* HW_USB_TCP_USB_H */
@@ -41,6 +41,7 @@ OBJECT_DECLARE_SIMPLE_TYPE(AppleA13Cluster, APPLE_A13_CLUSTER)
 #define A13_CPREG_VAR_DEF(name) uint64_t A13_CPREG_VAR_NAME(name)
 
 #define kDeferredIPITimerDefault 64000
+#define A13_PMC_COUNT 2
 
 typedef struct AppleA13Class {
     /*< private >*/
@@ -64,6 +65,15 @@ typedef struct AppleA13State {
     uint32_t cluster_id;
     uint64_t ipi_sr;
     qemu_irq fast_ipi;
+    qemu_irq pmi;
+    QEMUTimer *pmi_timer;
+    /* Counter sources at the last PMU sync, not migrated */
+    uint64_t pmc_last[A13_PMC_COUNT];
+    /* SPRR_PERM_EL0 writes that did or did not flush the EL0 TLB */
+    uint64_t sprr_tlb_flushes;
+    uint64_t sprr_tlb_flushes_skipped;
+    /* Whether AMX instructions are emulated instead of UNDEF */
+    bool amx;
     A13_CPREG_VAR_DEF(ARM64_REG_EHID3);
     A13_CPREG_VAR_DEF(ARM64_REG_EHID4);
     A13_CPREG_VAR_DEF(ARM64_REG_EHID10);
@@ -94,8 +104,6 @@ typedef struct AppleA13State {
     A13_CPREG_VAR_DEF(PMCR1);
     A13_CPREG_VAR_DEF(PMSR);
     A13_CPREG_VAR_DEF(S3_4_c15_c0_5);
-    A13_CPREG_VAR_DEF(AMX_STATUS_EL1);
-    A13_CPREG_VAR_DEF(AMX_CTL_EL1);
     A13_CPREG_VAR_DEF(ARM64_REG_CPU_OVRD);
     A13_CPREG_VAR_DEF(ARM64_REG_ACC_OVRD);
     A13_CPREG_VAR_DEF(ARM64_REG_ACC_CFG);
@@ -112,8 +120,11 @@ typedef struct AppleA13Cluster {
     uint32_t cluster_type;
     MemoryRegion mr;
     AppleA13State *cpus[A13_MAX_CPU];
+    AppleA13State *cpus_by_phys[256];
     uint32_t deferredIPI[A13_MAX_CPU];
     uint32_t noWakeIPI[A13_MAX_CPU];
+    /* Union of noWakeIPI, not migrated */
+    uint32_t noWakeTargets;
     uint64_t ipi_cr;
     QTAILQ_ENTRY(AppleA13Cluster) next;
     A13_CPREG_VAR_DEF(CTRR_A_LWR_EL1);
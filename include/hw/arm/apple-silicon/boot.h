@@ -353,6 +353,16 @@ typedef struct {
 MachoHeader64 *apple_boot_load_kernel(const char *filename,
                                       MachoHeader64 **secure_monitor);
 
+/*
+ * On-disk cache of patched kernelcaches. The key covers the contents of the
+ * kernelcache file and the patch set applied to it.
+ */
+char *apple_boot_kernel_cache_key(const char *filename, const char *patch_set);
+MachoHeader64 *apple_boot_load_cached_kernel(const char *cache_dir,
+                                             const char *key);
+void apple_boot_store_cached_kernel(const char *cache_dir, const char *key,
+                                    MachoHeader64 *header);
+
 MachoHeader64 *apple_boot_parse_macho(uint8_t *data, uint32_t len);
 
 uint8_t *apple_boot_get_macho_buffer(MachoHeader64 *header);
@@ -417,7 +427,11 @@ void apple_boot_finalise_dt(AppleDTNode *root, AddressSpace *as,
 
 uint8_t *apple_boot_load_trustcache_file(const char *filename, uint64_t *size);
 
+/*
+ * Raw ramdisks are mapped copy-on-write over guest memory when possible,
+ * `mr` tracks that mapping between calls and must start out as NULL.
+ */
 void apple_boot_load_ramdisk(const char *filename, AddressSpace *as, hwaddr pa,
-                             uint64_t *size);
+                             uint64_t *size, MemoryRegion **mr);
 
 #endif /* HW_ARM_APPLE_SILICON_BOOT_H */
@@ -26,14 +26,27 @@
 typedef struct {
     uint32_t len;
     bool placeholder;
+    /// The property was allocated from a deserialised device tree's arena.
+    bool arena;
+    /// `data` points into a deserialised device tree's arena.
+    bool arena_data;
     void *data;
 } AppleDTProp;
 
-typedef struct {
+typedef struct AppleDTNode AppleDTNode;
+
+struct AppleDTNode {
     GHashTable *props;
     GList *children;
+    /// Children by name. With duplicate names, the first child wins.
+    GHashTable *child_index;
+    /// Some child has a name which is not a C string, so it is not indexed.
+    bool child_index_partial;
+    AppleDTNode *parent;
     bool finalised;
-} AppleDTNode;
+    /// The node was allocated from a deserialised device tree's arena.
+    bool arena;
+};
 
 AppleDTNode *apple_dt_node_new(AppleDTNode *parent, const char *name);
 AppleDTNode *apple_dt_deserialise(void *blob);
@@ -22,6 +22,10 @@
 
 #include "hw/arm/apple-silicon/boot.h"
 
-void ck_patch_kernel(MachoHeader64 *hdr);
+/* Bump whenever the patches change, it invalidates cached kernelcaches. */
+#define CK_PATCH_SET_VERSION "1"
+
+/* With `amx` set, the kernel keeps advertising AMX to userspace. */
+void ck_patch_kernel(MachoHeader64 *hdr, bool amx);
 
 #endif /* HW_ARM_APPLE_SILICON_KERNEL_PATCHES_H */
@@ -25,6 +25,8 @@
 
 #define MOV_W0_0_BYTES 0x00, 0x00, 0x80, 0x52
 
+typedef struct CKPatcherBatch CKPatcherBatch;
+
 typedef struct {
     /// Physical or virtual address.
     vaddr addr;
@@ -32,6 +34,8 @@ typedef struct {
     /// Guaranteed to be an accessible host pointer.
     void *ptr;
     const char *name;
+    /// Non-null while patterns are being batched, see `ck_patcher_batch_begin`.
+    CKPatcherBatch *batch;
 } CKPatcherRange;
 
 CKPatcherRange *ck_patcher_range_from_ptr(const char *name, void *ptr,
@@ -70,4 +74,18 @@ bool ck_patcher_find_replace(CKPatcherRange *range, const char *name,
                              const uint8_t *replacement_mask,
                              size_t replace_off, size_t replace_len);
 
+/// Batched lookups, so that many patterns only scan `range` once.
+/// After `ck_patcher_batch_begin`, lookups in `range` only record their
+/// pattern and fail without calling back. `ck_patcher_batch_scan` then finds
+/// every recorded pattern in a single pass, and lookups repeated afterwards
+/// only visit the matches found by it, in the same order as a plain lookup.
+/// Matches are checked again before calling back, so earlier patches are
+/// taken into account, but a match only created by an earlier patch is
+/// missed.
+void ck_patcher_batch_begin(CKPatcherRange *range);
+/// See `ck_patcher_batch_begin`.
+void ck_patcher_batch_scan(CKPatcherRange *range);
+/// See `ck_patcher_batch_begin`.
+void ck_patcher_batch_end(CKPatcherRange *range);
+
 #endif /* HW_ARM_APPLE_SILICON_PATCHER_H */
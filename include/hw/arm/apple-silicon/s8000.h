@@ -54,6 +54,7 @@ typedef struct {
     MachoHeader64 *kernel;
     MachoHeader64 *secure_monitor;
     uint8_t *trustcache;
+    MemoryRegion *ramdisk_mr;
     char *securerom;
     gsize securerom_size;
     AppleDTNode *device_tree;
@@ -51,6 +51,7 @@ typedef struct {
     MachoHeader64 *kernel;
     AppleDTNode *device_tree;
     uint8_t *trustcache;
+    MemoryRegion *ramdisk_mr;
     char *securerom;
     gsize securerom_size;
     AppleBootInfo boot_info;
@@ -60,6 +61,7 @@ typedef struct {
     char *sep_rom_filename;
     char *sep_fw_filename;
     char *securerom_filename;
+    char *kc_cache_dir;
     uint32_t sio_protocol;
     uint32_t build_version;
     uint64_t ecid;
@@ -71,6 +73,7 @@ typedef struct {
     uint8_t amcc_reg[0x100000];
     bool kaslr_off;
     bool force_dfu;
+    bool amx;
     uint32_t board_id;
     uint32_t chip_revision;
     USBTCPRemoteConnType usb_conn_type;
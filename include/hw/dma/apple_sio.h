@@ -5,12 +5,22 @@
 #include "hw/arm/apple-silicon/dt.h"
 #include "hw/misc/apple-silicon/a7iop/base.h"
 #include "hw/sysbus.h"
+#include "qemu/iov.h"
 
 #define TYPE_APPLE_SIO "apple-sio"
 OBJECT_DECLARE_TYPE(AppleSIOState, AppleSIOClass, APPLE_SIO)
 
 typedef struct AppleSIODMAEndpoint AppleSIODMAEndpoint;
 
+/*
+ * Called with the mapped guest memory of the endpoint's current request,
+ * starting at its first untransferred byte. Returns how many bytes were
+ * consumed or produced; returning less than `qiov->size` ends the transfer.
+ */
+typedef uint64_t AppleSIODMAIOVFunc(void *opaque, QEMUIOVector *qiov);
+
+uint64_t apple_sio_dma_xfer_iov(AppleSIODMAEndpoint *ep, uint64_t len,
+                                AppleSIODMAIOVFunc *func, void *opaque);
 uint64_t apple_sio_dma_read(AppleSIODMAEndpoint *ep, void *buffer,
                             uint64_t len);
 uint64_t apple_sio_dma_write(AppleSIODMAEndpoint *ep, void *buffer,
@@ -38,6 +38,7 @@ typedef struct {
     uint32_t pendingIPI;
     uint32_t deferredIPI;
     uint32_t ipi_mask;
+    int64_t ipi_raised_ns;
 } AppleAICCPU;
 
 struct AppleAICState {
@@ -55,6 +56,8 @@ struct AppleAICState {
     uint32_t *eir_dest;
     AppleAICCPU *cpus;
     uint32_t *eir_state;
+    int64_t *eir_raised_ns;
+    bool legacy_poll;
 };
 
 
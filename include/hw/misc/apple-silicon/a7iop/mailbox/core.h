@@ -26,6 +26,7 @@
 #include "hw/misc/apple-silicon/a7iop/base.h"
 #include "hw/sysbus.h"
 #include "migration/vmstate.h"
+#include "qemu/bitmap.h"
 #include "qemu/queue.h"
 
 #define TYPE_APPLE_A7IOP_MAILBOX "apple-a7iop-mailbox"
@@ -87,6 +88,24 @@ typedef struct AppleA7IOPInterruptStatusMessage {
     QTAILQ_ENTRY(AppleA7IOPInterruptStatusMessage) entry;
 } AppleA7IOPInterruptStatusMessage;
 
+/// Must be a power of two.
+#define APPLE_A7IOP_MAILBOX_RING_SIZE (256)
+
+/*
+ * Single producer/single consumer message ring. `head` is only advanced by
+ * the receiving side and `tail` only by the sending side, both free-running.
+ */
+typedef struct AppleA7IOPMessageRing {
+    AppleA7IOPMessage msgs[APPLE_A7IOP_MAILBOX_RING_SIZE];
+    uint32_t head;
+    uint32_t tail;
+} AppleA7IOPMessageRing;
+
+// Interrupt status values are 0xGIIII; bits 16-18 group, bits 0-9 index.
+#define APPLE_A7IOP_INT_STATUS_GROUPS (8)
+#define APPLE_A7IOP_INT_STATUS_INDICES (0x400)
+#define APPLE_A7IOP_INT_STATUS_BITS \
+    (APPLE_A7IOP_INT_STATUS_GROUPS * APPLE_A7IOP_INT_STATUS_INDICES)
 
 struct AppleA7IOPMailbox {
     /*< private >*/
@@ -96,9 +115,17 @@ struct AppleA7IOPMailbox {
     QemuMutex lock;
     MemoryRegion mmio;
     QEMUBH *handle_messages_bh;
+    AppleA7IOPMessageRing inbox_ring;
+    DECLARE_BITMAP(interrupt_status_set, APPLE_A7IOP_INT_STATUS_BITS);
+    // Only populated while migrating, to keep the stream format.
     QTAILQ_HEAD(, AppleA7IOPMessage) inbox;
     QTAILQ_HEAD(, AppleA7IOPInterruptStatusMessage) interrupt_status;
     uint32_t count;
+    uint64_t sent;
+    uint64_t received;
+    uint64_t rate_window_start;
+    uint64_t rate_window_sent;
+    uint64_t messages_per_sec;
     AppleA7IOPMailbox *iop_mailbox;
     AppleA7IOPMailbox *ap_mailbox;
     qemu_irq irqs[APPLE_A7IOP_IRQ_MAX];
@@ -127,13 +154,15 @@ struct AppleA7IOPMailbox {
 void apple_a7iop_mailbox_update_irq_status(AppleA7IOPMailbox *s);
 void apple_a7iop_mailbox_update_irq(AppleA7IOPMailbox *s);
 bool apple_a7iop_mailbox_is_empty(AppleA7IOPMailbox *s);
-void apple_a7iop_mailbox_send_ap(AppleA7IOPMailbox *s, AppleA7IOPMessage *msg);
-void apple_a7iop_mailbox_send_iop(AppleA7IOPMailbox *s, AppleA7IOPMessage *msg);
+void apple_a7iop_mailbox_send_ap(AppleA7IOPMailbox *s,
+                                 const AppleA7IOPMessage *msg);
+void apple_a7iop_mailbox_send_iop(AppleA7IOPMailbox *s,
+                                  const AppleA7IOPMessage *msg);
 uint32_t apple_a7iop_mailbox_read_interrupt_status(AppleA7IOPMailbox *s);
 AppleA7IOPMessage *apple_a7iop_inbox_peek(AppleA7IOPMailbox *s);
 void apple_a7iop_interrupt_status_push(AppleA7IOPMailbox *s, uint32_t status);
-AppleA7IOPMessage *apple_a7iop_mailbox_recv_iop(AppleA7IOPMailbox *s);
-AppleA7IOPMessage *apple_a7iop_mailbox_recv_ap(AppleA7IOPMailbox *s);
+bool apple_a7iop_mailbox_recv_iop(AppleA7IOPMailbox *s, AppleA7IOPMessage *msg);
+bool apple_a7iop_mailbox_recv_ap(AppleA7IOPMailbox *s, AppleA7IOPMessage *msg);
 AppleA7IOPMailbox *apple_a7iop_mailbox_new(const char *role,
                                            AppleA7IOPVersion version,
                                            AppleA7IOPMailbox *iop_mailbox,
@@ -191,7 +191,10 @@ struct SMCKey {
     void *opaque;
     SMCKeyFunc *read;
     SMCKeyFunc *write;
-    QTAILQ_ENTRY(SMCKey) next;
+    SMCKeyData *data;
+    /// Guest accesses, exposed through the `key-stats` property.
+    uint64_t reads;
+    uint64_t writes;
 };
 
 struct SMCKeyData {
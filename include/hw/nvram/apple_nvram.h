@@ -56,7 +56,13 @@ typedef struct AppleNvramState {
 
     NvramBank *bank;
     QTAILQ_HEAD(, env_var) env;
+    /* Variables by name */
+    GHashTable *env_index;
     uint32_t len;
+
+    /* Bank image as it is in the backing store */
+    uint8_t *disk;
+    size_t disk_len;
 } AppleNvramState;
 
 struct AppleNvramClass {
@@ -56,6 +56,14 @@ struct SSIPeripheralClass {
      * See ssi_transfer().
      */
     uint32_t (*transfer_raw)(SSIPeripheral *dev, uint32_t val);
+
+    /* optional; clock @len bytes through a selected device in one call.
+     * @tx may be NULL to shift out 0xff, @rx may be NULL to discard the
+     * received bytes. Only used with the default transfer_raw.
+     * See ssi_transfer_bulk().
+     */
+    void (*transfer_bulk)(SSIPeripheral *dev, const uint8_t *tx, uint8_t *rx,
+                          size_t len);
 };
 
 struct SSIPeripheral {
@@ -126,6 +134,20 @@ SSIBus *ssi_create_bus(DeviceState *parent, const char *name);
  */
 uint32_t ssi_transfer(SSIBus *bus, uint32_t val);
 
+/**
+ * ssi_transfer_bulk:
+ * @bus: SSI bus
+ * @tx: bytes to write, or NULL to write 0xff
+ * @rx: buffer for the bytes read, or NULL
+ * @len: number of bytes
+ *
+ * Transfer @len 8-bit words. If the only selected peripheral implements
+ * transfer_bulk, it is handed the whole buffer at once; otherwise this
+ * falls back to one ssi_transfer() per byte.
+ */
+void ssi_transfer_bulk(SSIBus *bus, const uint8_t *tx, uint8_t *rx,
+                       size_t len);
+
 DeviceState *ssi_get_cs(SSIBus *bus, uint8_t cs_index);
 
 #endif
@@ -52,6 +52,17 @@ struct USBTCPHostState {
     USBTCPRemoteConnType conn_type;
     char *conn_addr;
     uint16_t conn_port;
+    uint32_t max_version;
+    uint32_t version;
+    bool coalesce;
+    uint8_t *rx_frame;
+    uint32_t rx_frame_len;
+    uint32_t rx_frame_pos;
+    GArray *tx_iov;
+    GPtrArray *tx_buffers;
+    uint32_t tx_count;
+    uint32_t tx_length;
+    QEMUBH *tx_bh;
 };
 
 #endif /* HW_USB_HCD_TCP_H */
@@ -636,8 +636,20 @@ typedef struct CPUArchState {
         uint64_t sprr_el_br_el1[4][2];
         uint64_t sprr_config_el[4];
         uint64_t mprr_el_br_el1[4][2];
+        /* SPRR indices whose EL0 permissions may be cached in the TLB */
+        uint32_t el0_tlb_idx;
     } sprr;
 
+    /* Apple AMX register file; X and Y are 8 x 64 bytes, Z is 64 x 64 */
+    struct {
+        uint8_t x[8][64] QEMU_ALIGNED(16);
+        uint8_t y[8][64] QEMU_ALIGNED(16);
+        uint8_t z[64][64] QEMU_ALIGNED(16);
+        bool active;
+        /* AMX_CTL_EL1 */
+        uint64_t ctl;
+    } amx;
+
     struct {
         /* M profile has up to 4 stack pointers:
          * a Main Stack Pointer and a Process Stack Pointer for each
@@ -2553,6 +2565,7 @@ enum arm_features {
      */
     ARM_FEATURE_BACKCOMPAT_CNTFRQ, /* 62.5MHz timer default */
     ARM_FEATURE_GXF, /* has Apple's GXF support */
+    ARM_FEATURE_AMX, /* has Apple's AMX coprocessor */
 };
 
 static inline int arm_feature(CPUARMState *env, int feature)
@@ -340,6 +340,28 @@ static const VMStateDescription vmstate_zt0 = {
     }
 };
 
+static bool amx_needed(void *opaque)
+{
+    ARMCPU *cpu = opaque;
+
+    /* AMX registers are undefined until the next AMX set */
+    return cpu->env.amx.active;
+}
+
+static const VMStateDescription vmstate_amx = {
+    .name = "cpu/amx",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .needed = amx_needed,
+    .fields = (const VMStateField[]) {
+        VMSTATE_BOOL(env.amx.active, ARMCPU),
+        VMSTATE_UINT8_2DARRAY(env.amx.x, ARMCPU, 8, 64),
+        VMSTATE_UINT8_2DARRAY(env.amx.y, ARMCPU, 8, 64),
+        VMSTATE_UINT8_2DARRAY(env.amx.z, ARMCPU, 64, 64),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
 static bool serror_needed(void *opaque)
 {
     ARMCPU *cpu = opaque;
@@ -1116,6 +1138,7 @@ const VMStateDescription vmstate_arm_cpu = {
         &vmstate_sve,
         &vmstate_za,
         &vmstate_zt0,
+        &vmstate_amx,
         &vmstate_serror,
         &vmstate_irq_line_state,
         &vmstate_wfxt_timer,
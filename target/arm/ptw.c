@@ -1008,13 +1008,15 @@ static int simple_ap_to_rw_prot(CPUARMState *env, ARMMMUIdx mmu_idx, int ap)
  * R/W/X protection flags.
  *
  * @env:     CPUARMState
+ * @mmu_idx: MMU index the result is filled into
  * @ap:      The 2-bit simple AP (AP[2:1])
  * @xn:      XN (execute-never) bits
  * @pxn:     PXN (privileged-execute-never) bits
  * @guarded: TRUE if accessing from GXF
  */
 static inline int
-pte_to_sprr_prot_is_guarded(CPUARMState *env, int ap, int xn, int pxn, bool guarded)
+pte_to_sprr_prot_is_guarded(CPUARMState *env, ARMMMUIdx mmu_idx, int ap,
+                            int xn, int pxn, bool guarded)
 {
     int el;
     int sprr_idx;
@@ -1031,6 +1033,13 @@ pte_to_sprr_prot_is_guarded(CPUARMState *env, int ap, int xn, int pxn, bool guar
 
     sprr_idx = ((ap << 2) | (xn << 1) | pxn) & 0xf;
     sprr_perm = env->sprr.sprr_el_br_el1[el][el];
+    /*
+     * Track every fill of the EL0 regime, including LDTR/STTR from EL1,
+     * so SPRR_PERM_EL0 writes know which cached indices to evict.
+     */
+    if (regime_is_user(env, mmu_idx)) {
+        env->sprr.el0_tlb_idx |= BIT(sprr_idx);
+    }
 
     attr = SPRR_EXTRACT_IDX_ATTR(sprr_perm, sprr_idx);
     prot = 0;
@@ -1086,14 +1095,16 @@ pte_to_sprr_prot_is_guarded(CPUARMState *env, int ap, int xn, int pxn, bool guar
  * R/W/X protection flags.
  *
  * @env:     CPUARMState
+ * @mmu_idx: MMU index the result is filled into
  * @ap:      The 2-bit simple AP (AP[2:1])
  * @xn:      XN (execute-never) bits
  * @pxn:     PXN (privileged-execute-never) bits
  */
 static inline int
-pte_to_sprr_prot(CPUARMState *env, int ap, int xn, int pxn)
+pte_to_sprr_prot(CPUARMState *env, ARMMMUIdx mmu_idx, int ap, int xn, int pxn)
 {
-    return pte_to_sprr_prot_is_guarded(env, ap, xn, pxn, arm_is_guarded(env));
+    return pte_to_sprr_prot_is_guarded(env, mmu_idx, ap, xn, pxn,
+                                       arm_is_guarded(env));
 }
 
 static bool get_phys_addr_v5(CPUARMState *env, S1Translate *ptw,
@@ -1358,8 +1369,10 @@ static bool get_phys_addr_v6(CPUARMState *env, S1Translate *ptw,
             user_rw = ap_to_rw_prot_is_user(env, mmu_idx, ap, domain_prot, 1);
         }
         if (arm_is_sprr_enabled(env)) {
-            prot_rw = pte_to_sprr_prot(env, ap, xn, pxn) & (PAGE_READ | PAGE_WRITE);
-            pxn = !(pte_to_sprr_prot(env, ap, xn, pxn) & PAGE_EXEC);
+            int sprr_prot = pte_to_sprr_prot(env, mmu_idx, ap, xn, pxn);
+
+            prot_rw = sprr_prot & (PAGE_READ | PAGE_WRITE);
+            pxn = !(sprr_prot & PAGE_EXEC);
         }
 
         result->f.prot = get_S1prot(env, mmu_idx, false, user_rw, prot_rw,
@@ -2214,8 +2227,10 @@ static bool get_phys_addr_lpae(CPUARMState *env, S1Translate *ptw,
 
         user_rw = simple_ap_to_rw_prot_is_user(ap, true);
         if (arm_is_sprr_enabled(env)) {
-            prot_rw = pte_to_sprr_prot(env, ap, xn, pxn) & (PAGE_READ | PAGE_WRITE);
-            xn = pxn = !(pte_to_sprr_prot(env, ap, xn, pxn) & PAGE_EXEC);
+            int sprr_prot = pte_to_sprr_prot(env, mmu_idx, ap, xn, pxn);
+
+            prot_rw = sprr_prot & (PAGE_READ | PAGE_WRITE);
+            xn = pxn = !(sprr_prot & PAGE_EXEC);
         } else {
             prot_rw = simple_ap_to_rw_prot_is_user(ap, false);
         }
@@ -2230,8 +2245,8 @@ static bool get_phys_addr_lpae(CPUARMState *env, S1Translate *ptw,
         if (access_type == MMU_INST_FETCH) {
             if (arm_is_sprr_enabled(env) && !arm_is_guarded(env)) {
                 if (!(result->f.prot & (1 << access_type))) {
-                    int gl_prot = pte_to_sprr_prot_is_guarded(env, ap, xn,
-                                                                 pxn, true);
+                    int gl_prot = pte_to_sprr_prot_is_guarded(env, mmu_idx, ap,
+                                                                 xn, pxn, true);
                     if (gl_prot & (1 << access_type)) {
                         fi->type = ARMFault_GXF_Abort;
                         goto do_fault;
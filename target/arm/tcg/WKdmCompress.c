@@ -1,4 +1,32 @@
 #include "WKdm_internal.h"
+#include "qemu/cutils.h"
+
+/*
+ * Zero words never touch the dictionary (it is never loaded with zero),
+ * so whole blocks of them can be tagged without running the model.
+ */
+#define WK_BLOCK_WORDS 8
+
+static inline bool WK_block_is_zero(const WK_word *block)
+{
+    WK_word acc = 0;
+
+    for (int i = 0; i < WK_BLOCK_WORDS; i++) {
+        acc |= block[i];
+    }
+    return acc == 0;
+}
+
+static bool WK_all_words_equal(const WK_word *buf, unsigned int num_words,
+                               WK_word value)
+{
+    WK_word acc = 0;
+
+    for (unsigned int i = 0; i < num_words; i++) {
+        acc |= buf[i] ^ value;
+    }
+    return acc == 0;
+}
 
 /*
  * WK_pack_2bits()
@@ -129,42 +157,72 @@ unsigned int WKdm_compress(WK_word *src_buf, WK_word *dest_buf, int byte_budget)
     next_full_patt = dest_buf + TAGS_AREA_OFFSET + (num_input_words / 16);
     start_next_full_patt = next_full_patt;
 
-    while (next_input_word < end_of_input) {
-        WK_word *dict_location;
-        WK_word dict_word;
-        WK_word input_word = *next_input_word;
+    /*
+     * Zero and single-value pages are the bulk of what the compressor
+     * pager sees. Answer them from a vectorised scan, with the same result
+     * and side effects the model below would produce. A page of ones is
+     * all exact matches against the preloaded dictionary and is not a
+     * single-value page for the model, so it takes the normal path.
+     */
+    if (buffer_is_zero(src_buf, TARGET_PAGE_SIZE)) {
+        return SV_RETURN;
+    }
+    if (src_buf[0] != 1 &&
+        WK_all_words_equal(src_buf, num_input_words, src_buf[0])) {
+        if (HIGH_BITS(src_buf[0]) != HIGH_BITS(1)) {
+            /* Recorded as one miss followed by exact matches */
+            if (byte_budget < 4) {
+                return -1;
+            }
+            *next_full_patt = src_buf[0];
+        }
+        return SV_RETURN;
+    }
 
-        /*
-         * compute hash value, which is a byte offset into the dictionary,
-         * and add it to the base address of the dictionary. Cast back and
-         * forth to/from char * so no shifts are needed
-         */
-        dict_location =
-            (WK_word *)((void *)(((char *)dictionary) +
-                                 HASH_TO_DICT_BYTE_OFFSET(input_word)));
-
-        dict_word = *dict_location;
-
-        if (input_word == dict_word) {
-            RECORD_EXACT(dict_location - dictionary);
-        } else if (input_word == 0) {
-            RECORD_ZERO;
-        } else {
-            WK_word input_high_bits = HIGH_BITS(input_word);
-            if (input_high_bits == HIGH_BITS(dict_word)) {
-                RECORD_PARTIAL(dict_location - dictionary,
-                               LOW_BITS(input_word));
-                *dict_location = input_word;
+    for (; next_input_word < end_of_input;
+         next_input_word += WK_BLOCK_WORDS) {
+        if (WK_block_is_zero(next_input_word)) {
+            memset(next_tag, ZERO_TAG, WK_BLOCK_WORDS);
+            next_tag += WK_BLOCK_WORDS;
+            continue;
+        }
+
+        for (int i = 0; i < WK_BLOCK_WORDS; i++) {
+            WK_word *dict_location;
+            WK_word dict_word;
+            WK_word input_word = next_input_word[i];
+
+            /*
+             * compute hash value, which is a byte offset into the dictionary,
+             * and add it to the base address of the dictionary. Cast back
+             * and forth to/from char * so no shifts are needed
+             */
+            dict_location =
+                (WK_word *)((void *)(((char *)dictionary) +
+                                     HASH_TO_DICT_BYTE_OFFSET(input_word)));
+
+            dict_word = *dict_location;
+
+            if (input_word == dict_word) {
+                RECORD_EXACT(dict_location - dictionary);
+            } else if (input_word == 0) {
+                RECORD_ZERO;
             } else {
-                byte_budget -= 4;
-                if (byte_budget < 0) {
-                    return -1;
+                WK_word input_high_bits = HIGH_BITS(input_word);
+                if (input_high_bits == HIGH_BITS(dict_word)) {
+                    RECORD_PARTIAL(dict_location - dictionary,
+                                   LOW_BITS(input_word));
+                    *dict_location = input_word;
+                } else {
+                    byte_budget -= 4;
+                    if (byte_budget < 0) {
+                        return -1;
+                    }
+                    RECORD_MISS(input_word);
+                    *dict_location = input_word;
                 }
-                RECORD_MISS(input_word);
-                *dict_location = input_word;
             }
         }
-        next_input_word++;
     }
 
     if (byte_budget < 0) {
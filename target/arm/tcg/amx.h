@@ -0,0 +1,52 @@
+/*
+ * Apple AMX coprocessor
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+
+#ifndef TARGET_ARM_AMX_H
+#define TARGET_ARM_AMX_H
+
+/*
+ * AMX instructions live in the Apple-private 0x00201000 space: bits [9:5]
+ * select the operation and bits [4:0] the GPR holding its 64-bit operand,
+ * except for AMX_OP_SET_CLR where they are an immediate.
+ */
+#define AMX_INSN_OPCODE 4
+
+enum {
+    AMX_OP_LDX = 0,
+    AMX_OP_LDY = 1,
+    AMX_OP_STX = 2,
+    AMX_OP_STY = 3,
+    AMX_OP_LDZ = 4,
+    AMX_OP_STZ = 5,
+    AMX_OP_LDZI = 6,
+    AMX_OP_STZI = 7,
+    AMX_OP_EXTRX = 8,
+    AMX_OP_EXTRY = 9,
+    AMX_OP_FMA64 = 10,
+    AMX_OP_FMS64 = 11,
+    AMX_OP_FMA32 = 12,
+    AMX_OP_FMS32 = 13,
+    AMX_OP_MAC16 = 14,
+    AMX_OP_FMA16 = 15,
+    AMX_OP_FMS16 = 16,
+    AMX_OP_SET_CLR = 17,
+};
+
+#define AMX_SET 0
+#define AMX_CLR 1
+
+/* AMX_CTL_EL1: every AMX instruction is UNDEF unless AMX_CTL_EN is set */
+#define AMX_CTL_EN BIT_ULL(63)
+/* AMX_STATUS_EL1: the register file holds state since the last AMX set */
+#define AMX_STATUS_ACTIVE BIT_ULL(63)
+
+static inline bool amx_op_supported(unsigned int op)
+{
+    return op <= AMX_OP_SET_CLR && op != AMX_OP_LDZI && op != AMX_OP_STZI &&
+           op != AMX_OP_EXTRX && op != AMX_OP_EXTRY;
+}
+
+#endif /* TARGET_ARM_AMX_H */
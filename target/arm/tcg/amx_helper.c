@@ -0,0 +1,390 @@
+/*
+ * Apple AMX coprocessor helpers
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+
+#include "qemu/osdep.h"
+#include <math.h>
+#include "qemu/log.h"
+#include "cpu.h"
+#include "internals.h"
+#include "exec/helper-proto.h"
+#include "accel/tcg/cpu-ldst.h"
+#include "accel/tcg/probe.h"
+#include "exec/target_page.h"
+#include "fpu/softfloat.h"
+#include "target/arm/trace.h"
+#include "amx.h"
+
+#ifdef CONFIG_AVX2_OPT
+#include <immintrin.h>
+#include "host/cpuinfo.h"
+#endif
+
+#define AMX_REG_BYTES 64
+#define AMX_POOL_BYTES (8 * AMX_REG_BYTES)
+
+/* Operand fields, using the M1 layout */
+#define AMX_LDST_PAIR BIT_ULL(62)
+#define AMX_FMA_VECTOR BIT_ULL(63)
+#define AMX_FMA_SKIP_Z BIT_ULL(27)
+/* Lane masking, skipped X/Y inputs and mixed-width modes */
+#define AMX_FMA_UNSUPPORTED \
+    (MAKE_64BIT_MASK(28, 2) | MAKE_64BIT_MASK(32, 31))
+
+static uint64_t amx_ptr(uint64_t operand)
+{
+    return sextract64(operand, 0, 56);
+}
+
+static void amx_load(CPUARMState *env, uint64_t addr, uint8_t *dst,
+                     uintptr_t ra)
+{
+    int mmu_idx = arm_env_mmu_index(env);
+    void *host = NULL;
+
+    if ((addr & ~TARGET_PAGE_MASK) + AMX_REG_BYTES <= TARGET_PAGE_SIZE) {
+        host = probe_access(env, addr, AMX_REG_BYTES, MMU_DATA_LOAD, mmu_idx,
+                            ra);
+    }
+    if (host != NULL) {
+        memcpy(dst, host, AMX_REG_BYTES);
+        return;
+    }
+
+    for (int i = 0; i < AMX_REG_BYTES; i += 8) {
+        stq_le_p(dst + i, cpu_ldq_le_mmuidx_ra(env, addr + i, mmu_idx, ra));
+    }
+}
+
+static void amx_store(CPUARMState *env, uint64_t addr, const uint8_t *src,
+                      uintptr_t ra)
+{
+    int mmu_idx = arm_env_mmu_index(env);
+    void *host = NULL;
+
+    if ((addr & ~TARGET_PAGE_MASK) + AMX_REG_BYTES <= TARGET_PAGE_SIZE) {
+        host = probe_access(env, addr, AMX_REG_BYTES, MMU_DATA_STORE, mmu_idx,
+                            ra);
+    }
+    if (host != NULL) {
+        memcpy(host, src, AMX_REG_BYTES);
+        return;
+    }
+
+    for (int i = 0; i < AMX_REG_BYTES; i += 8) {
+        cpu_stq_le_mmuidx_ra(env, addr + i, ldq_le_p(src + i), mmu_idx, ra);
+    }
+}
+
+/* ldx/ldy/stx/sty: bits [58:56] pick the register, bit 62 a pair */
+static void amx_ldst_xy(CPUARMState *env, uint8_t regs[8][AMX_REG_BYTES],
+                        uint64_t operand, bool store, uintptr_t ra)
+{
+    uint64_t addr = amx_ptr(operand);
+    unsigned int reg = extract64(operand, 56, 3);
+    int count = (operand & AMX_LDST_PAIR) ? 2 : 1;
+
+    for (int i = 0; i < count; i++) {
+        uint8_t *r = regs[(reg + i) & 7];
+
+        if (store) {
+            amx_store(env, addr + i * AMX_REG_BYTES, r, ra);
+        } else {
+            amx_load(env, addr + i * AMX_REG_BYTES, r, ra);
+        }
+    }
+}
+
+/* ldz/stz: bits [61:56] pick the Z row, bit 62 a pair */
+static void amx_ldst_z(CPUARMState *env, uint64_t operand, bool store,
+                       uintptr_t ra)
+{
+    uint64_t addr = amx_ptr(operand);
+    unsigned int row = extract64(operand, 56, 6);
+    int count = (operand & AMX_LDST_PAIR) ? 2 : 1;
+
+    for (int i = 0; i < count; i++) {
+        uint8_t *r = env->amx.z[(row + i) & 63];
+
+        if (store) {
+            amx_store(env, addr + i * AMX_REG_BYTES, r, ra);
+        } else {
+            amx_load(env, addr + i * AMX_REG_BYTES, r, ra);
+        }
+    }
+}
+
+/* X and Y operands are 64 bytes at any byte offset, wrapping in the pool */
+static void amx_gather(uint8_t regs[8][AMX_REG_BYTES], unsigned int offset,
+                       uint8_t *dst)
+{
+    uint8_t *pool = &regs[0][0];
+    unsigned int first = MIN(AMX_REG_BYTES, AMX_POOL_BYTES - offset);
+
+    memcpy(dst, pool + offset, first);
+    memcpy(dst + first, pool, AMX_REG_BYTES - first);
+}
+
+static inline float amx_ld_f32(const uint8_t *p)
+{
+    uint32_t v = ldl_le_p(p);
+    float f;
+
+    memcpy(&f, &v, sizeof(f));
+    return f;
+}
+
+static inline void amx_st_f32(uint8_t *p, float f)
+{
+    uint32_t v;
+
+    memcpy(&v, &f, sizeof(v));
+    stl_le_p(p, v);
+}
+
+static inline double amx_ld_f64(const uint8_t *p)
+{
+    uint64_t v = ldq_le_p(p);
+    double d;
+
+    memcpy(&d, &v, sizeof(d));
+    return d;
+}
+
+static inline void amx_st_f64(uint8_t *p, double d)
+{
+    uint64_t v;
+
+    memcpy(&v, &d, sizeof(v));
+    stq_le_p(p, v);
+}
+
+static inline float amx_fma_f32(float a, float b, float c, float_status *s)
+{
+    return fmaf(a, b, c);
+}
+
+static inline double amx_fma_f64(double a, double b, double c,
+                                 float_status *s)
+{
+    return fma(a, b, c);
+}
+
+static inline float16 amx_fma_f16(float16 a, float16 b, float16 c,
+                                  float_status *s)
+{
+    return float16_muladd(a, b, c, 0, s);
+}
+
+static inline uint16_t amx_mac_i16(uint16_t a, uint16_t b, uint16_t c,
+                                   float_status *s)
+{
+    return c + (uint32_t)a * b;
+}
+
+#define amx_neg_f32(x) (-(x))
+#define amx_neg_f64(x) (-(x))
+#define amx_neg_f16(x) float16_chs(x)
+#define amx_neg_i16(x) (x)
+
+/* z[i] = x[i] * y[i] + z[i] across one 64-byte row */
+#define DO_AMX_ROW(NAME, TYPE, ESIZE, MULADD)                                \
+static void NAME(TYPE *z, const TYPE *x, const TYPE *y, float_status *s)    \
+{                                                                           \
+    for (int i = 0; i < AMX_REG_BYTES / ESIZE; i++) {                       \
+        z[i] = MULADD(x[i], y[i], z[i], s);                                 \
+    }                                                                       \
+}
+
+DO_AMX_ROW(amx_row_f64_c, double, 8, amx_fma_f64)
+DO_AMX_ROW(amx_row_f32_c, float, 4, amx_fma_f32)
+DO_AMX_ROW(amx_row_f16, float16, 2, amx_fma_f16)
+DO_AMX_ROW(amx_row_i16, uint16_t, 2, amx_mac_i16)
+
+#ifdef CONFIG_AVX2_OPT
+/*
+ * Without -mfma, fma() and fmaf() are libm calls per element. Hosts with
+ * FMA3 do a whole row in two fused multiply-adds, which round once just
+ * like the C versions.
+ */
+static void __attribute__((target("avx2,fma")))
+amx_row_f64_fma(double *z, const double *x, const double *y)
+{
+    for (int i = 0; i < AMX_REG_BYTES / 8; i += 4) {
+        __m256d v = _mm256_fmadd_pd(_mm256_loadu_pd(x + i),
+                                    _mm256_loadu_pd(y + i),
+                                    _mm256_loadu_pd(z + i));
+        _mm256_storeu_pd(z + i, v);
+    }
+}
+
+static void __attribute__((target("avx2,fma")))
+amx_row_f32_fma(float *z, const float *x, const float *y)
+{
+    for (int i = 0; i < AMX_REG_BYTES / 4; i += 8) {
+        __m256 v = _mm256_fmadd_ps(_mm256_loadu_ps(x + i),
+                                   _mm256_loadu_ps(y + i),
+                                   _mm256_loadu_ps(z + i));
+        _mm256_storeu_ps(z + i, v);
+    }
+}
+#endif
+
+static void amx_row_f64(double *z, const double *x, const double *y,
+                        float_status *s)
+{
+#ifdef CONFIG_AVX2_OPT
+    if (cpuinfo & CPUINFO_FMA) {
+        amx_row_f64_fma(z, x, y);
+        return;
+    }
+#endif
+    amx_row_f64_c(z, x, y, s);
+}
+
+static void amx_row_f32(float *z, const float *x, const float *y,
+                        float_status *s)
+{
+#ifdef CONFIG_AVX2_OPT
+    if (cpuinfo & CPUINFO_FMA) {
+        amx_row_f32_fma(z, x, y);
+        return;
+    }
+#endif
+    amx_row_f32_c(z, x, y, s);
+}
+
+/*
+ * Z += X * Y (or Z -= X * Y). In matrix mode every X lane is multiplied
+ * with every Y lane, and result row j lands in Z row
+ * j * ESIZE + (zrow % ESIZE). In vector mode X and Y are multiplied
+ * lane-wise into the single row zrow. The f32/f64 rows use the host FPU,
+ * with FMA3 kernels when the host has them; f16 goes through softfloat.
+ */
+#define DO_AMX_FMA(NAME, TYPE, ESIZE, LD, ST, ROW, NEG)                      \
+static void NAME(CPUARMState *env, uint64_t operand, bool sub)              \
+{                                                                           \
+    enum { N = AMX_REG_BYTES / ESIZE };                                     \
+    uint8_t xb[AMX_REG_BYTES], yb[AMX_REG_BYTES];                           \
+    unsigned int zrow = extract64(operand, 20, 6);                          \
+    bool skip_z = operand & AMX_FMA_SKIP_Z;                                 \
+    float_status fpst = { };                                                \
+    TYPE x[N], y[N], z[N];                                                  \
+                                                                            \
+    arm_set_default_fp_behaviours(&fpst);                                   \
+    set_default_nan_mode(true, &fpst);                                      \
+    amx_gather(env->amx.x, extract64(operand, 10, 9), xb);                  \
+    amx_gather(env->amx.y, extract64(operand, 0, 9), yb);                   \
+    for (int i = 0; i < N; i++) {                                           \
+        x[i] = LD(xb + i * ESIZE);                                          \
+        x[i] = sub ? NEG(x[i]) : x[i];                                      \
+        y[i] = LD(yb + i * ESIZE);                                          \
+    }                                                                       \
+                                                                            \
+    if (operand & AMX_FMA_VECTOR) {                                         \
+        uint8_t *zb = env->amx.z[zrow];                                     \
+                                                                            \
+        for (int i = 0; i < N; i++) {                                       \
+            z[i] = skip_z ? 0 : LD(zb + i * ESIZE);                         \
+        }                                                                   \
+        ROW(z, x, y, &fpst);                                                \
+        for (int i = 0; i < N; i++) {                                       \
+            ST(zb + i * ESIZE, z[i]);                                       \
+        }                                                                   \
+        return;                                                             \
+    }                                                                       \
+                                                                            \
+    for (int j = 0; j < N; j++) {                                           \
+        uint8_t *zb = env->amx.z[j * ESIZE + (zrow & (ESIZE - 1))];         \
+        TYPE yj[N];                                                         \
+                                                                            \
+        for (int i = 0; i < N; i++) {                                       \
+            yj[i] = y[j];                                                   \
+            z[i] = skip_z ? 0 : LD(zb + i * ESIZE);                         \
+        }                                                                   \
+        ROW(z, x, yj, &fpst);                                               \
+        for (int i = 0; i < N; i++) {                                       \
+            ST(zb + i * ESIZE, z[i]);                                       \
+        }                                                                   \
+    }                                                                       \
+}
+
+DO_AMX_FMA(amx_fma64, double, 8, amx_ld_f64, amx_st_f64, amx_row_f64,
+           amx_neg_f64)
+DO_AMX_FMA(amx_fma32, float, 4, amx_ld_f32, amx_st_f32, amx_row_f32,
+           amx_neg_f32)
+DO_AMX_FMA(amx_fma16, float16, 2, lduw_le_p, stw_le_p, amx_row_f16,
+           amx_neg_f16)
+DO_AMX_FMA(amx_mac16, uint16_t, 2, lduw_le_p, stw_le_p, amx_row_i16,
+           amx_neg_i16)
+
+void HELPER(amx)(CPUARMState *env, uint32_t op, uint64_t operand)
+{
+    uintptr_t ra = GETPC();
+
+    trace_arm_amx_op(op, operand);
+
+    /* The kernel enables AMX on first use to switch its state lazily */
+    if (!(env->amx.ctl & AMX_CTL_EN)) {
+        trace_arm_amx_undef(op, env->amx.ctl, env->amx.active);
+        raise_exception_ra(env, EXCP_UDEF, syn_uncategorized(),
+                           exception_target_el(env), ra);
+    }
+
+    if (op == AMX_OP_SET_CLR) {
+        if (operand == AMX_SET) {
+            memset(env->amx.x, 0, sizeof(env->amx.x));
+            memset(env->amx.y, 0, sizeof(env->amx.y));
+            memset(env->amx.z, 0, sizeof(env->amx.z));
+        }
+        env->amx.active = operand == AMX_SET;
+        return;
+    }
+
+    if (!env->amx.active) {
+        trace_arm_amx_undef(op, env->amx.ctl, env->amx.active);
+        raise_exception_ra(env, EXCP_UDEF, syn_uncategorized(),
+                           exception_target_el(env), ra);
+    }
+
+    if (op >= AMX_OP_FMA64 && (operand & AMX_FMA_UNSUPPORTED)) {
+        qemu_log_mask(LOG_UNIMP,
+                      "AMX op %u: ignoring unsupported operand bits 0x%" PRIx64
+                      "\n",
+                      op, operand & AMX_FMA_UNSUPPORTED);
+    }
+
+    switch (op) {
+    case AMX_OP_LDX:
+    case AMX_OP_STX:
+        amx_ldst_xy(env, env->amx.x, operand, op == AMX_OP_STX, ra);
+        break;
+    case AMX_OP_LDY:
+    case AMX_OP_STY:
+        amx_ldst_xy(env, env->amx.y, operand, op == AMX_OP_STY, ra);
+        break;
+    case AMX_OP_LDZ:
+    case AMX_OP_STZ:
+        amx_ldst_z(env, operand, op == AMX_OP_STZ, ra);
+        break;
+    case AMX_OP_FMA64:
+    case AMX_OP_FMS64:
+        amx_fma64(env, operand, op == AMX_OP_FMS64);
+        break;
+    case AMX_OP_FMA32:
+    case AMX_OP_FMS32:
+        amx_fma32(env, operand, op == AMX_OP_FMS32);
+        break;
+    case AMX_OP_FMA16:
+    case AMX_OP_FMS16:
+        amx_fma16(env, operand, op == AMX_OP_FMS16);
+        break;
+    case AMX_OP_MAC16:
+        amx_mac16(env, operand, false);
+        break;
+    default:
+        g_assert_not_reached();
+    }
+}
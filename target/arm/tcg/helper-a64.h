@@ -149,3 +149,4 @@ DEF_HELPER_FLAGS_5(gvec_fmulx_idx_d, TCG_CALL_NO_RWG, void, ptr, ptr, ptr, fpst,
 
 DEF_HELPER_FLAGS_3(wkdmc, TCG_CALL_NO_WG, i64, env, i64, i64)
 DEF_HELPER_FLAGS_3(wkdmd, TCG_CALL_NO_WG, i64, env, i64, i64)
+DEF_HELPER_FLAGS_3(amx, TCG_CALL_NO_WG, void, env, i32, i64)
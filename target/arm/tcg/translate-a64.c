@@ -24,6 +24,7 @@
 #include "arm_ldst.h"
 #include "semihosting/semihost.h"
 #include "cpregs.h"
+#include "amx.h"
 
 static TCGv_i64 cpu_X[32];
 static TCGv_i64 cpu_pc;
@@ -10172,6 +10173,26 @@ static bool disas_apple_insn(DisasContext *s, uint32_t insn)
     rn = extract32(insn, 5, 5);
     rd = extract32(insn, 0, 5);
 
+    /* AMX is usable from EL0; rn is the operation, rd the operand GPR */
+    if (opcode == AMX_INSN_OPCODE && extract32(insn, 16, 15) == 0x20 &&
+        s->amx_active) {
+        if (!amx_op_supported(rn)) {
+            qemu_log_mask(LOG_UNIMP, "%s: unsupported AMX op %u\n", __func__,
+                          rn);
+            return false;
+        }
+        if (rn == AMX_OP_SET_CLR) {
+            if (rd > AMX_CLR) {
+                return false;
+            }
+            gen_helper_amx(tcg_env, tcg_constant_i32(rn),
+                           tcg_constant_i64(rd));
+        } else {
+            gen_helper_amx(tcg_env, tcg_constant_i32(rn), cpu_reg(s, rd));
+        }
+        return true;
+    }
+
     if (s->current_el == 0) {
         return false;
     }
@@ -10245,6 +10266,7 @@ static void aarch64_tr_init_disas_context(DisasContextBase *dcbase,
     dc->condjmp = 0;
     dc->pc_save = dc->base.pc_first;
     dc->gxf_active = arm_feature(env, ARM_FEATURE_GXF);
+    dc->amx_active = arm_feature(env, ARM_FEATURE_AMX);
     dc->aarch64 = true;
     dc->thumb = false;
     dc->sctlr_b = 0;